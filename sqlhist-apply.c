@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "sqlhist.h"
+
+/*
+ * Install compiled statements by writing to tracefs directly, instead
+ * of printing shell commands.
+ *
+ * Everything is written in dependency order: first the synthetic
+ * events (all in one write, as synthetic_events takes a command per
+ * line), then their filters and histograms, then the start histograms,
+ * and then the end histograms whose onmatch() refers to them. The
+ * commands for the same file are written through one open of that file.
+ * If any write fails, what was already installed is removed again, in
+ * reverse order.
+ *
+ * The commands are the spans from sqlhist_spans(), written straight
+ * out of the compiled statements.
+ *
+ * With SQLHIST_APPLY_DIR, a plain directory with a copy of the event
+ * formats stands in for tracefs, for testing: the files are created,
+ * and each command ends with a newline, as the echo commands that
+ * sqlhist prints would leave them.
+ */
+
+struct apply_step {
+	struct sqlhist_span	span;
+	bool			applied;
+};
+
+static int write_cmd(int fd, const struct iovec *cmd, unsigned int flags)
+{
+	struct iovec iov[2] = { *cmd, { .iov_base = "\n", .iov_len = 1 } };
+	int cnt = flags & SQLHIST_APPLY_DIR ? 2 : 1;
+	ssize_t w;
+
+	/* Each trigger command must arrive in a single write */
+	do {
+		w = writev(fd, iov, cnt);
+	} while (w < 0 && errno == EINTR);
+
+	if (w < 0)
+		return -1;
+	if (w != cmd->iov_len + cnt - 1) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Always append: opening synthetic_events with O_TRUNC would remove all
+ * synthetic events. Only a plain directory gets its files created, so
+ * that a bad event path in tracefs fails with ENOENT.
+ */
+static int open_file(const char *trace_dir, const char *path,
+		     unsigned int flags)
+{
+	int oflags = O_WRONLY | O_APPEND;
+	char *file;
+	int fd;
+
+	if (flags & SQLHIST_APPLY_DIR)
+		oflags |= O_CREAT;
+
+	if (asprintf(&file, "%s/%s", trace_dir, path) < 0)
+		return -1;
+	fd = open(file, oflags, 0644);
+	free(file);
+
+	return fd;
+}
+
+static void undo_step(const char *trace_dir, struct apply_step *step,
+		      unsigned int flags)
+{
+	struct iovec iov;
+	char *cmd;
+	int fd;
+	int len;
+
+	/* A synthetic event is removed by its name, the first word */
+	if (step->span.type == SQLHIST_SPAN_SYNTH)
+		len = asprintf(&cmd, "!%.*s",
+			       (int)strcspn(step->span.iov.iov_base, " "),
+			       (char *)step->span.iov.iov_base);
+	else if (step->span.type == SQLHIST_SPAN_FILTER)
+		len = asprintf(&cmd, "0");
+	else
+		len = asprintf(&cmd, "!%.*s", (int)step->span.iov.iov_len,
+			       (char *)step->span.iov.iov_base);
+	if (len < 0)
+		return;
+
+	iov.iov_base = cmd;
+	iov.iov_len = len;
+
+	fd = open_file(trace_dir, step->span.path, flags);
+	if (fd >= 0) {
+		/* Nothing more can be done if removing it fails */
+		write_cmd(fd, &iov, flags);
+		close(fd);
+	}
+	free(cmd);
+}
+
+/* A synthetic event can not be removed while a trigger still uses it */
+static void rollback(const char *trace_dir, struct apply_step *steps, int nr,
+		     unsigned int flags)
+{
+	int phase;
+	int i;
+
+	for (phase = SQLHIST_SPAN_END; phase >= SQLHIST_SPAN_SYNTH; phase--) {
+		for (i = nr - 1; i >= 0; i--) {
+			if (steps[i].span.type == phase && steps[i].applied)
+				undo_step(trace_dir, &steps[i], flags);
+		}
+	}
+}
+
+/* All the synthetic event definitions go out in one write */
+static int apply_synth(const char *trace_dir, struct apply_step *steps, int nr,
+		       unsigned int flags)
+{
+	struct iovec iov;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+	int ret = 0;
+	int fd;
+	int i;
+
+	fp = open_memstream(&buf, &size);
+	if (!fp)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		if (steps[i].span.type != SQLHIST_SPAN_SYNTH)
+			continue;
+		fwrite(steps[i].span.iov.iov_base, 1,
+		       steps[i].span.iov.iov_len, fp);
+		fputc('\n', fp);
+	}
+	fclose(fp);
+
+	if (!size)
+		goto out;
+
+	fd = open_file(trace_dir, "synthetic_events", flags);
+	if (fd < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	/*
+	 * The kernel adds the lines one at a time, so even a failed
+	 * write may have added some of them. Mark them all for removal.
+	 */
+	for (i = 0; i < nr; i++) {
+		if (steps[i].span.type == SQLHIST_SPAN_SYNTH)
+			steps[i].applied = true;
+	}
+
+	/* The definitions already end with a newline each */
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	ret = write_cmd(fd, &iov, flags & ~SQLHIST_APPLY_DIR);
+	close(fd);
+ out:
+	free(buf);
+	return ret;
+}
+
+static int apply_triggers(const char *trace_dir, struct apply_step *steps,
+			  int nr, enum sqlhist_span_type phase,
+			  unsigned int flags)
+{
+	bool *done;
+	int ret = 0;
+	int fd;
+	int i, j;
+
+	done = calloc(nr, sizeof(*done));
+	if (!done)
+		return -1;
+
+	for (i = 0; i < nr && !ret; i++) {
+		if (steps[i].span.type != phase || done[i])
+			continue;
+
+		fd = open_file(trace_dir, steps[i].span.path, flags);
+		if (fd < 0) {
+			ret = -1;
+			break;
+		}
+
+		for (j = i; j < nr; j++) {
+			if (steps[j].span.type != phase || done[j] ||
+			    strcmp(steps[j].span.path, steps[i].span.path) != 0)
+				continue;
+			done[j] = true;
+			ret = write_cmd(fd, &steps[j].span.iov, flags);
+			if (ret < 0)
+				break;
+			steps[j].applied = true;
+		}
+		close(fd);
+	}
+
+	free(done);
+	return ret;
+}
+
+/**
+ * sqlhist_apply_list_flags - install several compiled statements
+ * @sqlhists: The compiled statements
+ * @nr: The number of @sqlhists
+ * @flags: SQLHIST_APPLY_DIR to install into a plain directory (for tests)
+ *
+ * Writes the synthetic events and histogram triggers of all @sqlhists
+ * to the tracefs directory they were compiled against. Either all of
+ * them are installed, or on failure whatever was written is removed.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+int sqlhist_apply_list_flags(struct sqlhist **sqlhists, int nr,
+			     unsigned int flags)
+{
+	struct apply_step *steps;
+	struct sqlhist_span *spans;
+	const char *trace_dir;
+	int nr_spans = 0;
+	int nr_steps = 0;
+	int ret = 0;
+	int cnt;
+	int i;
+
+	if (!nr)
+		return 0;
+
+	trace_dir = sqlhist_trace_dir(sqlhists[0]);
+	for (i = 0; i < nr; i++) {
+		if (!sqlhist_start_event(sqlhists[i]) ||
+		    !sqlhist_trace_dir(sqlhists[i]) ||
+		    strcmp(sqlhist_trace_dir(sqlhists[i]), trace_dir) != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		nr_spans += sqlhist_spans(sqlhists[i], NULL, 0);
+	}
+
+	steps = calloc(nr_spans, sizeof(*steps));
+	spans = calloc(nr_spans, sizeof(*spans));
+	if (!steps || !spans) {
+		free(steps);
+		free(spans);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		cnt = sqlhist_spans(sqlhists[i], spans + nr_steps,
+				    nr_spans - nr_steps);
+		nr_steps += cnt;
+	}
+	for (i = 0; i < nr_steps; i++)
+		steps[i].span = spans[i];
+	free(spans);
+
+	ret = apply_synth(trace_dir, steps, nr_steps, flags);
+	if (!ret)
+		ret = apply_triggers(trace_dir, steps, nr_steps,
+				     SQLHIST_SPAN_FILTER, flags);
+	if (!ret)
+		ret = apply_triggers(trace_dir, steps, nr_steps,
+				     SQLHIST_SPAN_SYNTH_HIST, flags);
+	if (!ret)
+		ret = apply_triggers(trace_dir, steps, nr_steps,
+				     SQLHIST_SPAN_START, flags);
+	if (!ret)
+		ret = apply_triggers(trace_dir, steps, nr_steps,
+				     SQLHIST_SPAN_END, flags);
+
+	if (ret < 0) {
+		int err = errno;
+
+		rollback(trace_dir, steps, nr_steps, flags);
+		errno = err;
+	}
+
+	free(steps);
+	return ret;
+}
+
+/**
+ * sqlhist_apply_list - install several compiled statements into tracefs
+ * @sqlhists: The compiled statements
+ * @nr: The number of @sqlhists
+ *
+ * Same as sqlhist_apply_list_flags() without any flags.
+ */
+int sqlhist_apply_list(struct sqlhist **sqlhists, int nr)
+{
+	return sqlhist_apply_list_flags(sqlhists, nr, 0);
+}
+
+/**
+ * sqlhist_apply - install a compiled statement
+ * @sqlhist: The compiled statement
+ *
+ * Same as sqlhist_apply_list() for a single statement.
+ */
+int sqlhist_apply(struct sqlhist *sqlhist)
+{
+	return sqlhist_apply_list(&sqlhist, 1);
+}
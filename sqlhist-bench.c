@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "sqlhist.h"
+
+/*
+ * Compile the same statement over and over from several threads at
+ * once, to show that sqlhist_parse() scales with the number of cores
+ * (and that every thread gets the same answer).
+ *
+ * First compare the startup cost of loading all the event formats from
+ * tracefs against loading only those the statement uses. With -c, also
+ * time mapping the saved catalog and then have the threads compile
+ * against that one shared catalog. With -C, also time a compile that
+ * is found in the compile cache. With -H, also time reading the rows
+ * of the statement out of a generated hist file of that many entries.
+ */
+
+struct bench_thread {
+	pthread_t		thread;
+	const char		*buffer;
+	const char		*trace_dir;
+	const char		*expect;
+	struct sqlhist_catalog	*catalog;
+	int			loops;
+	int			failed;
+};
+
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(-1);
+}
+
+static void usage(char **argv)
+{
+	printf("\nusage: %s [-t tracefs-path][-c catalog][-C cache-dir][-H entries][-j max-threads][-n loops] file\n"
+	       " -t : Path to tracefs directory\n"
+	       " -c : Catalog file to time startup with and compile against\n"
+	       " -C : Compile cache directory to time cached compiles with\n"
+	       " -H : Number of entries of a hist file to time reading the rows from\n"
+	       " -j : Maximum number of threads to run (default number of CPUs)\n"
+	       " -n : Number of compiles each thread does (default 1000)\n"
+	       "\n", argv[0]);
+	exit(-1);
+}
+
+static char *read_file(const char *file)
+{
+	char *buffer = NULL;
+	char buf[BUFSIZ];
+	size_t size = 0;
+	size_t r;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		die("Error opening: %s", file);
+	while ((r = fread(buf, 1, BUFSIZ, fp)) > 0) {
+		buffer = realloc(buffer, size + r + 1);
+		if (!buffer)
+			die("Out of memory");
+		memcpy(buffer + size, buf, r);
+		size += r;
+	}
+	fclose(fp);
+	if (!buffer)
+		die("Empty file: %s", file);
+	buffer[size] = '\0';
+	return buffer;
+}
+
+static struct sqlhist *compile(const char *buffer, const char *trace_dir,
+			       struct sqlhist_catalog *catalog)
+{
+	if (catalog)
+		return sqlhist_parse_catalog(buffer, catalog);
+
+	return sqlhist_parse(buffer, trace_dir);
+}
+
+static char *show(struct sqlhist *sqlhist)
+{
+	const char *synth = sqlhist_synth_event_def(sqlhist);
+	const char *end = sqlhist_end_hist(sqlhist);
+	char *str;
+
+	if (asprintf(&str, "%s\n%s\n%s\n", synth ? synth : "",
+		     sqlhist_start_hist(sqlhist), end ? end : "") < 0)
+		return NULL;
+	return str;
+}
+
+static void *run_thread(void *data)
+{
+	struct bench_thread *bt = data;
+	struct sqlhist *sqlhist;
+	char *str;
+	int i;
+
+	for (i = 0; i < bt->loops; i++) {
+		sqlhist = compile(bt->buffer, bt->trace_dir, bt->catalog);
+		if (!sqlhist || !sqlhist_start_hist(sqlhist)) {
+			bt->failed++;
+		} else {
+			str = show(sqlhist);
+			if (!str || strcmp(str, bt->expect) != 0)
+				bt->failed++;
+			free(str);
+		}
+		sqlhist_destroy(sqlhist);
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+#define STARTUP_LOOPS	10
+
+static double time_open(const char *trace_dir, const char *file)
+{
+	struct sqlhist_catalog *catalog;
+	double start = now();
+	int i;
+
+	for (i = 0; i < STARTUP_LOOPS; i++) {
+		catalog = sqlhist_catalog_open(trace_dir, file);
+		if (!catalog)
+			die("Failed to load event formats");
+		sqlhist_catalog_close(catalog);
+	}
+
+	return (now() - start) / STARTUP_LOOPS;
+}
+
+/* A whole sqlhist_parse(), which loads only the events @buffer uses */
+static double time_parse(const char *buffer, const char *trace_dir)
+{
+	struct sqlhist *sqlhist;
+	double start = now();
+	int i;
+
+	for (i = 0; i < STARTUP_LOOPS; i++) {
+		sqlhist = sqlhist_parse(buffer, trace_dir);
+		if (!sqlhist || !sqlhist_start_hist(sqlhist))
+			die("Failed to compile");
+		sqlhist_destroy(sqlhist);
+	}
+
+	return (now() - start) / STARTUP_LOOPS;
+}
+
+/* A compile that is a hit in the cache of @dir */
+static double time_cache(const char *buffer, const char *trace_dir,
+			 const char *dir)
+{
+	struct sqlhist_cache *cache;
+	struct sqlhist *sqlhist;
+	unsigned long hits, misses;
+	double start;
+	int i;
+
+	cache = sqlhist_cache_open(dir);
+	if (!cache)
+		die("Failed to open cache %s", dir);
+
+	/* The first one may have to fill the cache */
+	sqlhist = sqlhist_cache_parse(cache, buffer, trace_dir, NULL);
+	if (!sqlhist || !sqlhist_start_hist(sqlhist))
+		die("Failed to compile");
+	sqlhist_destroy(sqlhist);
+
+	start = now();
+	for (i = 0; i < STARTUP_LOOPS; i++) {
+		sqlhist = sqlhist_cache_parse(cache, buffer, trace_dir, NULL);
+		if (!sqlhist || !sqlhist_start_hist(sqlhist))
+			die("Failed to compile");
+		sqlhist_destroy(sqlhist);
+	}
+	start = (now() - start) / STARTUP_LOOPS;
+
+	sqlhist_cache_stats(cache, &hits, &misses);
+	if (hits < STARTUP_LOOPS)
+		die("Only %lu of %d compiles were found in the cache",
+		    hits, STARTUP_LOOPS);
+	sqlhist_cache_close(cache);
+
+	return start;
+}
+
+/*
+ * Compare loading every event format (cold), loading only the ones
+ * @buffer references (query, which includes the compile), with @file,
+ * mapping the saved catalog (warm) and with @cache_dir, finding the
+ * compiled statement in the cache (cached).
+ */
+static struct sqlhist_catalog *startup(const char *buffer,
+				       const char *trace_dir, const char *file,
+				       const char *cache_dir)
+{
+	struct sqlhist_catalog *catalog;
+	double cold, query, warm, cached;
+
+	/* Make sure the catalog file is up to date before timing it */
+	if (file) {
+		catalog = sqlhist_catalog_open(trace_dir, file);
+		if (!catalog)
+			die("Failed to load event formats");
+		sqlhist_catalog_close(catalog);
+	}
+
+	cold = time_open(trace_dir, NULL);
+	query = time_parse(buffer, trace_dir);
+
+	printf("%8s %12s\n", "startup", "msecs");
+	printf("%8s %12.3f\n", "cold", cold * 1000);
+	printf("%8s %12.3f\n", "query", query * 1000);
+
+	if (cache_dir) {
+		cached = time_cache(buffer, trace_dir, cache_dir);
+		printf("%8s %12.3f\n", "cached", cached * 1000);
+	}
+
+	if (!file) {
+		printf("\n");
+		return NULL;
+	}
+
+	warm = time_open(trace_dir, file);
+	printf("%8s %12.3f\n\n", "warm", warm * 1000);
+
+	catalog = sqlhist_catalog_open(trace_dir, file);
+	if (!catalog)
+		die("Failed to load event formats");
+	return catalog;
+}
+
+#define RESULT_LOOPS	10
+
+/*
+ * Writes a hist file with @entries entries in the section of the
+ * result histogram of @sqlhist, with made up values for its columns.
+ */
+static char *make_hist(struct sqlhist *sqlhist, int entries)
+{
+	const char *cols = sqlhist_result_cols(sqlhist);
+	const char *hist = sqlhist_result_hist(sqlhist);
+	char *fields, *field, *save;
+	char *file;
+	bool keys;
+	FILE *fp;
+	int fd;
+	int i;
+
+	if (!cols || !hist)
+		die("The rows of this statement are not in a histogram");
+
+	file = strdup("/tmp/sqlhist-bench-XXXXXX");
+	if (!file)
+		die("Out of memory");
+	fd = mkstemp(file);
+	if (fd < 0)
+		die("Failed to create %s", file);
+	fp = fdopen(fd, "w");
+	if (!fp)
+		die("Failed to write %s", file);
+
+	fprintf(fp, "# event histogram\n#\n# trigger info: %s [active]\n#\n\n",
+		hist);
+
+	for (i = 0; i < entries; i++) {
+		fields = strdup(cols);
+		if (!fields)
+			die("Out of memory");
+		keys = true;
+		fprintf(fp, "{");
+		for (field = strtok_r(fields, ",", &save); field;
+		     field = strtok_r(NULL, ",", &save)) {
+			field[strcspn(field, "=")] = '\0';
+			if (keys && strcmp(field, "hitcount") == 0) {
+				fprintf(fp, " }");
+				keys = false;
+			} else if (keys && field != fields) {
+				fprintf(fp, ",");
+			}
+			/* Sorted by the hitcount, like most of them are */
+			fprintf(fp, " %s: %10d", field,
+				strcmp(field, "hitcount") ? i : entries - i);
+		}
+		fprintf(fp, "\n");
+		free(fields);
+	}
+
+	fprintf(fp, "\nTotals:\n    Hits: %d\n    Entries: %d\n    Dropped: 0\n",
+		entries, entries);
+	if (fclose(fp))
+		die("Failed to write %s", file);
+
+	return file;
+}
+
+/* The rows with sqlhist_result_next() */
+static unsigned long long read_rows(struct sqlhist *sqlhist, const char *file)
+{
+	struct sqlhist_result *result;
+	struct sqlhist_col *cols;
+	unsigned long long rows = 0;
+	int fd;
+	int nr;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		die("Failed to open %s", file);
+	result = sqlhist_result_open_fd(sqlhist, fd);
+	if (!result)
+		die("Failed to find the rows in %s", file);
+	while ((nr = sqlhist_result_next(result, &cols)) > 0)
+		rows++;
+	if (nr < 0)
+		die("Failed to read the rows of %s", file);
+	sqlhist_result_close(result);
+
+	return rows;
+}
+
+/* The same rows with getline() and a strtoull() of every value */
+static unsigned long long read_lines(const char *file)
+{
+	unsigned long long rows = 0;
+	unsigned long long sum = 0;
+	char *line = NULL;
+	size_t size = 0;
+	char *p;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		die("Failed to open %s", file);
+	while (getline(&line, &size, fp) > 0) {
+		if (line[0] != '{')
+			continue;
+		for (p = line; (p = strchr(p, ':')); p++)
+			sum += strtoull(p + 1, NULL, 0);
+		rows++;
+	}
+	free(line);
+	fclose(fp);
+
+	/* Keep the values from being thrown away */
+	return sum ? rows : 0;
+}
+
+static void time_result(struct sqlhist *sqlhist, int entries)
+{
+	unsigned long long limit = sqlhist_limit(sqlhist);
+	unsigned long long expect = entries;
+	unsigned long long rows;
+	struct stat st;
+	double start, delta;
+	double mbytes;
+	char *file;
+	int i;
+
+	file = make_hist(sqlhist, entries);
+	if (stat(file, &st) < 0)
+		die("Failed to stat %s", file);
+	mbytes = st.st_size / (1024.0 * 1024.0);
+	if (limit && limit < expect)
+		expect = limit;
+
+	printf("\n%8s %12s %12s %14s %12s\n", "rows", "entries",
+	       "seconds", "rows/sec", "MB/sec");
+
+	start = now();
+	for (i = 0; i < RESULT_LOOPS; i++) {
+		rows = read_rows(sqlhist, file);
+		if (rows != expect)
+			die("Read %llu rows of %llu", rows, expect);
+	}
+	delta = (now() - start) / RESULT_LOOPS;
+	/* With a LIMIT, only the start of the file is read */
+	printf("%8s %12d %12.6f %14.1f %12.1f\n", "result", entries, delta,
+	       rows / delta, expect == entries ? mbytes / delta : 0.0);
+
+	start = now();
+	for (i = 0; i < RESULT_LOOPS; i++) {
+		rows = read_lines(file);
+		if (rows != entries)
+			die("Read %llu lines of %d", rows, entries);
+	}
+	delta = (now() - start) / RESULT_LOOPS;
+	printf("%8s %12d %12.6f %14.1f %12.1f\n", "getline", entries, delta,
+	       rows / delta, mbytes / delta);
+
+	unlink(file);
+	free(file);
+}
+
+int main (int argc, char **argv)
+{
+	struct sqlhist_catalog *catalog = NULL;
+	struct bench_thread *threads;
+	struct sqlhist *sqlhist;
+	char *trace_dir = NULL;
+	char *catalog_file = NULL;
+	char *cache_dir = NULL;
+	int hist_entries = 0;
+	char *buffer;
+	char *expect;
+	double start, delta;
+	int max_threads;
+	int loops = 1000;
+	int failed;
+	int nr;
+	int c;
+	int i;
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (;;) {
+		c = getopt(argc, argv, "ht:c:C:H:j:n:");
+		if (c == -1)
+			break;
+
+		switch(c) {
+		case 'h':
+			usage(argv);
+		case 't':
+			trace_dir = optarg;
+			break;
+		case 'c':
+			catalog_file = optarg;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'H':
+			hist_entries = atoi(optarg);
+			break;
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		}
+	}
+
+	if (argc == optind || max_threads < 1 || loops < 1 || hist_entries < 0)
+		usage(argv);
+
+	buffer = read_file(argv[optind]);
+
+	catalog = startup(buffer, trace_dir, catalog_file, cache_dir);
+
+	sqlhist = compile(buffer, trace_dir, catalog);
+	if (!sqlhist)
+		die("Error parsing sqlhist");
+	if (!sqlhist_start_hist(sqlhist))
+		die("Error:\n%s", sqlhist_error(sqlhist));
+	expect = show(sqlhist);
+	if (!expect)
+		die("Out of memory");
+
+	threads = calloc(max_threads, sizeof(*threads));
+	if (!threads)
+		die("Out of memory");
+
+	printf("%8s %12s %14s\n", "threads", "seconds", "queries/sec");
+
+	for (nr = 1; ; nr *= 2) {
+		if (nr > max_threads)
+			nr = max_threads;
+
+		start = now();
+		for (i = 0; i < nr; i++) {
+			threads[i].buffer = buffer;
+			threads[i].trace_dir = trace_dir;
+			threads[i].expect = expect;
+			threads[i].catalog = catalog;
+			threads[i].loops = loops;
+			threads[i].failed = 0;
+			if (pthread_create(&threads[i].thread, NULL,
+					   run_thread, &threads[i]))
+				die("Failed to create thread");
+		}
+		failed = 0;
+		for (i = 0; i < nr; i++) {
+			pthread_join(threads[i].thread, NULL);
+			failed += threads[i].failed;
+		}
+		delta = now() - start;
+
+		printf("%8d %12.3f %14.1f", nr, delta, (nr * loops) / delta);
+		if (failed)
+			printf("  (%d mismatched)", failed);
+		printf("\n");
+
+		if (nr == max_threads)
+			break;
+	}
+
+	if (hist_entries)
+		time_result(sqlhist, hist_entries);
+
+	sqlhist_destroy(sqlhist);
+
+	sqlhist_catalog_close(catalog);
+	free(threads);
+	free(expect);
+	free(buffer);
+
+	return 0;
+}
@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_TRACEFS
+#include <tracefs/tracefs.h>
+#else
+#include "tracefs-stubs.h"
+#endif
+
+#include "sqlhist.h"
+#include "sqlhist-defs.h"
+#include "sqlhist-local.h"
+#include "sqlhist-catalog.h"
+
+/*
+ * A compile cache: the output of a statement is saved in a file named
+ * after the hash of the statement and the tracefs directory. The entry
+ * also lists the format files of the events the statement used with a
+ * hash of their content, and is only used if those still match. A hit
+ * needs neither the parser nor any event parsing.
+ *
+ * The hash also covers SQLHIST_CODEGEN_VERSION, and the pid_max and
+ * the number of CPUs that the :size= of a histogram is estimated from,
+ * so neither a new sqlhist nor another machine uses stale output.
+ *
+ * Statements are normalized by collapsing white space (outside of
+ * quotes). Case is kept, as labels and the field names are case
+ * sensitive.
+ */
+#define CACHE_MAGIC	"sqlhist-cache 3"
+
+struct sqlhist_cache {
+	char			*dir;
+	unsigned long		hits;
+	unsigned long		misses;
+};
+
+static const char *cache_keys[SQLHIST_NR_STRS] = {
+	[SQLHIST_START_EVENT]		= "start_event",
+	[SQLHIST_END_EVENT]		= "end_event",
+	[SQLHIST_SYNTH_EVENT]		= "synth_event",
+	[SQLHIST_SYNTH_EVENT_DEF]	= "synth_event_def",
+	[SQLHIST_START_HIST]		= "start_hist",
+	[SQLHIST_END_HIST]		= "end_hist",
+	[SQLHIST_START_PATH]		= "start_path",
+	[SQLHIST_END_PATH]		= "end_path",
+	[SQLHIST_SYNTH_FILTER]		= "synth_filter",
+	[SQLHIST_SYNTH_FILTER_PATH]	= "synth_filter_path",
+	[SQLHIST_SYNTH_HIST]		= "synth_hist",
+	[SQLHIST_SYNTH_HIST_PATH]	= "synth_hist_path",
+	[SQLHIST_STAGE_START_HISTS]	= "stage_start_hists",
+	[SQLHIST_STAGE_START_PATHS]	= "stage_start_paths",
+	[SQLHIST_STAGE_END_HISTS]	= "stage_end_hists",
+	[SQLHIST_STAGE_END_PATHS]	= "stage_end_paths",
+	[SQLHIST_FOLD_PATH]		= "fold_path",
+	[SQLHIST_FOLD_KEY]		= "fold_key",
+	[SQLHIST_FOLD_VALUE]		= "fold_value",
+	[SQLHIST_RESULT_PATH]		= "result_path",
+	[SQLHIST_LIMIT]			= "limit",
+	[SQLHIST_RESULT_COLS]		= "result_cols",
+	[SQLHIST_TRACE_DIR]		= "trace_dir",
+	[SQLHIST_FORMATS]		= "formats",
+};
+
+static char *normalize(const char *buffer)
+{
+	char *norm, *p;
+	char quote = 0;
+	bool space = false;
+
+	norm = malloc(strlen(buffer) + 1);
+	if (!norm)
+		return NULL;
+
+	for (p = norm; *buffer; buffer++) {
+		if (!quote && isspace((unsigned char)*buffer)) {
+			space = true;
+			continue;
+		}
+		if (space && p != norm)
+			*p++ = ' ';
+		space = false;
+		if (quote && *buffer == quote)
+			quote = 0;
+		else if (!quote && (*buffer == '"' || *buffer == '\''))
+			quote = *buffer;
+		*p++ = *buffer;
+	}
+	*p = '\0';
+
+	return norm;
+}
+
+static char *entry_path(struct sqlhist_cache *cache, const char *norm,
+			const char *trace_dir)
+{
+	unsigned long long sys[] = {
+		SQLHIST_CODEGEN_VERSION,
+		sqlhist_pid_max(),
+		sqlhist_nr_cpus(),
+	};
+	uint64_t hash = CATALOG_HASH_INIT;
+	char *path;
+
+	hash = catalog_hash(hash, norm, strlen(norm) + 1);
+	hash = catalog_hash(hash, trace_dir, strlen(trace_dir) + 1);
+	hash = catalog_hash(hash, sys, sizeof(sys));
+
+	if (asprintf(&path, "%s/%016" PRIx64, cache->dir, hash) < 0)
+		return NULL;
+	return path;
+}
+
+static int hash_format(uint64_t *hash, const char *trace_dir,
+		       const char *format)
+{
+	char *path;
+	int ret;
+
+	if (asprintf(&path, "%s/%s", trace_dir, format) < 0)
+		return -1;
+	*hash = CATALOG_HASH_INIT;
+	ret = catalog_hash_file(hash, path);
+	free(path);
+
+	return ret;
+}
+
+static char *read_entry(const char *path, size_t *size)
+{
+	struct stat st;
+	char *buf;
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0)
+		goto fail;
+
+	buf = malloc(st.st_size + 1);
+	if (!buf)
+		goto fail;
+
+	r = read(fd, buf, st.st_size);
+	close(fd);
+
+	if (r != st.st_size) {
+		free(buf);
+		return NULL;
+	}
+	buf[r] = '\0';
+	*size = r;
+	return buf;
+ fail:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * An entry is a list of "<key> <len>\n<value>\n" records. The values of
+ * the "format" records are "<hash> <path>". The values are terminated in
+ * place, so the entry itself becomes the output of the sqlhist. The
+ * values of the stage lists have '\0's of their own.
+ */
+static char *next_record(char **pos, const char *buf_end, char **key,
+			 size_t *len)
+{
+	char *p = *pos;
+	char *end;
+	char *val;
+
+	end = strchr(p, ' ');
+	if (!end)
+		return NULL;
+	*end = '\0';
+	*key = p;
+
+	*len = strtoul(end + 1, &val, 10);
+	if (*val != '\n')
+		return NULL;
+	val++;
+	if ((size_t)(buf_end - val) < *len + 1 || val[*len] != '\n')
+		return NULL;
+	val[*len] = '\0';
+	*pos = val + *len + 1;
+
+	return val;
+}
+
+static struct sqlhist *load_entry(char *buf, size_t size, const char *norm,
+				  const char *trace_dir)
+{
+	const char *end = buf + size;
+	struct sqlhist *sqlhist;
+	char *pos = buf;
+	char *key, *val, *format;
+	uint64_t hash, old;
+	size_t len;
+	bool sql = false;
+	int i;
+
+	if (strncmp(pos, CACHE_MAGIC "\n", strlen(CACHE_MAGIC) + 1) != 0)
+		goto fail_free;
+	pos += strlen(CACHE_MAGIC) + 1;
+
+	sqlhist = calloc(1, sizeof(*sqlhist));
+	if (!sqlhist)
+		goto fail_free;
+	sqlhist->output = buf;
+
+	while (pos < end) {
+		val = next_record(&pos, end, &key, &len);
+		if (!val)
+			goto fail;
+
+		if (strcmp(key, "sql") == 0) {
+			/* A different statement with the same hash */
+			if (strcmp(val, norm) != 0)
+				goto fail;
+			sql = true;
+			continue;
+		}
+
+		if (strcmp(key, "max_entries") == 0) {
+			sqlhist->max_entries = strtoull(val, NULL, 10);
+			continue;
+		}
+
+		if (strcmp(key, "format") == 0) {
+			old = strtoull(val, &format, 16);
+			if (*format != ' ' ||
+			    hash_format(&hash, trace_dir, format + 1) < 0 ||
+			    hash != old)
+				goto fail;
+			continue;
+		}
+
+		for (i = 0; i < SQLHIST_NR_STRS; i++) {
+			if (strcmp(key, cache_keys[i]) == 0)
+				break;
+		}
+		if (i == SQLHIST_NR_STRS || sqlhist->strs[i])
+			goto fail;
+		sqlhist->strs[i] = val;
+		sqlhist->lens[i] = len;
+	}
+
+	if (!sql || !sqlhist->strs[SQLHIST_START_HIST] ||
+	    !sqlhist->strs[SQLHIST_TRACE_DIR] ||
+	    strcmp(sqlhist->strs[SQLHIST_TRACE_DIR], trace_dir) != 0)
+		goto fail;
+
+	return sqlhist;
+ fail:
+	sqlhist_destroy(sqlhist);
+	return NULL;
+ fail_free:
+	free(buf);
+	return NULL;
+}
+
+static void write_record(FILE *fp, const char *key, const char *val,
+			 size_t len)
+{
+	fprintf(fp, "%s %zu\n", key, len);
+	fwrite(val, 1, len, fp);
+	fputc('\n', fp);
+}
+
+static void save_entry(const char *path, const char *norm,
+		       struct sqlhist *sqlhist)
+{
+	char *formats = NULL;
+	char *format, *next;
+	char *record;
+	char *tmp;
+	uint64_t hash;
+	FILE *fp;
+	int len;
+	int fd;
+	int i;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto fail;
+	}
+
+	fprintf(fp, "%s\n", CACHE_MAGIC);
+	write_record(fp, "sql", norm, strlen(norm));
+
+	formats = strdup(sqlhist->strs[SQLHIST_FORMATS]);
+	if (!formats)
+		goto fail_close;
+
+	for (format = formats; *format; format = next) {
+		next = strchr(format, '\n');
+		if (!next)
+			break;
+		*next++ = '\0';
+		if (hash_format(&hash, sqlhist->strs[SQLHIST_TRACE_DIR],
+				format) < 0)
+			goto fail_close;
+		len = asprintf(&record, "%016" PRIx64 " %s", hash, format);
+		if (len < 0)
+			goto fail_close;
+		write_record(fp, "format", record, len);
+		free(record);
+	}
+
+	len = asprintf(&record, "%llu", sqlhist->max_entries);
+	if (len < 0)
+		goto fail_close;
+	write_record(fp, "max_entries", record, len);
+	free(record);
+
+	for (i = 0; i < SQLHIST_NR_STRS; i++) {
+		if (sqlhist->strs[i])
+			write_record(fp, cache_keys[i], sqlhist->strs[i],
+				     sqlhist->lens[i]);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0)
+		goto fail;
+ out:
+	free(formats);
+	free(tmp);
+	return;
+ fail_close:
+	fclose(fp);
+ fail:
+	unlink(tmp);
+	goto out;
+}
+
+/**
+ * sqlhist_cache_open - open a compile cache
+ * @dir: The directory to keep the compiled statements in
+ *
+ * Creates @dir if it does not exist yet.
+ *
+ * Returns the cache, or NULL with errno set.
+ */
+struct sqlhist_cache *sqlhist_cache_open(const char *dir)
+{
+	struct sqlhist_cache *cache;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->dir = strdup(dir);
+	if (!cache->dir) {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void sqlhist_cache_close(struct sqlhist_cache *cache)
+{
+	if (!cache)
+		return;
+
+	free(cache->dir);
+	free(cache);
+}
+
+/**
+ * sqlhist_cache_parse - compile a statement, using the cache if possible
+ * @cache: The cache from sqlhist_cache_open()
+ * @buffer: The SQL statement to compile
+ * @trace_dir: The tracefs directory (NULL for the one of @catalog)
+ * @catalog: The catalog to compile against on a miss (may be NULL)
+ *
+ * If @buffer was compiled before against the same event formats, the
+ * saved result is returned. Otherwise it is compiled with
+ * sqlhist_parse_catalog() (or sqlhist_parse() if @catalog is NULL), and
+ * saved if it compiled without errors.
+ *
+ * Can be called by several threads on the same @cache.
+ */
+struct sqlhist *sqlhist_cache_parse(struct sqlhist_cache *cache,
+				    const char *buffer, const char *trace_dir,
+				    struct sqlhist_catalog *catalog)
+{
+	struct sqlhist *sqlhist = NULL;
+	char *path = NULL;
+	size_t size;
+	char *norm;
+	char *buf;
+
+	if (!trace_dir && catalog)
+		trace_dir = catalog->trace_dir;
+	if (!trace_dir)
+		trace_dir = tracefs_tracing_dir();
+
+	norm = normalize(buffer);
+	if (norm && trace_dir)
+		path = entry_path(cache, norm, trace_dir);
+
+	if (path) {
+		/* The entry is handed to the sqlhist */
+		buf = read_entry(path, &size);
+		if (buf)
+			sqlhist = load_entry(buf, size, norm, trace_dir);
+	}
+
+	if (sqlhist) {
+		__atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+
+	__atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+
+	if (catalog)
+		sqlhist = sqlhist_parse_catalog(buffer, catalog);
+	else
+		sqlhist = sqlhist_parse(buffer, trace_dir);
+
+	if (path && sqlhist && !sqlhist->error &&
+	    sqlhist->strs[SQLHIST_START_HIST] && sqlhist->strs[SQLHIST_FORMATS])
+		save_entry(path, norm, sqlhist);
+ out:
+	free(path);
+	free(norm);
+	return sqlhist;
+}
+
+/**
+ * sqlhist_cache_stats - the hit and miss counts of a cache
+ * @cache: The cache from sqlhist_cache_open()
+ * @hits: Returns the statements found in the cache
+ * @misses: Returns the statements that had to be compiled
+ */
+void sqlhist_cache_stats(struct sqlhist_cache *cache, unsigned long *hits,
+			 unsigned long *misses)
+{
+	*hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,803 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_TRACEFS
+#include <tracefs/tracefs.h>
+#else
+#include "tracefs-stubs.h"
+#endif
+
+#include "sqlhist.h"
+#include "sqlhist-catalog.h"
+
+/*
+ * Reading every events/<system>/<event>/format file takes much longer
+ * than compiling the SQL itself. The catalog holds just the parts of
+ * those files that the compiler looks at, and can be saved to a file
+ * that later compiles simply mmap.
+ *
+ * The saved catalog is stamped with a hash of the tracefs path, the
+ * boot id and the list of available events. If any of them changed
+ * (reboot, new kernel, modules loaded or removed) the catalog is
+ * rebuilt from tracefs.
+ */
+
+#define FNV_PRIME		0x100000001b3ULL
+
+/* FNV-1a, start with CATALOG_HASH_INIT */
+uint64_t catalog_hash(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *buf = data;
+
+	for (; len; buf++, len--) {
+		hash ^= *buf;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+int catalog_hash_file(uint64_t *hash, const char *path)
+{
+	char buf[BUFSIZ];
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		*hash = catalog_hash(*hash, buf, r);
+
+	close(fd);
+	return r < 0 ? -1 : 0;
+}
+
+static uint64_t catalog_stamp(const char *trace_dir)
+{
+	uint64_t hash = CATALOG_HASH_INIT;
+	char *path;
+	int ret;
+
+	hash = catalog_hash(hash, trace_dir, strlen(trace_dir) + 1);
+
+	/* Not having a boot id is fine, not knowing the events is not */
+	catalog_hash_file(&hash, "/proc/sys/kernel/random/boot_id");
+
+	if (asprintf(&path, "%s/available_events", trace_dir) < 0)
+		return 0;
+	ret = catalog_hash_file(&hash, path);
+	free(path);
+
+	return ret < 0 ? 0 : hash;
+}
+
+struct catalog_build {
+	char			*strings;
+	size_t			strings_size;
+	size_t			strings_alloc;
+	uint32_t		*str_hash;
+	size_t			str_hash_size;
+	size_t			nr_strs;
+	struct catalog_event	*events;
+	size_t			nr_events;
+	struct catalog_field	*fields;
+	size_t			nr_fields;
+	size_t			fields_alloc;
+};
+
+static int grow_str_hash(struct catalog_build *cb)
+{
+	size_t size = cb->str_hash_size ? cb->str_hash_size * 2 : 1024;
+	uint32_t *hash;
+	size_t i, key;
+
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return -1;
+
+	for (i = 0; i < cb->str_hash_size; i++) {
+		const char *str;
+
+		if (!cb->str_hash[i])
+			continue;
+		str = cb->strings + cb->str_hash[i];
+		key = catalog_hash(CATALOG_HASH_INIT, str, strlen(str)) & (size - 1);
+		while (hash[key])
+			key = (key + 1) & (size - 1);
+		hash[key] = cb->str_hash[i];
+	}
+
+	free(cb->str_hash);
+	cb->str_hash = hash;
+	cb->str_hash_size = size;
+	return 0;
+}
+
+/* Returns the offset of @str in the string table, adding it if needed */
+static int64_t add_string(struct catalog_build *cb, const char *str)
+{
+	size_t len = strlen(str);
+	size_t key;
+	uint32_t off;
+
+	/* Offset zero is the empty string */
+	if (!len)
+		return 0;
+
+	if ((cb->nr_strs + 1) * 2 > cb->str_hash_size && grow_str_hash(cb) < 0)
+		return -1;
+
+	key = catalog_hash(CATALOG_HASH_INIT, str, len) & (cb->str_hash_size - 1);
+	while ((off = cb->str_hash[key])) {
+		if (strcmp(cb->strings + off, str) == 0)
+			return off;
+		key = (key + 1) & (cb->str_hash_size - 1);
+	}
+
+	if (cb->strings_size + len + 1 > cb->strings_alloc) {
+		size_t size = cb->strings_alloc * 2 + len + 1;
+		char *strings;
+
+		strings = realloc(cb->strings, size);
+		if (!strings)
+			return -1;
+		cb->strings = strings;
+		cb->strings_alloc = size;
+	}
+
+	off = cb->strings_size;
+	memcpy(cb->strings + off, str, len + 1);
+	cb->strings_size += len + 1;
+
+	cb->str_hash[key] = off;
+	cb->nr_strs++;
+
+	return off;
+}
+
+
+static int cmp_tep_events(const void *a, const void *b)
+{
+	struct tep_event * const *A = a;
+	struct tep_event * const *B = b;
+	int ret;
+
+	ret = strcmp((*A)->name, (*B)->name);
+	if (!ret)
+		ret = strcmp((*A)->system, (*B)->system);
+	return ret;
+}
+
+static int cmp_tep_fields(const void *a, const void *b)
+{
+	struct tep_format_field * const *A = a;
+	struct tep_format_field * const *B = b;
+
+	return strcmp((*A)->name, (*B)->name);
+}
+
+static int count_fields(struct tep_format_field **fields)
+{
+	int i;
+
+	for (i = 0; fields && fields[i]; i++)
+		;
+	return i;
+}
+
+static int add_fields(struct catalog_build *cb, struct tep_format_field **fields,
+		      int nr_fields)
+{
+	struct catalog_field *field;
+	int64_t name, type;
+	int i;
+
+	if (cb->nr_fields + nr_fields > cb->fields_alloc) {
+		size_t size = cb->fields_alloc * 2 + nr_fields;
+
+		field = realloc(cb->fields, size * sizeof(*field));
+		if (!field)
+			return -1;
+		cb->fields = field;
+		cb->fields_alloc = size;
+	}
+
+	for (i = 0; i < nr_fields; i++) {
+		name = add_string(cb, fields[i]->name);
+		type = add_string(cb, fields[i]->type);
+		if (name < 0 || type < 0)
+			return -1;
+
+		field = &cb->fields[cb->nr_fields++];
+		field->name = name;
+		field->type = type;
+		field->offset = fields[i]->offset;
+		field->size = fields[i]->size;
+		field->flags = fields[i]->flags;
+	}
+	return 0;
+}
+
+static int add_event(struct catalog_build *cb, struct tep_event *tep_event)
+{
+	struct catalog_event *event = &cb->events[cb->nr_events];
+	struct tep_format_field **common;
+	struct tep_format_field **fields;
+	struct tep_format_field **all;
+	int nr_common, nr_fields;
+	int64_t name, system;
+	int ret = -1;
+
+	name = add_string(cb, tep_event->name);
+	system = add_string(cb, tep_event->system);
+	if (name < 0 || system < 0)
+		return -1;
+
+	common = tep_event_common_fields(tep_event);
+	fields = tep_event_fields(tep_event);
+	nr_common = count_fields(common);
+	nr_fields = count_fields(fields);
+
+	all = malloc((nr_common + nr_fields + 1) * sizeof(*all));
+	if (!all)
+		goto out;
+
+	if (nr_common)
+		memcpy(all, common, nr_common * sizeof(*all));
+	if (nr_fields)
+		memcpy(all + nr_common, fields, nr_fields * sizeof(*all));
+	nr_fields += nr_common;
+
+	/* Keep the fields of each event sorted by name for the lookups */
+	qsort(all, nr_fields, sizeof(*all), cmp_tep_fields);
+
+	event->name = name;
+	event->system = system;
+	event->fields = cb->nr_fields;
+	event->nr_fields = nr_fields;
+
+	ret = add_fields(cb, all, nr_fields);
+	if (!ret)
+		cb->nr_events++;
+
+	free(all);
+ out:
+	free(common);
+	free(fields);
+	return ret;
+}
+
+static void free_build(struct catalog_build *cb)
+{
+	free(cb->strings);
+	free(cb->str_hash);
+	free(cb->events);
+	free(cb->fields);
+}
+
+/* Point @catalog at the tables in its image */
+static void catalog_setup(struct sqlhist_catalog *catalog)
+{
+	const struct catalog_header *header = catalog->image;
+	const char *image = catalog->image;
+
+	catalog->header = header;
+	catalog->events = (const struct catalog_event *)(image + header->events);
+	catalog->fields = (const struct catalog_field *)(image + header->fields);
+	catalog->strings = image + header->strings;
+}
+
+static struct sqlhist_catalog *catalog_build(struct tep_handle *tep, uint64_t stamp)
+{
+	struct catalog_build cb = { };
+	struct sqlhist_catalog *catalog = NULL;
+	struct catalog_header *header;
+	struct tep_event **events;
+	size_t events_size;
+	size_t fields_size;
+	size_t size;
+	char *image;
+	int nr;
+	int i;
+
+	nr = tep_get_events_count(tep);
+	events = malloc((nr + 1) * sizeof(*events));
+	if (!events)
+		return NULL;
+
+	if (nr)
+		memcpy(events, tep_list_events(tep, TEP_EVENT_SORT_NAME),
+		       nr * sizeof(*events));
+	qsort(events, nr, sizeof(*events), cmp_tep_events);
+
+	cb.events = calloc(nr + 1, sizeof(*cb.events));
+	cb.strings = malloc(BUFSIZ);
+	if (!cb.events || !cb.strings)
+		goto out;
+
+	/* Offset zero is reserved for the empty string */
+	cb.strings[0] = '\0';
+	cb.strings_size = 1;
+	cb.strings_alloc = BUFSIZ;
+
+	for (i = 0; i < nr; i++) {
+		if (add_event(&cb, events[i]) < 0)
+			goto out;
+	}
+
+	events_size = cb.nr_events * sizeof(*cb.events);
+	fields_size = cb.nr_fields * sizeof(*cb.fields);
+	size = sizeof(*header) + events_size + fields_size + cb.strings_size;
+	if (size > UINT32_MAX)
+		goto out;
+
+	catalog = calloc(1, sizeof(*catalog));
+	image = calloc(1, size);
+	if (!catalog || !image) {
+		free(catalog);
+		free(image);
+		catalog = NULL;
+		goto out;
+	}
+
+	header = (struct catalog_header *)image;
+	memcpy(header->magic, CATALOG_MAGIC, sizeof(header->magic));
+	header->version = CATALOG_VERSION;
+	header->size = size;
+	header->stamp = stamp;
+	header->nr_events = cb.nr_events;
+	header->nr_fields = cb.nr_fields;
+	header->events = sizeof(*header);
+	header->fields = header->events + events_size;
+	header->strings = header->fields + fields_size;
+	header->strings_size = cb.strings_size;
+
+	memcpy(image + header->events, cb.events, events_size);
+	memcpy(image + header->fields, cb.fields, fields_size);
+	memcpy(image + header->strings, cb.strings, cb.strings_size);
+
+	catalog->image = image;
+	catalog->image_size = size;
+	catalog_setup(catalog);
+ out:
+	free_build(&cb);
+	free(events);
+	return catalog;
+}
+
+/* Make sure a catalog read from a file can not send us out of bounds */
+static bool catalog_valid(const void *image, size_t size, uint64_t stamp)
+{
+	const struct catalog_header *header = image;
+	const struct catalog_event *events;
+	const struct catalog_field *fields;
+	uint32_t i;
+
+	if (size < sizeof(*header))
+		return false;
+
+	if (memcmp(header->magic, CATALOG_MAGIC, sizeof(header->magic)) ||
+	    header->version != CATALOG_VERSION ||
+	    header->size != size || header->stamp != stamp)
+		return false;
+
+	if (header->events != sizeof(*header) ||
+	    header->fields != header->events +
+	    (uint64_t)header->nr_events * sizeof(*events) ||
+	    header->strings != header->fields +
+	    (uint64_t)header->nr_fields * sizeof(*fields) ||
+	    (uint64_t)header->strings + header->strings_size != size ||
+	    !header->strings_size)
+		return false;
+
+	/* The string table must end with a nul */
+	if (((const char *)image)[size - 1])
+		return false;
+
+	events = (const void *)((const char *)image + header->events);
+	fields = (const void *)((const char *)image + header->fields);
+
+	for (i = 0; i < header->nr_events; i++) {
+		if (events[i].name >= header->strings_size ||
+		    events[i].system >= header->strings_size ||
+		    events[i].fields > header->nr_fields ||
+		    events[i].nr_fields > header->nr_fields - events[i].fields)
+			return false;
+	}
+
+	for (i = 0; i < header->nr_fields; i++) {
+		if (fields[i].name >= header->strings_size ||
+		    fields[i].type >= header->strings_size)
+			return false;
+	}
+
+	return true;
+}
+
+static struct sqlhist_catalog *catalog_map(const char *file, uint64_t stamp)
+{
+	struct sqlhist_catalog *catalog;
+	struct stat st;
+	void *image;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct catalog_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+
+	if (!catalog_valid(image, st.st_size, stamp))
+		goto fail;
+
+	catalog = calloc(1, sizeof(*catalog));
+	if (!catalog)
+		goto fail;
+
+	catalog->image = image;
+	catalog->image_size = st.st_size;
+	catalog->mapped = true;
+	catalog_setup(catalog);
+
+	return catalog;
+ fail:
+	munmap(image, st.st_size);
+	return NULL;
+}
+
+/*
+ * Write to a temp file and rename it over @file, so that anyone else
+ * mapping the catalog at the same time sees either the old or the new one.
+ */
+static int catalog_write(struct sqlhist_catalog *catalog, const char *file)
+{
+	const char *image = catalog->image;
+	size_t size = catalog->image_size;
+	char *tmp;
+	ssize_t w;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", file) < 0)
+		return -1;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto fail;
+
+	while (size) {
+		w = write(fd, image, size);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			goto fail_unlink;
+		}
+		image += w;
+		size -= w;
+	}
+
+	if (close(fd) < 0 || rename(tmp, file) < 0)
+		goto fail_unlink;
+
+	free(tmp);
+	return 0;
+
+ fail_unlink:
+	unlink(tmp);
+ fail:
+	free(tmp);
+	return -1;
+}
+
+/**
+ * sqlhist_catalog_open - load the event formats for compiling
+ * @trace_dir: The tracefs directory (NULL to find it)
+ * @file: The file to keep the catalog in (NULL to not save it)
+ *
+ * If @file holds a catalog of the current @trace_dir, it is simply
+ * mapped. Otherwise the event formats are read from @trace_dir, and if
+ * @file is given, saved there for next time.
+ *
+ * Returns the catalog to pass to sqlhist_parse_catalog(), which must be
+ * freed with sqlhist_catalog_close(), or NULL on error.
+ */
+struct sqlhist_catalog *sqlhist_catalog_open(const char *trace_dir,
+					     const char *file)
+{
+	struct sqlhist_catalog *catalog = NULL;
+	struct tep_handle *tep;
+	uint64_t stamp;
+
+	if (!trace_dir)
+		trace_dir = tracefs_tracing_dir();
+	if (!trace_dir)
+		return NULL;
+
+	stamp = catalog_stamp(trace_dir);
+
+	if (file && stamp)
+		catalog = catalog_map(file, stamp);
+
+	if (!catalog) {
+		tep = tracefs_local_events(trace_dir);
+		if (!tep)
+			return NULL;
+
+		catalog = catalog_build(tep, stamp);
+		tep_free(tep);
+		if (!catalog)
+			return NULL;
+
+		/* Failing to save it only means the next open rebuilds it */
+		if (file && stamp)
+			catalog_write(catalog, file);
+	}
+
+	catalog->trace_dir = strdup(trace_dir);
+	if (!catalog->trace_dir) {
+		sqlhist_catalog_close(catalog);
+		return NULL;
+	}
+
+	return catalog;
+}
+
+void sqlhist_catalog_close(struct sqlhist_catalog *catalog)
+{
+	if (!catalog)
+		return;
+
+	if (catalog->mapped)
+		munmap(catalog->image, catalog->image_size);
+	else
+		free(catalog->image);
+
+	free(catalog->trace_dir);
+	free(catalog);
+}
+
+static int read_file(const char *path, char **pbuf, size_t *psize)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	size_t alloc = 0;
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	do {
+		if (size == alloc) {
+			char *tmp;
+
+			alloc += BUFSIZ;
+			tmp = realloc(buf, alloc);
+			if (!tmp)
+				goto fail;
+			buf = tmp;
+		}
+		r = read(fd, buf + size, alloc - size);
+		if (r < 0)
+			goto fail;
+		size += r;
+	} while (r);
+
+	close(fd);
+	*pbuf = buf;
+	*psize = size;
+	return 0;
+ fail:
+	close(fd);
+	free(buf);
+	return -1;
+}
+
+/* Parse the format file of just @system/@event into @tep */
+static int load_event(struct tep_handle *tep, const char *trace_dir,
+		      const char *system, const char *event)
+{
+	char *path;
+	char *buf;
+	size_t size;
+	int ret;
+
+	if (tep_find_event_by_name(tep, system, event))
+		return 0;
+
+	if (asprintf(&path, "%s/events/%s/%s/format", trace_dir, system, event) < 0)
+		return -1;
+	ret = read_file(path, &buf, &size);
+	free(path);
+	if (ret < 0)
+		return -1;
+
+	ret = tep_parse_event(tep, buf, size, system) ? -1 : 0;
+	free(buf);
+	return ret;
+}
+
+/*
+ * The system of @event is not known. Rather than reading every format
+ * file, look for @event in each system directory, and load it from
+ * every system that has it.
+ */
+static int scan_event(struct tep_handle *tep, const char *trace_dir,
+		      const char *event)
+{
+	struct dirent *dent;
+	char *path;
+	DIR *dir;
+
+	if (tep_find_event_by_name(tep, NULL, event))
+		return 0;
+
+	if (asprintf(&path, "%s/events", trace_dir) < 0)
+		return -1;
+	dir = opendir(path);
+	free(path);
+	if (!dir)
+		return -1;
+
+	while ((dent = readdir(dir))) {
+		if (dent->d_name[0] == '.')
+			continue;
+		load_event(tep, trace_dir, dent->d_name, event);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/**
+ * catalog_open_events - load only the named event formats
+ * @trace_dir: The tracefs directory (NULL to find it)
+ * @events: The events as either "system.event" or just "event"
+ * @nr_events: The number of @events
+ *
+ * Unlike sqlhist_catalog_open(), this only reads the format files of
+ * @events. An event without a system is looked for in every system.
+ * Events that do not exist are skipped, and later fail to be found in
+ * the catalog like any other unknown event.
+ *
+ * Returns an in-memory catalog, or NULL if @trace_dir has no events.
+ */
+struct sqlhist_catalog *catalog_open_events(const char *trace_dir,
+					    const char * const *events,
+					    int nr_events)
+{
+	struct sqlhist_catalog *catalog;
+	struct tep_handle *tep;
+	struct stat st;
+	const char *event;
+	char *system;
+	char *path;
+	int ret;
+	int i;
+
+	if (!trace_dir)
+		trace_dir = tracefs_tracing_dir();
+	if (!trace_dir)
+		return NULL;
+
+	if (asprintf(&path, "%s/events", trace_dir) < 0)
+		return NULL;
+	ret = stat(path, &st);
+	free(path);
+	if (ret < 0)
+		return NULL;
+
+	tep = tep_alloc();
+	if (!tep)
+		return NULL;
+
+	for (i = 0; i < nr_events; i++) {
+		event = strchr(events[i], '.');
+		if (!event) {
+			scan_event(tep, trace_dir, events[i]);
+			continue;
+		}
+		system = strndup(events[i], event - events[i]);
+		if (!system)
+			goto fail;
+		load_event(tep, trace_dir, system, event + 1);
+		free(system);
+	}
+
+	catalog = catalog_build(tep, 0);
+	tep_free(tep);
+	if (!catalog)
+		return NULL;
+
+	catalog->trace_dir = strdup(trace_dir);
+	if (!catalog->trace_dir) {
+		sqlhist_catalog_close(catalog);
+		return NULL;
+	}
+
+	return catalog;
+ fail:
+	tep_free(tep);
+	return NULL;
+}
+
+const char *catalog_str(const struct sqlhist_catalog *catalog, uint32_t str)
+{
+	return catalog->strings + str;
+}
+
+const struct catalog_event *
+catalog_find_event(const struct sqlhist_catalog *catalog,
+		   const char *system, const char *name)
+{
+	const struct catalog_event *event;
+	int lo = 0, hi = catalog->header->nr_events;
+	int mid;
+	int ret;
+
+	/* Find the first event called @name */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strcmp(catalog_str(catalog, catalog->events[mid].name), name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < catalog->header->nr_events; lo++) {
+		event = &catalog->events[lo];
+		if (strcmp(catalog_str(catalog, event->name), name) != 0)
+			break;
+		if (!system)
+			return event;
+		ret = strcmp(catalog_str(catalog, event->system), system);
+		if (!ret)
+			return event;
+		if (ret > 0)
+			break;
+	}
+
+	return NULL;
+}
+
+const struct catalog_field *
+catalog_find_field(const struct sqlhist_catalog *catalog,
+		   const struct catalog_event *event, const char *name)
+{
+	const struct catalog_field *fields = catalog->fields + event->fields;
+	int lo = 0, hi = event->nr_fields;
+	int mid;
+	int ret;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		ret = strcmp(catalog_str(catalog, fields[mid].name), name);
+		if (!ret)
+			return &fields[mid];
+		if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,79 @@
+#ifndef __SQLHIST_CATALOG_H
+#define __SQLHIST_CATALOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The catalog is a flat image of the event formats that the compiler
+ * needs: the systems, events, fields and their types. It is laid out as
+ *
+ *   struct catalog_header
+ *   struct catalog_event[nr_events]	(sorted by name, then system)
+ *   struct catalog_field[nr_fields]	(grouped by event, sorted by name)
+ *   strings
+ *
+ * All references are offsets into the image, so it can be written to a
+ * file once and mmapped by every later compile.
+ */
+#define CATALOG_MAGIC		"SQLHCAT"
+#define CATALOG_VERSION		1
+
+struct catalog_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		size;
+	uint64_t		stamp;
+	uint32_t		nr_events;
+	uint32_t		nr_fields;
+	uint32_t		events;
+	uint32_t		fields;
+	uint32_t		strings;
+	uint32_t		strings_size;
+};
+
+struct catalog_event {
+	uint32_t		name;
+	uint32_t		system;
+	uint32_t		fields;
+	uint32_t		nr_fields;
+};
+
+struct catalog_field {
+	uint32_t		name;
+	uint32_t		type;
+	int32_t			offset;
+	int32_t			size;
+	uint32_t		flags;
+};
+
+struct sqlhist_catalog {
+	const struct catalog_header	*header;
+	const struct catalog_event	*events;
+	const struct catalog_field	*fields;
+	const char			*strings;
+	char				*trace_dir;
+	void				*image;
+	size_t				image_size;
+	bool				mapped;
+};
+
+#define CATALOG_HASH_INIT	0xcbf29ce484222325ULL
+
+uint64_t catalog_hash(uint64_t hash, const void *data, size_t len);
+int catalog_hash_file(uint64_t *hash, const char *path);
+
+struct sqlhist_catalog *catalog_open_events(const char *trace_dir,
+					    const char * const *events,
+					    int nr_events);
+
+const char *catalog_str(const struct sqlhist_catalog *catalog, uint32_t str);
+const struct catalog_event *
+catalog_find_event(const struct sqlhist_catalog *catalog,
+		   const char *system, const char *name);
+const struct catalog_field *
+catalog_find_field(const struct sqlhist_catalog *catalog,
+		   const struct catalog_event *event, const char *name);
+
+#endif
@@ -5,10 +5,12 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "sqlhist.h"
 #include "sqlhist-parse.h"
 #include "sqlhist-local.h"
+#include "sqlhist-catalog.h"
 
 extern int yylex_init(void* ptr_yy_globals);
 extern int yylex_init_extra(struct sqlhist_bison *sb, void* ptr_yy_globals);
@@ -36,41 +38,47 @@ extern int yylex_destroy (void * yyscanner );
  *                       events/sched/sched_switch/trigger
  */
 
-static struct tep_handle *tep;
-
 extern int yylex(void *);
 
 static int lex_it(void)
 {
-	struct sqlhist_bison sb;
+	struct sqlhist_bison sb = { };
 	int ret;
 
-	yylex_init(&sb.scanner);
-	yylex_init_extra(&sb, sb.scanner);
+	yylex_init_extra(&sb, &sb.scanner);
 	do {
 		ret = yylex(sb.scanner);
 	} while (ret > 0);
 
 	yylex_destroy(sb.scanner);
+	clean_stores(&sb);
 
 	return ret;
 }
 
-static const char *show_raw_expr(void *e)
+static const char *show_raw_expr(void *expr)
 {
+	struct expression *e = expr;
+
+	/* Fields are resolved once by the binding pass */
+	if (e->type == EXPR_FIELD && e->raw)
+		return e->raw;
+
 	return __show_expr(e, true);
 }
 
 static const char *resolve(struct sql_table *table, const char *label)
 {
-	struct sql_table *save_curr = curr_table;
+	struct sqlhist_bison *sb = table->sb;
+	struct sql_table *save_curr = sb->curr_table;
+	unsigned int id = str_id(label);
 	struct label_map *lmap;
 	struct expression *e;
 
-	curr_table = table;
+	sb->curr_table = table;
 
 	for (lmap = table->labels; lmap; lmap = lmap->next)
-		if (strcmp(lmap->label, label) == 0)
+		if (lmap->label_id == id)
 			break;
 
 	if (lmap) {
@@ -85,7 +93,7 @@ static const char *resolve(struct sql_table *table, const char *label)
 		}
 	}
 
-	curr_table = save_curr;
+	sb->curr_table = save_curr;
 
 	return label;
 }
@@ -96,79 +104,60 @@ static const char *resolve_expr(struct sql_table *table,
 	return resolve(table, show_expr(e));
 }
 
+/* Returns the part of @str before the first '.' (or all of it) */
+static const char *event_part(struct sqlhist_bison *sb, const char *str)
+{
+	return store_printf(sb, "%.*s", (int)strcspn(str, "."), str);
+}
+
 static const char *expand(struct sqlhist_bison *sb, const char *str)
 {
-	char *exp = strdup(str);
 	const char *label;
-	const char *ret;
-	char *p;
-
-	if ((p = strstr(exp, "."))) {
-		*p = 0;
-		label = resolve(curr_table, exp);
-		ret = store_printf(sb, "%s.%s", label, p+1);
-		*p = '.';
-	} else {
-		ret = resolve(curr_table, str);
+	const char *p;
+
+	if ((p = strstr(str, "."))) {
+		label = resolve(sb->curr_table, event_part(sb, str));
+		return store_printf(sb, "%s%s", label, p);
 	}
-	free(exp);
-	return ret;
+
+	return resolve(sb->curr_table, str);
 }
 
-static char *expr_op_connect(void *A, void *B, const char *op,
-			     const char *(*show)(void *A))
+static const char *expr_op_connect(void *A, void *B, const char *op,
+				   const char *(*show)(void *A))
 {
 	struct expression *eA = A;
 	struct expression *eB = B;
 	struct sqlhist_bison *sb = eA->sb;
-	char *a = NULL, *b = NULL;
-	char *ret, *str;
-	int r;
+	const char *a, *b;
 
-	if (eA->name) {
-		r = asprintf(&a, "%s AS %s", show(A), eA->name);
-		if (r < 0)
-			return NULL;
-	}
+	if (eA->name)
+		a = store_printf(sb, "%s AS %s", show(A), eA->name);
+	else
+		a = show(A);
 
-	if (eB->name) {
-		r = asprintf(&b, "%s AS %s", show(B), eB->name);
-		if (r < 0)
-			return NULL;
-	}
+	if (eB->name)
+		b = store_printf(sb, "%s AS %s", show(B), eB->name);
+	else
+		b = show(B);
 
-	r = asprintf(&str, "(%s %s %s)",
-		     a ? a : show(A), op, b ? b : show(B));
-	if (r < 0)
+	if (!a || !b)
 		return NULL;
-	free(a);
-	free(b);
 
-	ret = store_str(sb, str);
-	free(str);
-	return ret;
+	return store_printf(sb, "(%s %s %s)", a, op, b);
 }
 
-static char *str_op_connect(struct sqlhist_bison *sb,
-			    const char *a, const char *b, const char *op)
+static const char *str_op_connect(struct sqlhist_bison *sb,
+				  const char *a, const char *b, const char *op)
 {
-	char *ret, *str;
-	int r;
-
-	r = asprintf(&str, "(%s %s %s)", a, op, b );
-	if (r < 0)
-		return NULL;
-
-	ret = store_str(sb, str);
-	free(str);
-	return ret;
+	return store_printf(sb, "(%s %s %s)", a, op, b);
 }
 
 const char *__show_expr(struct expression *e, bool eval)
 {
 	const char *(*show)(void *);
 	struct sqlhist_bison *sb = e->sb;
-	char *ret = NULL;
+	const char *ret = NULL;
 
 	if (eval)
 		show = show_raw_expr;
@@ -194,7 +183,40 @@ const char *__show_expr(struct expression *e, bool eval)
 		ret = expr_op_connect(e->A, e->B, "/", show);
 		break;
 	case EXPR_FILTER:
-		ret = str_op_connect(sb, e->A, e->B, e->op);
+		ret = str_op_connect(sb, show(e->A), show(e->B), e->op);
+		break;
+	case EXPR_AND:
+		ret = str_op_connect(sb, show(e->A), show(e->B), "AND");
+		break;
+	case EXPR_OR:
+		ret = str_op_connect(sb, show(e->A), show(e->B), "OR");
+		break;
+	case EXPR_NOT:
+		ret = store_printf(sb, "(NOT %s)", show(e->A));
+		break;
+	case EXPR_STRING:
+		ret = store_printf(sb, "\"%s\"", (char *)e->A);
+		break;
+	case EXPR_BUCKET:
+		ret = store_printf(sb, "bucket(%s, %s)", show(e->A), (char *)e->B);
+		break;
+	case EXPR_LOG2:
+		ret = store_printf(sb, "log2(%s)", show(e->A));
+		break;
+	case EXPR_COUNT:
+		ret = store_str(sb, "count(*)");
+		break;
+	case EXPR_COUNT_DISTINCT:
+		ret = store_printf(sb, "count(distinct %s)", show(e->A));
+		break;
+	case EXPR_SUM:
+		ret = store_printf(sb, "sum(%s)", show(e->A));
+		break;
+	case EXPR_MIN:
+		ret = store_printf(sb, "min(%s)", show(e->A));
+		break;
+	case EXPR_MAX:
+		ret = store_printf(sb, "max(%s)", show(e->A));
 		break;
 	}
 	return ret;
@@ -203,10 +225,10 @@ const char *__show_expr(struct expression *e, bool eval)
 static struct sql_table *find_table(struct expression *e)
 {
 	struct table_map *tmap;
-	const char *name = show_expr(e);
+	unsigned int id = str_id(show_expr(e));
 
-	for (tmap = table_list; tmap; tmap = tmap->next)
-		if (strcmp(tmap->name, name) == 0)
+	for (tmap = e->sb->table_list; tmap; tmap = tmap->next)
+		if (tmap->name_id == id)
 			return tmap->table;
 	return NULL;
 }
@@ -250,27 +272,32 @@ static void dump_match_map(struct trace_seq *s, struct sql_table *table)
 
 static void dump_table(struct trace_seq *s, struct sql_table *table)
 {
-	struct sql_table *save_curr = curr_table;
+	struct sql_table *save_curr;
 
 	if (!table)
 		return;
 
 	dump_table(s, find_table(table->from));
 
-	curr_table = table;
+	save_curr = table->sb->curr_table;
+	table->sb->curr_table = table;
 
 	trace_seq_printf(s, "\nTable: %s\n", table->name);
 	dump_label_map(s, table);
 	dump_match_map(s, table);
 
-	curr_table = save_curr;
+	table->sb->curr_table = save_curr;
 
 	dump_table(s, find_table(table->to));
 }
 
-static const char *event_match(const char *event, const char *val, int len)
+/* Returns the field of @val if it is "@event.field" */
+static const char *event_match(const char *event, const char *val)
 {
-	if (strncmp(event, val, len) == 0 && val[len] == '.')
+	unsigned int len = str_len(event);
+
+	if (str_len(val) > len && val[len] == '.' &&
+	    memcmp(event, val, len) == 0)
 		return val + len + 1;
 
 	return NULL;
@@ -278,807 +305,3280 @@ static const char *event_match(const char *event, const char *val, int len)
 
 static char * make_dynamic_arg(struct sqlhist_bison *sb)
 {
-	static int arg_cnt;
-
-	return store_printf(sb, "__arg%d__", arg_cnt++);
+	return store_printf(sb, "__arg%d__", sb->arg_cnt++);
 }
 
-static struct tep_event *find_event(struct tep_handle *tep, const char *name)
+static const struct catalog_event *find_event(struct sqlhist_catalog *catalog,
+					      const char *system,
+					      const char *name)
 {
-	static struct tep_event stub_event = {
-		.system			= "(system)",
-	};
+	static const struct catalog_event stub_event;
 
-	if (tep)
-		return tep_find_event_by_name(tep, NULL, name);
+	if (catalog)
+		return catalog_find_event(catalog, system, name);
 
 	return &stub_event;
 }
 
-static struct tep_format_field *find_field(struct tep_event *event, char *name)
+static const char *event_system(struct sqlhist_catalog *catalog,
+				const struct catalog_event *event)
 {
-	static struct tep_format_field stub_field = {
-		.type = "(unknown)",
-	};
-
-	if (tep)
-		return tep_find_any_field(event, name);
+	if (catalog)
+		return catalog_str(catalog, event->system);
 
-	return &stub_field;
+	return "(system)";
 }
 
-static void print_type(struct trace_seq *s, struct expression *e)
+static const char *bound_system(struct sqlhist_bison *sb,
+				struct bound_event *event)
 {
-	struct tep_format_field *field;
-	struct tep_event *event;
-	char *name;
-	char *tok;
+	const char *system = event->system;
 
-	while (e && e->type != EXPR_FIELD) {
-		e = e->A;
-	}
+	if (!system && event->event)
+		system = event_system(sb->catalog, event->event);
 
-	if (!e) {
-		trace_seq_printf(s, " (unknown-expression) ");
-		return;
-	}
+	return system ? : "(system)";
+}
+
+/**
+ * sqlhist_event_key - the event a histogram of a table is on
+ * @table: The table
+ * @event: Its start or end event, or NULL for its synthetic event
+ *
+ * Returns "system/name", which is the same for all the tables on the
+ * event.
+ */
+const char *sqlhist_event_key(struct sql_table *table,
+			      struct bound_event *event)
+{
+	struct sqlhist_bison *sb = table->sb;
+
+	if (!event)
+		return store_printf(sb, "synthetic/%s", table->name);
 
-	name = strdup(show_raw_expr(e));
+	return store_printf(sb, "%s/%s", bound_system(sb, event), event->name);
+}
 
-	tok = strtok(name, ".");
+/* The name a variable of @table is defined as, see sqlhist_share_starts() */
+const char *sqlhist_var_name(struct sql_table *table, const char *name)
+{
+	struct var_rename *rename;
 
-	event = find_event(tep, tok);
-	if (!event) {
-		tok = strtok(NULL, ".");
-		if (!tok)
-			goto out;
-		event = find_event(tep, tok);
+	for (rename = table->renames; rename; rename = rename->next) {
+		if (strcmp(rename->name, name) == 0)
+			return rename->var;
 	}
 
-	tok = strtok(NULL, ".");
-	if (!tok || !event)
-		goto out;
+	return name;
+}
 
-	if (strcmp(tok, "common_timestamp") == 0) {
-		trace_seq_printf(s, " u64 ");
-	} else {
-		field = find_field(event, tok);
-		if (field)
-			trace_seq_printf(s, " %s ", field->type);
-		else
-			trace_seq_printf(s, " (no-field-%s-for-%s) ", tok, name);
+/*
+ * The variables that the histograms of @table define on @event are
+ * recorded as they are first emitted, for sqlhist_share_starts() to
+ * rename where they clash with those of other statements.
+ */
+static const char *def_var(struct sql_table *table, struct bound_event *event,
+			   const char *name)
+{
+	struct sqlhist_bison *sb = table->sb;
+	struct hist_var **next;
+	struct hist_var *var;
+
+	if (!sb->emitted) {
+		var = arena_alloc(sb, sizeof(*var));
+		if (var) {
+			var->event = sqlhist_event_key(table, event);
+			var->name = name;
+			var->next = NULL;
+			/* In the order they are defined in */
+			for (next = &table->hist_vars; *next; next = &(*next)->next)
+				;
+			*next = var;
+		}
 	}
- out:
-	if (!event)
-		trace_seq_printf(s, " (no-event-for:%s) ", name);
-	free(name);
+
+	return sqlhist_var_name(table, name);
 }
 
-static void print_synthetic_field(struct trace_seq *s,
-				  struct sql_table *table,
-				  struct selection *selection)
+/*
+ * Returns the next '.' separated token of *@str and moves *@str past it,
+ * or NULL when there are no more tokens.
+ */
+static const char *next_token(struct sqlhist_bison *sb, const char **str)
 {
-	struct expression *e = selection->item;
-	struct sqlhist_bison *sb = e->sb;
-	const char *name;
-	const char *actual;
-	const char *field;
-	const char *to;
-	int len;
+	const char *s = *str;
+	const char *p;
 
-	print_type(s, e);
+	if (!s || !*s)
+		return NULL;
 
-	name = selection->name;
-	if (!name)
-		name = e->name;
-	if (name) {
-		trace_seq_printf(s, "%s", name);
-		return;
+	p = strstr(s, ".");
+	if (!p) {
+		*str = NULL;
+		return s;
 	}
 
-	to = resolve_expr(table, table->to);
-	len = strlen(to);
+	*str = p + 1;
+	return store_printf(sb, "%.*s", (int)(p - s), s);
+}
 
-	actual = show_raw_expr(e);
-	field = event_match(to, actual, len);
-	if (field) {
-		trace_seq_printf(s, "%s", field);
-		return;
-	}
+static const struct catalog_field *find_field(struct sqlhist_catalog *catalog,
+					      const struct catalog_event *event,
+					      const char *name)
+{
+	static const struct catalog_field stub_field;
 
-	selection->name = make_dynamic_arg(sb);
-	e->name = selection->name;
+	if (catalog)
+		return catalog_find_field(catalog, event, name);
 
-	field = strstr(actual, ".");
-	if (field) {
-		/* Need to check for common_timestamp */
-		trace_seq_printf(s, "%s", field + 1);
-	} else {
-		trace_seq_printf(s, "%s", e->name);
-	}
+	return &stub_field;
 }
 
-static void make_synthetic_events(struct trace_seq *s, struct sql_table *table)
+static const char *field_type(struct sqlhist_catalog *catalog,
+			      const struct catalog_field *field)
 {
-	struct selection *selection;
-	struct sql_table *save_curr = curr_table;
-
-	if (!table || !table->to)
-		return;
+	if (catalog)
+		return catalog_str(catalog, field->type);
 
-	make_synthetic_events(s, find_table(table->from));
+	return "(unknown)";
+}
 
-	curr_table = table;
+/*
+ * Binding.
+ *
+ * The parser only records what was written. Before anything is
+ * emitted, every table gets the events it starts from and joins to
+ * (with their labels resolved), and every field expression gets its
+ * resolved text, the table event it belongs to, the name of the field
+ * within that event and, once the event formats are loaded, its type.
+ * The emitters below only look at these, and never go back to the
+ * strings.
+ */
+static void bind_event(struct sqlhist_bison *sb, struct sql_table *table,
+		       struct bound_event *event, struct expression *e)
+{
+	const char *dot;
 
-	trace_seq_printf(s, "%s", table->name);
-	for (selection = table->selections; selection; selection = selection->next)
-		print_synthetic_field(s, table, selection);
+	event->text = resolve_expr(table, e);
 
-	curr_table = save_curr;
+	dot = strstr(event->text, ".");
+	if (dot) {
+		event->system = store_printf(sb, "%.*s",
+					     (int)(dot - event->text),
+					     event->text);
+		event->name = store_str(sb, dot + 1);
+	} else {
+		event->name = event->text;
+	}
+}
 
-	make_synthetic_events(s, find_table(table->to));
+/* The synthetic event of a stage */
+static void bind_stage_event(struct sql_table *stage, struct bound_event *event)
+{
+	event->text = stage->name;
+	event->system = "synthetic";
+	event->name = stage->name;
+	event->table = stage;
 }
 
-static void print_key(struct trace_seq *s,
-		      struct sql_table *table,
-		      const char *event,
-		      const char *key1, const char *key2)
+/* Follows labels of fields: "end_time" gives "end.common_timestamp" */
+static const char *label_field(struct sql_table *table, const char *str)
 {
-	int len = strlen(event);
-	const char *field;
+	unsigned int id = str_id(str);
+	struct label_map *lmap;
+	struct expression *e;
+
+	if (strstr(str, "."))
+		return str;
 
-	field = event_match(event, key1, len);
-	if (field) 
-		trace_seq_printf(s, "%s", field);
+	for (lmap = table->labels; lmap; lmap = lmap->next) {
+		if (lmap->label_id != id || lmap->type != LABEL_EXPR)
+			continue;
+		e = lmap->value;
+		if (e->type == EXPR_FIELD && e->A != str)
+			return label_field(table, e->A);
+		break;
+	}
 
-	field = event_match(event, key2, len);
-	if (field)
-		trace_seq_printf(s, "%s", field);
+	return str;
 }
 
-static void print_keys(struct trace_seq *s, struct sql_table *table, const char *event)
+static bool is_alias(struct expression *e, const char *alias)
 {
-	struct sqlhist_bison *sb = table->sb;
-	struct selection *selection;
-	struct match_map *map;
-	struct expression *e;
-	char *f, *p;
-	int start = 0;
-
-	if (event) {
-		f = strdup(event);
-		if ((p = strstr(f, ".")))
-			*p = '\0';
+	return e && strcmp(show_expr(e), alias) == 0;
+}
 
-		for (map = table->matches; map; map = map->next) {
-			if (start++)
-				trace_seq_printf(s, ",");
-			print_key(s, table, f, expand(sb, map->A),
-				  expand(sb, map->B));
-		}
+/*
+ * With stages, an event can be joined more than once (switch in and
+ * switch out are both sched_switch), so which one a field is of goes
+ * by the alias it is written with, and only then by the event.
+ */
+static bool is_to_field(struct sqlhist_bison *sb, struct sql_table *table,
+			const char *str)
+{
+	struct sql_table *stage;
+	const char *alias = NULL;
 
-		free(f);
-	} else {
-		for (selection = table->selections; selection; selection = selection->next) {
-			e = selection->item;
-			if (!e->name || strncmp(e->name, "key", 3) != 0)
-				continue;
-			if (start++)
-				trace_seq_printf(s, ",");
-			trace_seq_printf(s, "%s", show_raw_expr(e));
+	if (!table->to)
+		return false;
+
+	str = label_field(table, str);
+	if (strstr(str, "."))
+		alias = event_part(sb, str);
+
+	if (alias) {
+		if (is_alias(table->to, alias))
+			return true;
+		for (stage = table->from_table; stage; stage = stage->from_table) {
+			if (strcmp(stage->name, alias) == 0)
+				return false;
+			/* The aliases inside a SELECT in FROM are its own */
+			if (!stage->split)
+				break;
+			if (is_alias(stage->to, alias) ||
+			    (!stage->from_table && is_alias(stage->from, alias)))
+				return false;
 		}
 	}
-}
 
-enum value_type {
-	VALUE_TO,
-	VALUE_FROM,
-};
+	return event_match(table->to_event.text, expand(sb, str)) != NULL;
+}
 
-static void print_val_delim(struct trace_seq *s, bool *start)
+static struct expression *carried_item(struct sql_table *stage,
+				       const char *name)
 {
-	if (*start) {
-		trace_seq_printf(s, ":");
-		*start = false;
-	} else
-		trace_seq_printf(s, ",");
+	struct selection *selection;
+
+	for (selection = stage->selections; selection; selection = selection->next) {
+		if (selection->synth_name && strcmp(selection->synth_name, name) == 0)
+			return selection->item;
+	}
+
+	return NULL;
 }
 
-struct var_list {
-	struct var_list		*next;
-	const char		*var;
-	const char		*val;
-};
+static void bind_field(struct sqlhist_bison *sb, struct sql_table *table,
+		       struct expression *e);
 
-static const char *find_var(struct var_list **vars, const char *val)
+/*
+ * A SELECT in FROM only has the fields it selects, by their names in
+ * its synthetic event: "lat.delta" or just "delta".
+ */
+static const char *select_field(struct sqlhist_bison *sb,
+				struct sql_table *select, const char *str)
 {
-	struct var_list *v;
-	
-	for (v = *vars; v; v = v->next) {
-		if (strcmp(v->val, val) == 0)
-		    return v->var;
+	const char *field = str;
+
+	if (strstr(str, ".")) {
+		if (strcmp(event_part(sb, str), select->name) != 0)
+			return NULL;
+		field = strstr(str, ".") + 1;
 	}
 
-	return NULL;
+	field = store_str(sb, field);
+	if (!field || !carried_item(select, field))
+		return NULL;
+
+	return field;
 }
 
-static int add_var(struct var_list **vars, const char *var, const char *val)
+/*
+ * Makes the field @str of the events of @stage a field of its
+ * synthetic event, so that the stages after it can use it. Only the
+ * fields that are used are carried forward. Returns its name in the
+ * synthetic event, or NULL if @str is not a field of @stage.
+ */
+static const char *carry_field(struct sqlhist_bison *sb,
+			       struct sql_table *stage, const char *str)
 {
-	struct var_list *v;
+	struct sql_table *save_curr = sb->curr_table;
+	struct selection *selection;
+	struct expression *e;
+	const char *name;
+	char *p, *q;
 
-	v = malloc(sizeof(*v));
-	if (!v)
-		return -ENOMEM;
-	v->var = var;
-	v->val = val;
-	v->next = *vars;
-	*vars = v;
+	if (!stage->split)
+		return select_field(sb, stage, str);
 
-	return 0;
+	str = label_field(stage, str);
+
+	for (selection = stage->selections; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->type == EXPR_FIELD && strcmp(e->A, str) == 0)
+			return selection->synth_name;
+	}
+
+	sb->curr_table = stage;
+	e = add_field(sb, str, NULL);
+	if (e)
+		bind_field(sb, stage, e);
+	sb->curr_table = save_curr;
+
+	if (!e || !e->event || !e->field)
+		return NULL;
+
+	selection = arena_alloc(sb, sizeof(*selection));
+	if (!selection)
+		return NULL;
+
+	/* common_timestamp.usecs is not a name */
+	p = strdup(e->field);
+	if (!p)
+		return NULL;
+	for (q = p; (q = strchr(q, '.')); )
+		*q = '_';
+	name = store_str(sb, p);
+	free(p);
+
+	/* A common_timestamp field would hide that of the synthetic event */
+	if (name && (carried_item(stage, name) ||
+		     strncmp(name, "common_", 7) == 0))
+		name = store_printf(sb, "%s_%s", e->event->name, name);
+	if (!name || carried_item(stage, name))
+		name = make_dynamic_arg(sb);
+
+	/* The start histogram saves it in a variable for the trace */
+	if (e->event == &stage->from_event) {
+		e->name = make_dynamic_arg(sb);
+		selection->name = e->name;
+	}
+
+	selection->item = e;
+	selection->synth_name = name;
+	*stage->next_selection = selection;
+	stage->next_selection = &selection->next;
+
+	return name;
 }
 
-static void print_to_expr(struct trace_seq *s,
-			  struct sql_table *table, const char *event,
-			  struct expression *e,
-			  struct var_list **vars)
+static void bind_field(struct sqlhist_bison *sb, struct sql_table *table,
+		       struct expression *e)
 {
-	const char *actual;
 	const char *field;
-	int len = strlen(event);
 
-	switch (e->type) {
-	case EXPR_FIELD:
-		actual = show_raw_expr(e);
-		field = event_match(event, actual, len);
+	e->raw = expand(sb, e->A);
+
+	/* Anything not of the event joined to comes from the stage before */
+	if (table->from_table && !is_to_field(sb, table, e->A)) {
+		field = carry_field(sb, table->from_table,
+				    label_field(table, e->A));
 		if (field) {
-			trace_seq_printf(s, "%s", field);
-			break;
+			/* Without a join, the histogram is on the synthetic event */
+			if (table->to)
+				e->raw = store_printf(sb, "%s.%s",
+						      table->from_event.text, field);
+			else
+				e->raw = field;
+			e->event = &table->from_event;
+			e->field = field;
+			return;
 		}
+	}
 
-		field = strstr(actual, ".");
-		if (!field) {
-			trace_seq_printf(s, "%s", field);
-			break;
-		}
-		trace_seq_printf(s, "$%s", find_var(vars, actual));
-		break;
-	default:
-		print_to_expr(s, table, event, e->A, vars);
-		switch (e->type) {
-		case EXPR_PLUS:		trace_seq_printf(s, "+");	break;
-		case EXPR_MINUS:	trace_seq_printf(s, "-");	break;
-		case EXPR_MULT:		trace_seq_printf(s,"*");	break;
-		case EXPR_DIVID:	trace_seq_printf(s, "/");	break;
-		default: break;
-		}
-		print_to_expr(s, table, event, e->B, vars);
+	if (table->from && (field = event_match(table->from_event.text, e->raw))) {
+		e->event = &table->from_event;
+		e->field = field;
+	} else if (table->to && (field = event_match(table->to_event.text, e->raw))) {
+		e->event = &table->to_event;
+		e->field = field;
+	} else if ((field = strstr(e->raw, "."))) {
+		e->field = field + 1;
 	}
 }
 
-static int print_from_expr(struct trace_seq *s,
-			   struct sql_table *table, const char *event,
-			    struct expression *e, bool *start,
-			    struct var_list **vars)
+static void bind_expr(struct sqlhist_bison *sb, struct sql_table *table,
+		      struct expression *e)
 {
-	struct sqlhist_bison *sb = e->sb;
-	const char *actual;
-	const char *field;
-	int len = strlen(event);
-	int ret = 0;
+	if (!e)
+		return;
 
 	switch (e->type) {
 	case EXPR_FIELD:
-		actual = show_raw_expr(e);
-		field = event_match(event, actual, len);
-		if (field && !find_var(vars, actual)) {
-			print_val_delim(s, start);
-			if (!e->name)
-				e->name = make_dynamic_arg(sb);
-			trace_seq_printf(s, "%s=%s", e->name, field);
-			ret = add_var(vars, e->name, actual);
-			break;
-		}
+		bind_field(sb, table, e);
+		break;
+	case EXPR_STRING:
 		break;
+	case EXPR_BUCKET:
+	case EXPR_LOG2:
+	case EXPR_COUNT_DISTINCT:
+	case EXPR_SUM:
+	case EXPR_MIN:
+	case EXPR_MAX:
+		bind_expr(sb, table, e->A);
+		break;
+	case EXPR_COUNT:
+		break;
+	case EXPR_FILTER:
 	default:
-		print_from_expr(s, table, event, e->A, start, vars);
-		print_from_expr(s, table, event, e->B, start, vars);
+		bind_expr(sb, table, e->A);
+		bind_expr(sb, table, e->B);
+		break;
 	}
-	return ret;
 }
 
-static int print_value(struct trace_seq *s,
-		       struct sql_table *table,
-			const char *event, struct selection *selection,
-			enum value_type type, bool *start, struct var_list **vars)
+/* The keys of @event are the parts of the matches that are its fields */
+static const char *bind_key(struct sqlhist_bison *sb, const char *event,
+			    const char *A, const char *B)
 {
-	struct expression *e = selection->item;
-	const char *name = selection->name;
-	int len = strlen(event);
-	const char *actual;
-	const char *field;
-	int ret = 0;
+	const char *a = event_match(event, A);
+	const char *b = event_match(event, B);
 
-	switch (e->type) {
-	case EXPR_FIELD:
-		if (!selection->name || !e->name)
-			break;
-		actual = show_raw_expr(e);
-		field = event_match(event, actual, len);
-		if (field && type != VALUE_TO) {
-			print_val_delim(s, start);
-			trace_seq_printf(s, "%s=%s", e->name, field);
-			ret = add_var(vars, e->name, actual);
-		}
-		break;
-	default:
-		if (type == VALUE_TO) {
-			print_val_delim(s, start);
-			trace_seq_printf(s, "%s=", name);
-			print_to_expr(s, table, event, e, vars);
-		} else {
-			print_from_expr(s, table, event, e, start, vars);
-		}
-		break;
+	return store_printf(sb, "%s%s", a ? a : "", b ? b : "");
+}
+
+/*
+ * Filter pushdown.
+ *
+ * The WHERE clause is split at its top level ANDs. Every part whose
+ * fields are all of the same event goes into the "if" of the trigger
+ * on that event, so the kernel drops the event before it gets to the
+ * histogram. Whatever is left is kept as the table's residual.
+ */
+static struct bound_event *compare_event(struct sql_table *table,
+					 struct expression *e)
+{
+	struct expression *A = e->A;
+	struct expression *B = e->B;
+
+	/* The kernel only compares a field to a constant */
+	if (B->type == EXPR_FIELD && B->event)
+		return NULL;
+	if (A->event)
+		return A->event;
+
+	/* Without a join, the fields do not need the event in front */
+	if (!table->to && table->from)
+		return &table->from_event;
+
+	return NULL;
+}
+
+/* Returns the one event that all of @e is about, or NULL */
+static struct bound_event *cond_event(struct sql_table *table,
+				      struct expression *e)
+{
+	struct bound_event *a, *b;
+
+	switch (e->type) {
+	case EXPR_FILTER:
+		return compare_event(table, e);
+	case EXPR_NOT:
+		return cond_event(table, e->A);
+	case EXPR_AND:
+	case EXPR_OR:
+		a = cond_event(table, e->A);
+		b = cond_event(table, e->B);
+		return a == b ? a : NULL;
+	default:
+		return NULL;
 	}
+}
 
-	return ret;
+static struct expression *and_cond(struct sqlhist_bison *sb,
+				   struct expression *cond,
+				   struct expression *e)
+{
+	return cond ? add_and(sb, cond, e) : e;
 }
 
-static int print_values(struct trace_seq *s,
-			struct sql_table *table, const char *event,
-			 enum value_type type, struct var_list **vars)
+static void push_filter(struct sqlhist_bison *sb, struct sql_table *table,
+			struct expression *e)
 {
-	struct selection *selection;
-	struct expression *e;
-	char *f, *p;
-	bool start = true;
-	int ret = 0;
+	struct bound_event *event;
 
-	if (event) {
-		f = strdup(event);
-		if ((p = strstr(f, ".")))
-			*p = '\0';
+	if (!e)
+		return;
 
-		for (selection = table->selections; selection; selection = selection->next) {
-			ret = print_value(s, table, f, selection, type,
-					  &start, vars);
-		}
-		free(f);
-	} else {
-		for (selection = table->selections; selection; selection = selection->next) {
-			e = selection->item;
-			if (e->name && strncmp(e->name, "key", 3) == 0)
-				continue;
-			if (start) {
-				trace_seq_printf(s, ":values=");
-				start = false;
-			} else {
-				trace_seq_printf(s, ",");
-			}
-			trace_seq_printf(s, "%s", show_raw_expr(e));
+	if (e->type == EXPR_AND) {
+		push_filter(sb, table, e->A);
+		push_filter(sb, table, e->B);
+		return;
+	}
+
+	event = cond_event(table, e);
+	if (event)
+		event->filter = and_cond(sb, event->filter, e);
+	else
+		table->residual = and_cond(sb, table->residual, e);
+}
+
+/* Returns true if any field of @e is of the event @table joins to */
+static bool cond_has_to(struct sqlhist_bison *sb, struct sql_table *table,
+			struct expression *e)
+{
+	switch (e->type) {
+	case EXPR_FIELD:
+		return is_to_field(sb, table, e->A);
+	case EXPR_STRING:
+		return false;
+	default:
+		return cond_has_to(sb, table, e->A) ||
+			(e->B && cond_has_to(sb, table, e->B));
+	}
+}
+
+/*
+ * The parts of the WHERE clause that are about a single event of an
+ * earlier stage go into the trigger on that event, like any other
+ * pushed down filter. The rest is done on this table.
+ */
+static void push_stage_filter(struct sqlhist_bison *sb, struct sql_table *table,
+			      struct expression *e)
+{
+	struct sql_table *stage = table->from_table;
+
+	if (!e)
+		return;
+
+	if (e->type == EXPR_AND) {
+		push_stage_filter(sb, table, e->A);
+		push_stage_filter(sb, table, e->B);
+		return;
+	}
+
+	if (!cond_has_to(sb, table, e)) {
+		sb->curr_table = stage;
+		bind_expr(sb, stage, e);
+		sb->curr_table = table;
+		if (cond_event(stage, e)) {
+			if (stage->from_table)
+				push_stage_filter(sb, stage, e);
+			else
+				push_filter(sb, stage, e);
+			sb->curr_table = table;
+			return;
 		}
 	}
-	return ret;
+
+	bind_expr(sb, table, e);
+	push_filter(sb, table, e);
 }
 
-static void print_trace_field(struct trace_seq *s,
-			      struct sql_table *table, struct selection *selection)
+/* The start key is the field carried in the synthetic event of the stage */
+static void bind_stage_keys(struct sqlhist_bison *sb, struct sql_table *table,
+			    struct match_map *map)
+{
+	const char *to = map->A;
+	const char *from = map->B;
+	const char *field;
+
+	if (!is_to_field(sb, table, to)) {
+		to = map->B;
+		from = map->A;
+	}
+
+	to = expand(sb, to);
+	field = event_match(table->to_event.text, to);
+	map->to_key = field ? field : to;
+
+	map->from_key = carry_field(sb, table->from_table, from);
+	if (!map->from_key)
+		map->from_key = expand(sb, from);
+}
+
+/* Returns the field of @e if it is a field of @event */
+static const char *bound_field(struct expression *e, struct bound_event *event)
+{
+	if (e->type == EXPR_FIELD && e->event == event)
+		return e->field;
+
+	return NULL;
+}
+
+/*
+ * Picks the name of @selection in the synthetic event. The tables
+ * using the synthetic event refer to its fields by these names.
+ */
+static void name_synthetic_field(struct sqlhist_bison *sb,
+				 struct sql_table *table,
+				 struct selection *selection)
 {
 	struct expression *e = selection->item;
 	const char *name;
-	const char *actual;
 	const char *field;
-	const char *to;
-	int len;
 
-	to = resolve_expr(table, table->to);
-	len = strlen(to);
-
-	actual = show_raw_expr(e);
-	field = event_match(to, actual, len);
-	if (field) {
-		trace_seq_printf(s, ",%s", field);
+	/* Carried into a stage, with its name already picked */
+	if (selection->synth_name)
 		return;
-	}
 
 	name = selection->name;
 	if (!name)
 		name = e->name;
 	if (name) {
-		trace_seq_printf(s, ",$%s", name);
+		selection->synth_name = name;
 		return;
 	}
 
-	trace_seq_printf(s, ",ERROR");
+	field = bound_field(e, &table->to_event);
+	if (field) {
+		selection->synth_name = field;
+		return;
+	}
+
+	selection->name = make_dynamic_arg(sb);
+	e->name = selection->name;
+
+	if (e->type == EXPR_FIELD && e->field) {
+		/* Need to check for common_timestamp */
+		selection->synth_name = e->field;
+	} else {
+		selection->synth_name = e->name;
+	}
 }
 
-static void print_trace(struct trace_seq *s, struct sql_table *table)
+/* The selection that ORDER BY names, by its label or by its field */
+static struct selection *order_selection(struct sql_table *table)
+{
+	struct expression *order = table->order_by;
+	struct selection *selection;
+	struct expression *e;
+
+	for (selection = table->selections; selection; selection = selection->next) {
+		e = selection->item;
+		if ((selection->name && strcmp(selection->name, order->A) == 0) ||
+		    (e->type == EXPR_FIELD && strcmp(e->A, order->A) == 0))
+			return selection;
+	}
+
+	return NULL;
+}
+
+static bool is_aggregate_label(struct sql_table *table, const char *name)
+{
+	struct selection *selection;
+	struct expression *e;
+
+	for (selection = table->aggregates; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->name && strcmp(e->name, name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* A stage is bound before the tables that use its synthetic event */
+static void bind_table(struct sqlhist_bison *sb, struct sql_table *table)
+{
+	struct selection *selection;
+	struct match_map *map;
+	const char *A, *B;
+
+	if (table->bound)
+		return;
+	table->bound = true;
+
+	if (table->from_table)
+		bind_table(sb, table->from_table);
+
+	sb->curr_table = table;
+
+	if (table->from_table)
+		bind_stage_event(table->from_table, &table->from_event);
+	else if (table->from)
+		bind_event(sb, table, &table->from_event, table->from);
+	if (table->to)
+		bind_event(sb, table, &table->to_event, table->to);
+
+	for (selection = table->selections; selection; selection = selection->next)
+		bind_expr(sb, table, selection->item);
+	for (selection = table->aggregates; selection; selection = selection->next)
+		bind_expr(sb, table, selection->item);
+	for (selection = table->group_by; selection; selection = selection->next)
+		bind_expr(sb, table, selection->item);
+	/* A label is bound with what it labels */
+	if (table->order_by && !order_selection(table) &&
+	    !is_aggregate_label(table, table->order_by->A))
+		bind_expr(sb, table, table->order_by);
+
+	if (table->from_table) {
+		push_stage_filter(sb, table, table->filter);
+	} else {
+		bind_expr(sb, table, table->filter);
+		push_filter(sb, table, table->filter);
+	}
+
+	if (!table->to)
+		return;
+
+	for (map = table->matches; map; map = map->next) {
+		if (table->from_table) {
+			bind_stage_keys(sb, table, map);
+			continue;
+		}
+		A = expand(sb, map->A);
+		B = expand(sb, map->B);
+		map->from_key = bind_key(sb, table->from_event.text, A, B);
+		map->to_key = bind_key(sb, table->to_event.text, A, B);
+	}
+
+	for (selection = table->selections; selection; selection = selection->next)
+		name_synthetic_field(sb, table, selection);
+}
+
+static void bind_names(struct sqlhist_bison *sb)
+{
+	struct sql_table *save_curr = sb->curr_table;
+	struct table_map *tmap;
+
+	for (tmap = sb->table_list; tmap; tmap = tmap->next)
+		bind_table(sb, tmap->table);
+
+	sb->curr_table = save_curr;
+}
+
+static void bind_type(struct sqlhist_bison *sb, struct expression *e)
+{
+	struct sqlhist_catalog *catalog = sb->catalog;
+	const struct catalog_event *event;
+	const char *next = e->raw;
+	struct expression *item;
+	const char *tok;
+
+	if (e->event && e->event->table) {
+		/* A field of a stage has the type of what was carried */
+		item = carried_item(e->event->table, e->field);
+		/* A SELECT in FROM can select a whole expression, like a delta */
+		while (item && item->type != EXPR_FIELD)
+			item = item->A;
+		if (!item) {
+			e->type_error = store_printf(sb, "%s\nIs not selected by %s",
+						     e->raw, e->event->text);
+			return;
+		}
+		if (!item->field_type && !item->type_error)
+			bind_type(sb, item);
+		e->format = item->format;
+		e->field_type = item->field_type;
+		e->type_error = item->type_error;
+		return;
+	} else if (e->event) {
+		event = e->event->event;
+		next = e->field;
+	} else if (e->table && e->table->from && !e->table->to) {
+		/* Without a join, the fields do not need the event in front */
+		event = e->table->from_event.event;
+	} else {
+		/* Either "event.field" or "system.event.field" */
+		tok = next_token(sb, &next);
+		event = find_event(catalog, NULL, tok);
+		if (!event) {
+			tok = next_token(sb, &next);
+			if (tok)
+				event = find_event(catalog, NULL, tok);
+		}
+	}
+
+	if (!event) {
+		e->type_error = store_printf(sb, "%s\nIs not a field of a known event",
+					     e->raw);
+		return;
+	}
+
+	tok = next_token(sb, &next);
+	if (!tok)
+		return;
+
+	if (strcmp(tok, "common_timestamp") == 0) {
+		e->field_type = "u64";
+		return;
+	}
+
+	e->format = find_field(catalog, event, tok);
+	if (e->format)
+		e->field_type = field_type(catalog, e->format);
+	else
+		e->type_error = store_printf(sb, "%s\nThe event has no field %s",
+					     e->raw, tok);
+}
+
+/* Returns the first type error in @e, or NULL */
+static const char *bind_expr_types(struct sqlhist_bison *sb,
+				   struct expression *e)
+{
+	const char *error;
+
+	if (!e)
+		return NULL;
+
+	switch (e->type) {
+	case EXPR_FIELD:
+		bind_type(sb, e);
+		return e->type_error;
+	case EXPR_STRING:
+		return NULL;
+	case EXPR_BUCKET:
+	case EXPR_LOG2:
+	case EXPR_COUNT_DISTINCT:
+	case EXPR_SUM:
+	case EXPR_MIN:
+	case EXPR_MAX:
+		return bind_expr_types(sb, e->A);
+	case EXPR_COUNT:
+		return NULL;
+	default:
+		error = bind_expr_types(sb, e->A);
+		if (!error)
+			error = bind_expr_types(sb, e->B);
+		return error;
+	}
+}
+
+/* GROUP BY the label of a selection, which is typed with the selection */
+static bool is_selection_label(struct sql_table *table, struct expression *e)
+{
+	struct selection *selection;
+
+	if (e->type != EXPR_FIELD)
+		return false;
+
+	for (selection = table->selections; selection; selection = selection->next) {
+		if (selection->name && strcmp(selection->name, e->A) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static const char *bind_list_types(struct sqlhist_bison *sb,
+				   struct selection *selection)
+{
+	const char *error = NULL;
+
+	for (; selection && !error; selection = selection->next)
+		error = bind_expr_types(sb, selection->item);
+
+	return error;
+}
+
+/*
+ * The one place that reports an unknown event or field: the first one
+ * found fails the statement with its error.
+ */
+static int bind_types(struct sqlhist_bison *sb, struct sqlhist *sqlhist)
+{
+	struct selection *selection;
+	struct table_map *tmap;
+	struct sql_table *table;
+	struct bound_event *event;
+	const char *error = NULL;
+
+	/* A field of a stage gets its type from the events of the stage */
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		table = tmap->table;
+
+		event = &table->from_event;
+		if (table->from && !table->from_table)
+			event->event = find_event(sb->catalog, event->system,
+						  event->name);
+		event = &table->to_event;
+		if (table->to)
+			event->event = find_event(sb->catalog, event->system,
+						  event->name);
+	}
+
+	for (tmap = sb->table_list; tmap && !error; tmap = tmap->next) {
+		table = tmap->table;
+
+		error = bind_list_types(sb, table->selections);
+		if (!error)
+			error = bind_list_types(sb, table->aggregates);
+		for (selection = table->group_by; selection && !error;
+		     selection = selection->next) {
+			if (!is_selection_label(table, selection->item))
+				error = bind_expr_types(sb, selection->item);
+		}
+	}
+
+	if (!error)
+		return 0;
+
+	sqlhist->error = strdup(error);
+	return -1;
+}
+
+static void print_type(struct trace_seq *s, struct expression *e)
+{
+	while (e && e->type != EXPR_FIELD) {
+		e = e->A;
+	}
+
+	if (!e) {
+		trace_seq_printf(s, " (unknown-expression) ");
+		return;
+	}
+
+	if (e->field_type)
+		trace_seq_printf(s, " %s ", e->field_type);
+}
+
+static void print_synthetic_field(struct trace_seq *s,
+				  struct selection *selection)
+{
+	print_type(s, selection->item);
+	trace_seq_printf(s, "%s", selection->synth_name);
+}
+
+static void make_synthetic_events(struct trace_seq *s, struct sql_table *table)
+{
+	struct selection *selection;
+
+	if (!table)
+		return;
+
+	/* A histogram over a SELECT in FROM has no event of its own */
+	make_synthetic_events(s, find_table(table->from));
+	if (!table->to)
+		return;
+	if (table->from_table)
+		trace_seq_putc(s, '\n');
+
+	trace_seq_printf(s, "%s", table->name);
+	for (selection = table->selections; selection; selection = selection->next)
+		print_synthetic_field(s, selection);
+
+	make_synthetic_events(s, find_table(table->to));
+}
+
+/*
+ * Without a join, the keys are the selections labeled "key..." and
+ * those grouped with bucket() or log2().
+ */
+static bool is_key(struct expression *e)
+{
+	if (e->type == EXPR_BUCKET || e->type == EXPR_LOG2)
+		return true;
+
+	return e->name && strncmp(e->name, "key", 3) == 0;
+}
+
+static void print_key(struct trace_seq *s, struct expression *e)
+{
+	switch (e->type) {
+	case EXPR_BUCKET:
+		trace_seq_printf(s, "%s.buckets=%s", show_raw_expr(e->A),
+				 (char *)e->B);
+		break;
+	case EXPR_LOG2:
+		trace_seq_printf(s, "%s.log2", show_raw_expr(e->A));
+		break;
+	default:
+		trace_seq_printf(s, "%s", show_raw_expr(e));
+		break;
+	}
+}
+
+/*
+ * The field of the synthetic event of @table that @e names, if any:
+ * either by its name there, or by the field that was selected into it.
+ */
+static const char *synth_field(struct sql_table *table, struct expression *e)
+{
+	struct selection *selection;
+	struct expression *item;
+
+	if (e->type != EXPR_FIELD)
+		return NULL;
+
+	for (selection = table->selections; selection; selection = selection->next) {
+		if (!selection->synth_name)
+			continue;
+		item = selection->item;
+		if (strcmp(selection->synth_name, e->A) == 0 ||
+		    (item->type == EXPR_FIELD && strcmp(item->A, e->A) == 0))
+			return selection->synth_name;
+	}
+
+	return NULL;
+}
+
+/*
+ * GROUP BY and the aggregates. Without a join they are done by the
+ * histogram of the event itself, with a join by a histogram on the
+ * synthetic event (@synth), whose fields they then refer to:
+ *
+ *   GROUP BY x		x is a key
+ *   COUNT(*)		the hitcount, always there
+ *   COUNT(DISTINCT x)	x is a key too, one entry per value in each group
+ *   SUM(x)		x is a value
+ *   MAX(x)		x is saved in a variable tracked with onmax()
+ *
+ * The kernel has no onmin(), so there is no MIN().
+ */
+static const char *agg_field(struct sql_table *synth, struct expression *e)
+{
+	if (synth)
+		return synth_field(synth, e);
+	return show_raw_expr(e);
+}
+
+static bool is_grouped(struct sql_table *table, struct expression *e)
+{
+	struct selection *group;
+	struct expression *item;
+
+	if (e->type != EXPR_FIELD)
+		return false;
+
+	for (group = table->group_by; group; group = group->next) {
+		item = group->item;
+		if (strcmp(item->A, e->A) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* GROUP BY the label of a selection that is already a key */
+static bool is_key_label(struct sql_table *table, struct expression *e)
+{
+	struct selection *selection;
+
+	for (selection = table->selections; selection; selection = selection->next) {
+		if (selection->name && strcmp(selection->name, e->A) == 0)
+			return is_key(selection->item);
+	}
+
+	return false;
+}
+
+/* Returns the expression whose field is missing from @synth, or NULL */
+static struct expression *print_group_keys(struct trace_seq *s,
+					   struct sql_table *table,
+					   struct sql_table *synth, int *start)
+{
+	struct selection *selection;
+	struct expression *e;
+	const char *field;
+
+	for (selection = table->group_by; selection; selection = selection->next) {
+		e = selection->item;
+		if (!synth && is_key_label(table, e))
+			continue;
+		field = agg_field(synth, e);
+		if (!field)
+			return e;
+		trace_seq_printf(s, "%s%s", (*start)++ ? "," : "", field);
+	}
+
+	for (selection = table->aggregates; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->type != EXPR_COUNT_DISTINCT)
+			continue;
+		field = agg_field(synth, e->A);
+		if (!field)
+			return e->A;
+		trace_seq_printf(s, "%s%s", (*start)++ ? "," : "", field);
+	}
+
+	return NULL;
+}
+
+static struct expression *print_sums(struct trace_seq *s,
+				     struct sql_table *table,
+				     struct sql_table *synth, bool *start)
+{
+	struct selection *selection;
+	struct expression *e;
+	const char *field;
+
+	for (selection = table->aggregates; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->type != EXPR_SUM)
+			continue;
+		field = agg_field(synth, e->A);
+		if (!field)
+			return e->A;
+		trace_seq_printf(s, "%s%s", *start ? ":values=" : ",", field);
+		*start = false;
+	}
+
+	return NULL;
+}
+
+static struct expression *print_maxes(struct trace_seq *s,
+				      struct sql_table *table,
+				      struct sql_table *synth)
+{
+	struct selection *selection;
+	struct expression *e;
+	const char *field;
+	const char *var;
+
+	for (selection = table->aggregates; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->type != EXPR_MAX)
+			continue;
+		field = agg_field(synth, e->A);
+		if (!field)
+			return e->A;
+		if (!e->name)
+			e->name = make_dynamic_arg(table->sb);
+		var = def_var(table, synth ? NULL : &table->from_event, e->name);
+		trace_seq_printf(s, ":%s=%s:onmax($%s).save(%s)",
+				 var, field, var, field);
+	}
+
+	return NULL;
+}
+
+/*
+ * ORDER BY an aggregate or a key of the histogram is done by the
+ * histogram itself, with :sort=. It only sorts what it shows, so LIMIT
+ * is left to whoever reads it (see sqlhist_print_top()), which then
+ * only reads the first entries:
+ *
+ *   COUNT(*)		sort=hitcount
+ *   SUM(x)		sort=x
+ *   GROUP BY x		sort=x
+ *   bucket(x)		sort=x, for any key of a plain SELECT
+ */
+static struct expression *order_aggregate(struct sql_table *table)
+{
+	struct selection *selection;
+	struct expression *e;
+
+	for (selection = table->aggregates; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->name && strcmp(e->name, table->order_by->A) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static bool is_sorted(struct sql_table *table)
+{
+	struct selection *selection;
+
+	if (!table->order_by)
+		return false;
+	if (order_aggregate(table) || is_grouped(table, table->order_by))
+		return true;
+
+	selection = order_selection(table);
+	return selection && !table->to && is_key(selection->item);
+}
+
+/* With @synth, the fields are those of its synthetic event */
+static const char *sort_field(struct sql_table *table, struct sql_table *synth)
+{
+	struct selection *selection;
+	struct expression *e;
+
+	e = order_aggregate(table);
+	if (e) {
+		switch (e->type) {
+		case EXPR_COUNT:
+			return "hitcount";
+		case EXPR_SUM:
+			return agg_field(synth, e->A);
+		default:
+			/* Their values are in variables, not in the entries */
+			return NULL;
+		}
+	}
+
+	e = table->order_by;
+	selection = order_selection(table);
+	if (selection && !synth)
+		e = selection->item;
+	if (e->type == EXPR_BUCKET || e->type == EXPR_LOG2)
+		e = e->A;
+
+	return agg_field(synth, e);
+}
+
+static void print_sort(struct trace_seq *s, struct sql_table *table,
+		       struct sql_table *synth)
+{
+	if (!is_sorted(table))
+		return;
+
+	trace_seq_printf(s, ":sort=%s%s", sort_field(table, synth),
+			 table->order_desc ? ".descending" : "");
+}
+
+/*
+ * ORDER BY x DESC LIMIT 1 keeps the maximum of x in the kernel with
+ * onmax(), along with the fields of the event that set it. With
+ * WITH (snapshot = true) the trace buffer is also snapshot at every new
+ * maximum. The histogram that does it is the one with x in a variable:
+ * the end histogram of a join, the histogram on the synthetic event
+ * with a GROUP BY, or else the histogram of the event itself.
+ */
+static bool is_onmax(struct sql_table *table)
+{
+	return table->order_by && !is_sorted(table) && table->order_desc &&
+		table->limit && strcmp(table->limit, "1") == 0;
+}
+
+static bool is_snapshot(struct sql_table *table)
+{
+	return table->snapshot && strcasecmp(table->snapshot, "true") == 0;
+}
+
+/* save() only takes fields of the event, and common_timestamp is not one */
+static bool is_save_field(const char *field)
+{
+	return field && strncmp(field, "common_timestamp", 16) != 0;
+}
+
+static void print_save_field(struct trace_seq *s, const char *field, int *cnt)
+{
+	trace_seq_printf(s, "%s%s", (*cnt)++ ? "," : "", field);
+}
+
+/* With @synth, the fields are those of its synthetic event */
+static void print_onmax(struct trace_seq *s, struct sql_table *table,
+			struct bound_event *event, struct sql_table *synth,
+			const char *var)
+{
+	struct selection *selection;
+	struct match_map *map;
+	struct expression *e;
+	const char *field;
+	int cnt = 0;
+
+	trace_seq_printf(s, ":onmax($%s).save(", var);
+	for (selection = table->selections; selection; selection = selection->next) {
+		e = selection->item;
+		if (synth)
+			field = selection->synth_name;
+		else if (table->to)
+			field = bound_field(e, event);
+		else
+			field = e->type == EXPR_FIELD ? show_raw_expr(e) : NULL;
+		if (is_save_field(field))
+			print_save_field(s, field, &cnt);
+	}
+	/* The end event of a join at least has its keys */
+	if (!cnt && event == &table->to_event) {
+		for (map = table->matches; map; map = map->next)
+			print_save_field(s, map->to_key, &cnt);
+	}
+	if (!cnt)
+		print_save_field(s, "common_pid", &cnt);
+	trace_seq_printf(s, ")");
+
+	if (is_snapshot(table))
+		trace_seq_printf(s, ":onmax($%s).snapshot()", var);
+}
+
+/* Saves the ORDER BY value in a variable of its own to track it */
+static struct expression *print_order_max(struct trace_seq *s,
+					  struct sql_table *table,
+					  struct sql_table *synth)
+{
+	struct selection *selection;
+	struct expression *e;
+	const char *field;
+	const char *var;
+
+	if (!is_onmax(table))
+		return NULL;
+
+	/* The synthetic event has it by its name, the event by its fields */
+	e = table->order_by;
+	selection = order_selection(table);
+	if (selection && !synth)
+		e = selection->item;
+
+	field = agg_field(synth, e);
+	if (!field)
+		return table->order_by;
+
+	if (!table->order_var)
+		table->order_var = make_dynamic_arg(table->sb);
+	var = def_var(table, synth ? NULL : &table->from_event, table->order_var);
+	trace_seq_printf(s, ":%s=%s", var, field);
+	print_onmax(s, table, &table->from_event, synth, var);
+
+	return NULL;
+}
+
+static void print_keys(struct trace_seq *s, struct sql_table *table,
+		       struct bound_event *event)
+{
+	struct selection *selection;
+	struct match_map *map;
+	struct expression *e;
+	int start = 0;
+
+	if (event) {
+		for (map = table->matches; map; map = map->next) {
+			if (start++)
+				trace_seq_printf(s, ",");
+			if (event == &table->from_event)
+				trace_seq_printf(s, "%s", map->from_key);
+			else
+				trace_seq_printf(s, "%s", map->to_key);
+		}
+	} else {
+		for (selection = table->selections; selection; selection = selection->next) {
+			e = selection->item;
+			if (!is_key(e))
+				continue;
+			if (start++)
+				trace_seq_printf(s, ",");
+			print_key(s, e);
+		}
+		print_group_keys(s, table, NULL, &start);
+	}
+}
+
+enum value_type {
+	VALUE_TO,
+	VALUE_FROM,
+};
+
+static void print_val_delim(struct trace_seq *s, bool *start)
+{
+	if (*start) {
+		trace_seq_printf(s, ":");
+		*start = false;
+	} else
+		trace_seq_printf(s, ",");
+}
+
+static const char *find_var(struct var_list **vars, const char *val)
+{
+	unsigned int id = str_id(val);
+	struct var_list *v;
+	
+	for (v = *vars; v; v = v->next) {
+		if (v->val_id == id)
+		    return v->var;
+	}
+
+	return NULL;
+}
+
+static int add_var(struct sqlhist_bison *sb, struct var_list **vars,
+		   const char *var, const char *val)
+{
+	struct var_list *v;
+
+	v = arena_alloc(sb, sizeof(*v));
+	if (!v)
+		return -ENOMEM;
+	v->var = var;
+	v->val_id = str_id(val);
+	v->next = *vars;
+	*vars = v;
+
+	return 0;
+}
+
+static void print_to_expr(struct trace_seq *s,
+			  struct sql_table *table, struct bound_event *event,
+			  struct expression *e,
+			  struct var_list **vars)
+{
+	const char *field;
+
+	switch (e->type) {
+	case EXPR_FIELD:
+		field = bound_field(e, event);
+		if (field) {
+			trace_seq_printf(s, "%s", field);
+			break;
+		}
+
+		/* Not a field at all, but a constant */
+		if (!e->field) {
+			trace_seq_printf(s, "%s", e->raw);
+			break;
+		}
+		trace_seq_printf(s, "$%s", find_var(vars, e->raw));
+		break;
+	default:
+		print_to_expr(s, table, event, e->A, vars);
+		switch (e->type) {
+		case EXPR_PLUS:		trace_seq_printf(s, "+");	break;
+		case EXPR_MINUS:	trace_seq_printf(s, "-");	break;
+		case EXPR_MULT:		trace_seq_printf(s,"*");	break;
+		case EXPR_DIVID:	trace_seq_printf(s, "/");	break;
+		default: break;
+		}
+		print_to_expr(s, table, event, e->B, vars);
+	}
+}
+
+static int print_from_expr(struct trace_seq *s,
+			   struct sql_table *table, struct bound_event *event,
+			    struct expression *e, bool *start,
+			    struct var_list **vars)
+{
+	struct sqlhist_bison *sb = e->sb;
+	const char *field;
+	const char *var;
+	int ret = 0;
+
+	switch (e->type) {
+	case EXPR_FIELD:
+		field = bound_field(e, event);
+		if (field && !find_var(vars, e->raw)) {
+			print_val_delim(s, start);
+			if (!e->name)
+				e->name = make_dynamic_arg(sb);
+			var = def_var(table, event, e->name);
+			trace_seq_printf(s, "%s=%s", var, field);
+			ret = add_var(sb, vars, var, e->raw);
+			break;
+		}
+		break;
+	default:
+		print_from_expr(s, table, event, e->A, start, vars);
+		print_from_expr(s, table, event, e->B, start, vars);
+	}
+	return ret;
+}
+
+static int print_value(struct trace_seq *s,
+		       struct sql_table *table,
+			struct bound_event *event, struct selection *selection,
+			enum value_type type, bool *start, struct var_list **vars)
+{
+	struct expression *e = selection->item;
+	const char *name = selection->name;
+	struct sqlhist_bison *sb = e->sb;
+	const char *field;
+	const char *var;
+	int ret = 0;
+
+	switch (e->type) {
+	case EXPR_FIELD:
+		if (!selection->name || !e->name)
+			break;
+		field = bound_field(e, event);
+		/* A field is saved once, whatever it is selected as */
+		if (field && type != VALUE_TO && !find_var(vars, e->raw)) {
+			print_val_delim(s, start);
+			var = def_var(table, event, e->name);
+			trace_seq_printf(s, "%s=%s", var, field);
+			ret = add_var(sb, vars, var, e->raw);
+		}
+		break;
+	default:
+		if (type == VALUE_TO) {
+			print_val_delim(s, start);
+			trace_seq_printf(s, "%s=", def_var(table, event, name));
+			print_to_expr(s, table, event, e, vars);
+		} else {
+			print_from_expr(s, table, event, e, start, vars);
+		}
+		break;
+	}
+
+	return ret;
+}
+
+static int print_values(struct trace_seq *s,
+			struct sql_table *table, struct bound_event *event,
+			 enum value_type type, struct var_list **vars)
+{
+	struct selection *selection;
+	struct expression *e;
+	bool start = true;
+	int ret = 0;
+
+	if (event) {
+		for (selection = table->selections; selection; selection = selection->next) {
+			ret = print_value(s, table, event, selection, type,
+					  &start, vars);
+		}
+	} else {
+		for (selection = table->selections; selection; selection = selection->next) {
+			e = selection->item;
+			if (is_key(e) || is_grouped(table, e))
+				continue;
+			if (start) {
+				trace_seq_printf(s, ":values=");
+				start = false;
+			} else {
+				trace_seq_printf(s, ",");
+			}
+			trace_seq_printf(s, "%s", show_raw_expr(e));
+		}
+		print_sums(s, table, NULL, &start);
+		print_maxes(s, table, NULL);
+		print_order_max(s, table, NULL);
+		print_sort(s, table, NULL);
+	}
+	return ret;
+}
+
+static void print_trace_field(struct trace_seq *s,
+			      struct sql_table *table, struct selection *selection)
+{
+	struct expression *e = selection->item;
+	const char *name;
+	const char *field;
+
+	field = bound_field(e, &table->to_event);
+	if (field) {
+		trace_seq_printf(s, ",%s", field);
+		return;
+	}
+
+	/* A field of the start event is in the variable that saved it */
+	name = NULL;
+	if (e->type == EXPR_FIELD && bound_field(e, &table->from_event))
+		name = find_var(&table->vars, e->raw);
+	if (!name)
+		name = selection->name;
+	if (!name)
+		name = e->name;
+	if (name) {
+		trace_seq_printf(s, ",$%s", sqlhist_var_name(table, name));
+		return;
+	}
+
+	trace_seq_printf(s, ",ERROR");
+}
+
+static void print_trace(struct trace_seq *s, struct sql_table *table)
+{
+	struct selection *selection;
+
+	trace_seq_printf(s, ".trace(%s", table->name);
+
+	for (selection = table->selections; selection; selection = selection->next)
+		print_trace_field(s, table, selection);
+	trace_seq_printf(s, ")");
+}
+
+/* With @synth, the fields are those of its synthetic event */
+static void print_compare(struct trace_seq *s, struct expression *e,
+			  struct sql_table *synth)
+{
+	struct expression *A = e->A;
+	struct expression *B = e->B;
+	const char *field;
+
+	if (synth)
+		field = synth_field(synth, A);
+	else
+		field = A->event ? A->field : A->raw;
+
+	trace_seq_printf(s, "%s %s ", field, e->op);
+
+	if (B->type == EXPR_STRING)
+		trace_seq_printf(s, "\"%s\"", (char *)B->A);
+	else
+		trace_seq_printf(s, "%s", (char *)B->A);
+}
+
+static void print_cond(struct trace_seq *s, struct expression *e,
+		       struct sql_table *synth)
+{
+	switch (e->type) {
+	case EXPR_AND:
+		print_cond(s, e->A, synth);
+		trace_seq_printf(s, " && ");
+		print_cond(s, e->B, synth);
+		break;
+	case EXPR_OR:
+		trace_seq_printf(s, "(");
+		print_cond(s, e->A, synth);
+		trace_seq_printf(s, " || ");
+		print_cond(s, e->B, synth);
+		trace_seq_printf(s, ")");
+		break;
+	case EXPR_NOT:
+		trace_seq_printf(s, "!(");
+		print_cond(s, e->A, synth);
+		trace_seq_printf(s, ")");
+		break;
+	case EXPR_FILTER:
+		print_compare(s, e, synth);
+		break;
+	default:
+		trace_seq_printf(s, "<NOT A FILTER>");
+		break;
+	}
+}
+
+/* The parts of the WHERE clause that were pushed down to @event */
+static void print_filter(struct trace_seq *s, struct bound_event *event)
+{
+	if (!event->filter)
+		return;
+
+	trace_seq_printf(s, " if ");
+	print_cond(s, event->filter, NULL);
+}
+
+/* Returns true if all of @e is about the synthetic event of @table */
+static bool cond_synth(struct sql_table *table, struct expression *e)
+{
+	struct expression *B;
+
+	switch (e->type) {
+	case EXPR_FILTER:
+		B = e->B;
+		if (B->type == EXPR_FIELD && B->event)
+			return false;
+		return synth_field(table, e->A) != NULL;
+	case EXPR_NOT:
+		return cond_synth(table, e->A);
+	case EXPR_AND:
+	case EXPR_OR:
+		return cond_synth(table, e->A) && cond_synth(table, e->B);
+	default:
+		return false;
+	}
+}
+
+static void print_system_event(struct trace_seq *s, struct sqlhist_bison *sb,
+			       struct bound_event *event, char delim)
+{
+	trace_seq_printf(s, "%s%c%s", bound_system(sb, event), delim,
+			 event->name);
+}
+
+
+/*
+ * The output is built in one trace_seq, each string ending with its
+ * '\0'. Only where the strings start is recorded while building it, as
+ * the buffer may still move.
+ */
+struct emit {
+	struct trace_seq	s;
+	ssize_t			offs[SQLHIST_NR_STRS];
+	size_t			lens[SQLHIST_NR_STRS];
+};
+
+static void end_str(struct emit *out, enum sqlhist_str str, ssize_t start)
+{
+	out->offs[str] = start;
+	out->lens[str] = out->s.len - start;
+	trace_seq_putc(&out->s, '\0');
+}
+
+static void add_str(struct emit *out, enum sqlhist_str str, const char *val)
+{
+	ssize_t start = out->s.len;
+
+	trace_seq_puts(&out->s, val);
+	end_str(out, str, start);
+}
+
+/*
+ * The worst case number of entries of a histogram: the product of the
+ * number of values each of its keys can take. ULLONG_MAX means there
+ * is no bound (a string key, or more than fits).
+ */
+static unsigned long long mul_entries(unsigned long long a,
+				      unsigned long long b)
+{
+	if (a && b > ULLONG_MAX / a)
+		return ULLONG_MAX;
+	return a * b;
+}
+
+static unsigned long long bits_entries(int bits)
+{
+	if (bits < 0 || bits >= 64)
+		return ULLONG_MAX;
+	return 1ULL << bits;
+}
+
+/* How many bits a field can vary in, or -1 if it is not a number */
+static int field_bits(const struct catalog_field *field)
+{
+	if (!field || field->flags & (TEP_FIELD_IS_STRING | TEP_FIELD_IS_ARRAY |
+				      TEP_FIELD_IS_DYNAMIC))
+		return -1;
+	return field->size * 8;
+}
+
+/* PID_MAX_LIMIT, for when /proc can not tell */
+#define PID_MAX_DEFAULT		4194304ULL
+
+/* Read once; racing threads would all read the same value */
+unsigned long long sqlhist_pid_max(void)
+{
+	static unsigned long long max;
+	unsigned long long val;
+	FILE *fp;
+
+	val = __atomic_load_n(&max, __ATOMIC_RELAXED);
+	if (val)
+		return val;
+
+	fp = fopen("/proc/sys/kernel/pid_max", "r");
+	if (!fp || fscanf(fp, "%llu", &val) != 1 || !val)
+		val = PID_MAX_DEFAULT;
+	if (fp)
+		fclose(fp);
+
+	__atomic_store_n(&max, val, __ATOMIC_RELAXED);
+	return val;
+}
+
+unsigned long long sqlhist_nr_cpus(void)
+{
+	static unsigned long long cpus;
+	unsigned long long val;
+	long ret;
+
+	val = __atomic_load_n(&cpus, __ATOMIC_RELAXED);
+	if (val)
+		return val;
+
+	ret = sysconf(_SC_NPROCESSORS_CONF);
+	val = ret > 0 ? ret : ULLONG_MAX;
+
+	__atomic_store_n(&cpus, val, __ATOMIC_RELAXED);
+	return val;
+}
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+	size_t len = strlen(str);
+	size_t slen = strlen(suffix);
+
+	return len >= slen && strcmp(str + len - slen, suffix) == 0;
+}
+
+/*
+ * Some fields take far fewer values than their size allows: pids stay
+ * below pid_max, and CPUs below the number of CPUs.
+ */
+static unsigned long long field_entries(struct sqlhist_catalog *catalog,
+					const struct catalog_field *field)
+{
+	unsigned long long entries = bits_entries(field_bits(field));
+	unsigned long long bound = ULLONG_MAX;
+	const char *name;
+
+	if (!catalog || !field)
+		return entries;
+
+	name = catalog_str(catalog, field->name);
+	if (strcmp(field_type(catalog, field), "pid_t") == 0 ||
+	    has_suffix(name, "pid"))
+		bound = sqlhist_pid_max();
+	else if (has_suffix(name, "cpu"))
+		bound = sqlhist_nr_cpus();
+
+	return entries < bound ? entries : bound;
+}
+
+static int key_bits(struct expression *e)
+{
+	if (e->format)
+		return field_bits(e->format);
+
+	/* common_timestamp */
+	if (e->field_type)
+		return 64;
+
+	return -1;
+}
+
+static unsigned long long key_entries(struct expression *e)
+{
+	unsigned long long size;
+	int bits;
+
+	switch (e->type) {
+	case EXPR_FIELD:
+		if (e->format)
+			return field_entries(e->sb->catalog, e->format);
+		return bits_entries(key_bits(e));
+	case EXPR_LOG2:
+		bits = key_bits(e->A);
+		return bits < 0 ? ULLONG_MAX : bits + 1;
+	case EXPR_BUCKET:
+		bits = key_bits(e->A);
+		size = strtoull(e->B, NULL, 0);
+		if (bits < 0)
+			return ULLONG_MAX;
+		if (bits >= 64)
+			return ULLONG_MAX / size + 1;
+		return ((1ULL << bits) + size - 1) / size;
+	default:
+		return ULLONG_MAX;
+	}
+}
+
+/* The keys that GROUP BY and COUNT(DISTINCT) add */
+static unsigned long long group_entries(struct sql_table *table)
+{
+	unsigned long long entries = 1;
+	struct selection *selection;
+	struct expression *e;
+
+	for (selection = table->group_by; selection; selection = selection->next)
+		entries = mul_entries(entries, key_entries(selection->item));
+
+	for (selection = table->aggregates; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->type == EXPR_COUNT_DISTINCT)
+			entries = mul_entries(entries, key_entries(e->A));
+	}
+
+	return entries;
+}
+
+static const struct catalog_field *key_format(struct sqlhist_bison *sb,
+					      struct bound_event *event,
+					      const char *key)
+{
+	struct expression *item;
+
+	if (event->table) {
+		item = carried_item(event->table, key);
+		return item ? item->format : NULL;
+	}
+
+	return event->event ? find_field(sb->catalog, event->event, key) : NULL;
+}
+
+/* The entries of the histogram of @table on @event */
+static unsigned long long hist_entries(struct sqlhist_bison *sb,
+				       struct sql_table *table,
+				       struct bound_event *event)
+{
+	unsigned long long entries = 1;
+	const struct catalog_field *field;
+	struct selection *selection;
+	struct match_map *map;
+	const char *key;
+
+	if (!table->to) {
+		for (selection = table->selections; selection; selection = selection->next) {
+			if (is_key(selection->item))
+				entries = mul_entries(entries,
+						      key_entries(selection->item));
+		}
+		return mul_entries(entries, group_entries(table));
+	}
+
+	for (map = table->matches; map; map = map->next) {
+		key = event == &table->from_event ? map->from_key : map->to_key;
+		field = key_format(sb, event, key);
+		entries = mul_entries(entries, field_entries(sb->catalog, field));
+	}
+
+	return entries;
+}
+
+/*
+ * The kernel sizes a histogram to a power of two number of entries,
+ * from 2^7 to 2^17. Without a size hint, it is sized for the entries
+ * its keys can have, but only when that is a small, tight bound like
+ * the number of CPUs or buckets. A pid key could have pid_max entries,
+ * which is millions on most hosts, and every entry holds its keys,
+ * values and variables; such a histogram, or one with no bound at all,
+ * is left at the kernel default.
+ */
+static unsigned long long hist_size(unsigned long long entries)
+{
+	unsigned long long size = HIST_SIZE_MIN;
+
+	while (size < entries && size < HIST_SIZE_MAX)
+		size <<= 1;
+
+	return size;
+}
+
+/* The entries to size @table for, or 0 for the kernel default */
+static unsigned long long size_entries(struct sql_table *table,
+				       unsigned long long entries)
+{
+	if (table->size_hint)
+		return strtoull(table->size_hint, NULL, 0);
+
+	return entries > HIST_SIZE_AUTO_MAX ? 0 : entries;
+}
+
+static void print_size(struct trace_seq *s, struct sql_table *table,
+		       unsigned long long entries)
+{
+	entries = size_entries(table, entries);
+	if (entries)
+		trace_seq_printf(s, ":size=%llu", hist_size(entries));
+}
+
+static unsigned long long start_entries(struct sql_table *table)
+{
+	return size_entries(table, hist_entries(table->sb, table,
+						&table->from_event));
+}
+
+/* A shared start histogram is sized for the largest of its tables */
+static void print_start_size(struct trace_seq *s, struct sql_table *table)
+{
+	unsigned long long entries;
+	unsigned long long max;
+	struct sql_table *sharer;
+	bool sized;
+
+	entries = start_entries(table);
+	sized = entries;
+	max = entries ? : HIST_SIZE_DEFAULT;
+	for (sharer = table->sharers; sharer; sharer = sharer->next_sharer) {
+		entries = start_entries(sharer);
+		sized |= entries;
+		if (!entries)
+			entries = HIST_SIZE_DEFAULT;
+		if (entries > max)
+			max = entries;
+	}
+
+	if (sized)
+		trace_seq_printf(s, ":size=%llu", hist_size(max));
+}
+
+static int count_vars(struct var_list *vars)
+{
+	int cnt = 0;
+
+	for (; vars; vars = vars->next)
+		cnt++;
+
+	return cnt;
+}
+
+/*
+ * The tables that share the start histogram of @table (see
+ * sqlhist_share_starts()) save their own variables in it, even of the
+ * same fields: an end histogram reads a variable of another histogram
+ * once, which resets it for the end histograms of the others.
+ */
+static void print_start_hist(struct trace_seq *s, struct sql_table *table)
+{
+	struct bound_event *from = NULL;
+	struct var_list *vars;
+	struct sql_table *sharer;
+
+	if (table->to)
+		from = &table->from_event;
+
+	table->vars = NULL;
+	trace_seq_printf(s, "hist:keys=");
+	print_keys(s, table, from);
+	print_values(s, table, from, VALUE_FROM, &table->vars);
+	if (!table->sb->emitted)
+		table->nr_start_vars = count_vars(table->vars);
+	for (sharer = table->sharers; sharer; sharer = sharer->next_sharer) {
+		vars = NULL;
+		print_values(s, sharer, &sharer->from_event, VALUE_FROM, &vars);
+	}
+	print_start_size(s, table);
+	print_filter(s, &table->from_event);
+}
+
+/* Its end histogram needs the variables the shared start histogram saves */
+static void bind_shared_vars(struct sql_table *table)
+{
+	struct trace_seq s;
+
+	trace_seq_init(&s);
+	table->vars = NULL;
+	print_values(&s, table, &table->from_event, VALUE_FROM, &table->vars);
+	trace_seq_destroy(&s);
+}
+
+static void print_start_path(struct trace_seq *s, struct sql_table *table)
+{
+	trace_seq_printf(s, "events/");
+	print_system_event(s, table->sb, &table->from_event, '/');
+	trace_seq_printf(s, "/trigger");
+}
+
+/* Needs the variables that print_start_hist() saved */
+static void print_end_hist(struct trace_seq *s, struct sql_table *table)
+{
+	struct sqlhist_bison *sb = table->sb;
+	struct bound_event *to = &table->to_event;
+
+	if (table->shared_start)
+		bind_shared_vars(table);
+
+	trace_seq_printf(s, "hist:keys=");
+	print_keys(s, table, to);
+	print_values(s,table, to, VALUE_TO, &table->vars);
+	print_size(s, table, hist_entries(sb, table, to));
+	trace_seq_printf(s, ":onmatch(");
+	print_system_event(s, sb, &table->from_event, '.');
+	trace_seq_printf(s, ")");
+	print_trace(s, table);
+	/* The value is already in the variable that the trace passes on */
+	if (is_onmax(table) && !table->group_by)
+		print_onmax(s, table, to, NULL,
+			    sqlhist_var_name(table, order_selection(table)->name));
+	print_filter(s, to);
+}
+
+static void print_end_path(struct trace_seq *s, struct sql_table *table)
+{
+	trace_seq_printf(s, "events/");
+	print_system_event(s, table->sb, &table->to_event, '/');
+	trace_seq_printf(s, "/trigger");
+}
+
+/*
+ * Prints one of the triggers of every stage, first stage first. The
+ * start histograms of stages that share another one's are left out.
+ * Returns true if any was printed.
+ */
+static bool print_stages(struct trace_seq *s, struct sql_table *stage,
+			 void (*print)(struct trace_seq *, struct sql_table *),
+			 bool starts)
+{
+	struct sqlhist_bison *sb = stage->sb;
+	struct sql_table *save_curr;
+	bool printed = false;
+
+	if (stage->from_table)
+		printed = print_stages(s, stage->from_table, print, starts);
+
+	if (starts && stage->shared_start)
+		return printed;
+
+	if (printed)
+		trace_seq_putc(s, '\0');
+
+	save_curr = sb->curr_table;
+	sb->curr_table = stage;
+	print(s, stage);
+	sb->curr_table = save_curr;
+
+	return true;
+}
+
+static void make_stages(struct emit *out, struct sql_table *stage)
+{
+	ssize_t start;
+
+	start = out->s.len;
+	if (print_stages(&out->s, stage, print_start_hist, true))
+		end_str(out, SQLHIST_STAGE_START_HISTS, start);
+
+	start = out->s.len;
+	if (print_stages(&out->s, stage, print_start_path, true))
+		end_str(out, SQLHIST_STAGE_START_PATHS, start);
+
+	start = out->s.len;
+	print_stages(&out->s, stage, print_end_hist, false);
+	end_str(out, SQLHIST_STAGE_END_HISTS, start);
+
+	start = out->s.len;
+	print_stages(&out->s, stage, print_end_path, false);
+	end_str(out, SQLHIST_STAGE_END_PATHS, start);
+}
+
+static void make_histograms(struct emit *out, struct sql_table *table)
+{
+	struct sql_table *save_curr;
+	struct sqlhist_bison *sb;
+	ssize_t start;
+
+	if (!table)
+		return;
+
+	if (table->from_table)
+		make_stages(out, table->from_table);
+
+	sb = table->sb;
+	save_curr = sb->curr_table;
+	sb->curr_table = table;
+
+	/* Left out where it shares the start histogram of another table */
+	if (!table->shared_start) {
+		start = out->s.len;
+		print_start_hist(&out->s, table);
+		end_str(out, SQLHIST_START_HIST, start);
+
+		start = out->s.len;
+		print_start_path(&out->s, table);
+		end_str(out, SQLHIST_START_PATH, start);
+	}
+
+	if (table->to) {
+		start = out->s.len;
+		print_end_hist(&out->s, table);
+		end_str(out, SQLHIST_END_HIST, start);
+
+		start = out->s.len;
+		print_end_path(&out->s, table);
+		end_str(out, SQLHIST_END_PATH, start);
+	}
+
+	sb->curr_table = save_curr;
+}
+
+/* The kernel shows a column by its field, without the modifiers */
+static void print_result_col(struct trace_seq *s, int *cnt, const char *field,
+			     const char *name)
+{
+	if (!field)
+		return;
+	trace_seq_printf(s, "%s%.*s=%s", (*cnt)++ ? "," : "",
+			 (int)strcspn(field, "."), field, name);
+}
+
+/* The name of what is selected as, or grouped by, @e */
+static const char *result_name(struct sql_table *table, struct expression *e)
+{
+	struct selection *selection;
+	struct expression *item;
+
+	for (selection = table->selections; selection; selection = selection->next) {
+		item = selection->item;
+		if (selection->name && strcmp(selection->name, e->A) == 0)
+			return selection->name;
+		if (item->type == EXPR_FIELD && strcmp(item->A, e->A) == 0)
+			return selection->name ? : e->A;
+	}
+
+	return e->A;
+}
+
+/*
+ * The columns of the result histogram, as "field=name" in the order the
+ * kernel shows them: the keys, the hitcount and then the values. The
+ * name is what the column was selected as. MAX() is left out, as it is
+ * kept in a variable, which the kernel does not show in the entries.
+ */
+static void print_result_cols(struct trace_seq *s, struct sql_table *table)
+{
+	struct sql_table *synth = table->to ? table : NULL;
+	struct selection *selection;
+	struct match_map *map;
+	struct expression *e;
+	const char *count = "hitcount";
+	int cnt = 0;
+
+	/* An end histogram that tracks a maximum is keyed by the match */
+	if (table->to && !table->group_by) {
+		for (map = table->matches; map; map = map->next)
+			print_result_col(s, &cnt, map->to_key, map->to_key);
+		print_result_col(s, &cnt, count, count);
+		return;
+	}
+
+	if (!synth) {
+		for (selection = table->selections; selection; selection = selection->next) {
+			e = selection->item;
+			if (!is_key(e))
+				continue;
+			if (e->type == EXPR_BUCKET || e->type == EXPR_LOG2)
+				e = e->A;
+			print_result_col(s, &cnt, show_raw_expr(e),
+					 selection->name ? : show_raw_expr(e));
+		}
+	}
+
+	for (selection = table->group_by; selection; selection = selection->next) {
+		e = selection->item;
+		if (!synth && is_key_label(table, e))
+			continue;
+		print_result_col(s, &cnt, agg_field(synth, e),
+				 result_name(table, e));
+	}
+
+	for (selection = table->aggregates; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->type == EXPR_COUNT_DISTINCT)
+			print_result_col(s, &cnt, agg_field(synth, e->A),
+					 selection->name ? : show_raw_expr(e));
+		else if (e->type == EXPR_COUNT)
+			count = selection->name ? : show_raw_expr(e);
+	}
+
+	print_result_col(s, &cnt, "hitcount", count);
+
+	if (!synth) {
+		for (selection = table->selections; selection; selection = selection->next) {
+			e = selection->item;
+			if (is_key(e) || is_grouped(table, e))
+				continue;
+			print_result_col(s, &cnt, show_raw_expr(e),
+					 selection->name ? : show_raw_expr(e));
+		}
+	}
+
+	for (selection = table->aggregates; selection; selection = selection->next) {
+		e = selection->item;
+		if (e->type == EXPR_SUM)
+			print_result_col(s, &cnt, agg_field(synth, e->A),
+					 selection->name ? : show_raw_expr(e));
+	}
+}
+
+/*
+ * The hist file that the rows of the statement end up in: the
+ * histogram of the event, the one on the synthetic event with a GROUP
+ * BY, or the end histogram that tracks a maximum. Other joins only
+ * have synthetic events.
+ */
+static void make_result(struct emit *out, struct sql_table *table)
+{
+	struct bound_event *event;
+	ssize_t start;
+
+	if (!table->to)
+		event = &table->from_event;
+	else if (!table->group_by && is_onmax(table))
+		event = &table->to_event;
+	else
+		event = NULL;
+
+	start = out->s.len;
+	if (table->to && table->group_by) {
+		trace_seq_printf(&out->s, "events/synthetic/%s/hist",
+				 table->name);
+	} else if (event) {
+		trace_seq_printf(&out->s, "events/");
+		print_system_event(&out->s, table->sb, event, '/');
+		trace_seq_printf(&out->s, "/hist");
+	} else {
+		return;
+	}
+	end_str(out, SQLHIST_RESULT_PATH, start);
+
+	if (table->limit)
+		add_str(out, SQLHIST_LIMIT, table->limit);
+
+	start = out->s.len;
+	print_result_cols(&out->s, table);
+	end_str(out, SQLHIST_RESULT_COLS, start);
+}
+
+/* The format files (relative to tracefs) of the events that were used */
+static void print_formats(struct trace_seq *s, struct sqlhist_bison *sb)
+{
+	struct bound_event *events[2];
+	struct table_map *tmap;
+	const char *system;
+	int i;
+
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		events[0] = tmap->table->from ? &tmap->table->from_event : NULL;
+		events[1] = tmap->table->to ? &tmap->table->to_event : NULL;
+
+		for (i = 0; i < 2; i++) {
+			if (!events[i] || !events[i]->event)
+				continue;
+			system = events[i]->system;
+			if (!system)
+				system = event_system(sb->catalog, events[i]->event);
+			trace_seq_printf(s, "events/%s/%s/format\n",
+					 system, events[i]->name);
+		}
+	}
+}
+
+static void dump_tables(struct sqlhist_bison *sb)
+{
+	struct trace_seq s;
+
+	if (!sb->debug)
+		return;
+
+	trace_seq_init(&s);
+	dump_table(&s, sb->curr_table);
+
+	trace_seq_do_printf(&s);
+	trace_seq_destroy(&s);
+}
+
+void parse_error(struct sqlhist_bison *sb, int line, int idx,
+		 const char *text, const char *fmt, va_list ap)
+{
+	const char *buffer = sb->buffer;
+	struct trace_seq s;
+	int i;
+
+	if (!buffer)
+		return;
+
+	trace_seq_init(&s);
+	if (!s.buffer) {
+		fprintf(stderr, "Error allocating internal buffer\n");
+		return;
+	}
+
+	for (i = 0; line && buffer[i]; i++) {
+		if (buffer[i] == '\n')
+			line--;
+	}
+	for (; buffer[i] && buffer[i] != '\n'; i++)
+		trace_seq_putc(&s, buffer[i]);
+	trace_seq_putc(&s, '\n');
+	for (i = idx; i > 0; i--)
+		trace_seq_putc(&s, ' ');
+	trace_seq_puts(&s, "^\n");
+	trace_seq_printf(&s, "ERROR: '%s'\n", text);
+	trace_seq_vprintf(&s, fmt, ap);
+
+	trace_seq_terminate(&s);
+
+	sb->parse_error_str = strdup(s.buffer);
+	trace_seq_destroy(&s);
+}
+
+void print_buffer_line(struct sqlhist_bison *sb, int line, int idx)
+{
+	const char *buffer = sb->buffer;
+	int i;
+
+	if (!buffer)
+		return;
+
+	for (i = 0; line && buffer[i]; i++) {
+		if (buffer[i] == '\n')
+			line--;
+	}
+	for (; buffer[i] && buffer[i] != '\n'; i++)
+		printf("%c", buffer[i]);
+	printf("\n");
+	for (i = idx; i > 0; i--)
+		printf(" ");
+	printf("^\n");
+}
+
+int my_yyinput(struct sqlhist_bison *sb, char *buf, int max)
+{
+	if (!sb->buffer)
+		return read(0, buf, max);
+	
+	if (sb->buffer_idx + max > sb->buffer_size)
+		max = sb->buffer_size - sb->buffer_idx;
+
+	if (max)
+		memcpy(buf, sb->buffer + sb->buffer_idx, max);
+
+	sb->buffer_idx += max;
+	
+	return max;
+}
+
+const char *sqlhist_start_event(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_START_EVENT];
+}
+
+const char *sqlhist_end_event(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_END_EVENT];
+}
+
+const char *sqlhist_synth_event(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_SYNTH_EVENT];
+}
+
+const char *sqlhist_synth_event_def(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_SYNTH_EVENT_DEF];
+}
+
+const char *sqlhist_start_hist(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_START_HIST];
+}
+
+const char *sqlhist_end_hist(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_END_HIST];
+}
+
+const char *sqlhist_start_path(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_START_PATH];
+}
+
+const char *sqlhist_end_path(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_END_PATH];
+}
+
+const char *sqlhist_synth_filter(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_SYNTH_FILTER];
+}
+
+const char *sqlhist_synth_filter_path(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_SYNTH_FILTER_PATH];
+}
+
+const char *sqlhist_synth_hist(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_SYNTH_HIST];
+}
+
+const char *sqlhist_synth_hist_path(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_SYNTH_HIST_PATH];
+}
+
+const char *sqlhist_fold_path(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_FOLD_PATH];
+}
+
+const char *sqlhist_fold_key(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_FOLD_KEY];
+}
+
+const char *sqlhist_fold_value(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_FOLD_VALUE];
+}
+
+/* The hist file with the rows of the statement, relative to tracefs */
+const char *sqlhist_result_path(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_RESULT_PATH];
+}
+
+/**
+ * sqlhist_result_cols - the columns of the rows of the statement
+ * @sqlhist: The compiled statement
+ *
+ * Returns the columns of the entries in sqlhist_result_path() as a
+ * comma separated list of "field=name", where field is how the kernel
+ * shows the column and name what the statement selected it as. They
+ * are in the order the kernel shows them: the keys, the hitcount, and
+ * then the values. NULL if the rows are not in a histogram.
+ */
+const char *sqlhist_result_cols(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_RESULT_COLS];
+}
+
+/**
+ * sqlhist_limit - the LIMIT of the statement
+ * @sqlhist: The compiled statement
+ *
+ * Returns how many of the (sorted) rows in sqlhist_result_path() the
+ * statement asked for, or 0 for all of them.
+ */
+unsigned long long sqlhist_limit(struct sqlhist *sqlhist)
+{
+	const char *limit = sqlhist->strs[SQLHIST_LIMIT];
+
+	return limit ? strtoull(limit, NULL, 0) : 0;
+}
+
+/**
+ * sqlhist_max_entries - worst case size of the start histogram
+ * @sqlhist: The compiled statement
+ *
+ * Returns how many entries the start histogram can have at most, from
+ * the number of values its keys can take, or ULLONG_MAX if there is no
+ * such bound.
+ */
+unsigned long long sqlhist_max_entries(struct sqlhist *sqlhist)
+{
+	return sqlhist->max_entries;
+}
+
+const char *sqlhist_trace_dir(struct sqlhist *sqlhist)
+{
+	return sqlhist->strs[SQLHIST_TRACE_DIR];
+}
+
+const char *sqlhist_error(struct sqlhist *sqlhist)
+{
+	return sqlhist->error;
+}
+
+static void set_span(struct sqlhist_span *span, enum sqlhist_span_type type,
+		     const char *path, const char *data, size_t len)
+{
+	span->type = type;
+	span->path = path;
+	span->iov.iov_base = (void *)data;
+	span->iov.iov_len = len;
+}
+
+/* The stage triggers are lists of strings, each ending with its '\0' */
+static int stage_spans(struct sqlhist *sqlhist, struct sqlhist_span *spans,
+		       int nr, int cnt, enum sqlhist_span_type type,
+		       enum sqlhist_str hists, enum sqlhist_str paths)
+{
+	const char *hist = sqlhist->strs[hists];
+	const char *path = sqlhist->strs[paths];
+	const char *end;
+	size_t len;
+
+	if (!hist || !path)
+		return cnt;
+
+	for (end = hist + sqlhist->lens[hists]; hist < end; hist += len + 1) {
+		len = strlen(hist);
+		if (cnt < nr)
+			set_span(&spans[cnt], type, path, hist, len);
+		cnt++;
+		path += strlen(path) + 1;
+	}
+
+	return cnt;
+}
+
+/**
+ * sqlhist_spans - the writes that install a compiled statement
+ * @sqlhist: The compiled statement
+ * @spans: The array to fill in (may be NULL if @nr is 0)
+ * @nr: The size of @spans
+ *
+ * Fills in @spans with what to write to which tracefs file (relative to
+ * sqlhist_trace_dir()), in the order they must be written. Each one is
+ * a single command (without a new line) and must be written with a
+ * single write. They point into @sqlhist, nothing is copied.
+ *
+ * A join of more than two events has a synthetic event and a start and
+ * end histogram for every stage, so there is no fixed number of spans.
+ *
+ * Returns the number of spans, which may be more than @nr, or -1 if
+ * @sqlhist did not compile.
+ */
+int sqlhist_spans(struct sqlhist *sqlhist, struct sqlhist_span *spans, int nr)
+{
+	const char *def = sqlhist->strs[SQLHIST_SYNTH_EVENT_DEF];
+	const char *end;
+	int cnt = 0;
+
+	if (!sqlhist->strs[SQLHIST_START_EVENT]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* One synthetic event per line */
+	for (end = def; def && *def; def = *end ? end + 1 : end) {
+		end = strchrnul(def, '\n');
+		if (cnt < nr)
+			set_span(&spans[cnt], SQLHIST_SPAN_SYNTH,
+				 "synthetic_events", def, end - def);
+		cnt++;
+	}
+
+	if (sqlhist->strs[SQLHIST_SYNTH_FILTER]) {
+		if (cnt < nr)
+			set_span(&spans[cnt], SQLHIST_SPAN_FILTER,
+				 sqlhist->strs[SQLHIST_SYNTH_FILTER_PATH],
+				 sqlhist->strs[SQLHIST_SYNTH_FILTER],
+				 sqlhist->lens[SQLHIST_SYNTH_FILTER]);
+		cnt++;
+	}
+
+	if (sqlhist->strs[SQLHIST_SYNTH_HIST]) {
+		if (cnt < nr)
+			set_span(&spans[cnt], SQLHIST_SPAN_SYNTH_HIST,
+				 sqlhist->strs[SQLHIST_SYNTH_HIST_PATH],
+				 sqlhist->strs[SQLHIST_SYNTH_HIST],
+				 sqlhist->lens[SQLHIST_SYNTH_HIST]);
+		cnt++;
+	}
+
+	cnt = stage_spans(sqlhist, spans, nr, cnt, SQLHIST_SPAN_START,
+			  SQLHIST_STAGE_START_HISTS, SQLHIST_STAGE_START_PATHS);
+	/* Not there if sqlhist_share_starts() folded it into another */
+	if (sqlhist->strs[SQLHIST_START_HIST]) {
+		if (cnt < nr)
+			set_span(&spans[cnt], SQLHIST_SPAN_START,
+				 sqlhist->strs[SQLHIST_START_PATH],
+				 sqlhist->strs[SQLHIST_START_HIST],
+				 sqlhist->lens[SQLHIST_START_HIST]);
+		cnt++;
+	}
+
+	cnt = stage_spans(sqlhist, spans, nr, cnt, SQLHIST_SPAN_END,
+			  SQLHIST_STAGE_END_HISTS, SQLHIST_STAGE_END_PATHS);
+	if (sqlhist->strs[SQLHIST_END_HIST]) {
+		if (cnt < nr)
+			set_span(&spans[cnt], SQLHIST_SPAN_END,
+				 sqlhist->strs[SQLHIST_END_PATH],
+				 sqlhist->strs[SQLHIST_END_HIST],
+				 sqlhist->lens[SQLHIST_END_HIST]);
+		cnt++;
+	}
+
+	return cnt;
+}
+
+/**
+ * sqlhist_span_vars - the number of variables a trigger defines
+ * @span: The span of the trigger
+ *
+ * Counts the "name=value" variables of the histogram trigger of @span,
+ * which the kernel allows at most SQLHIST_MAX_VARS of in a histogram.
+ *
+ * Returns the number of variables, 0 if @span is not a histogram.
+ */
+int sqlhist_span_vars(const struct sqlhist_span *span)
+{
+	const char *hist = span->iov.iov_base;
+	const char *end = hist + span->iov.iov_len;
+	const char *filter;
+	const char *p, *q;
+	int cnt = 0;
+
+	if (span->iov.iov_len < 5 || strncmp(hist, "hist:", 5) != 0)
+		return 0;
+
+	filter = memmem(hist, span->iov.iov_len, " if ", 4);
+	if (filter)
+		end = filter;
+
+	for (p = hist + 5; p < end; p = q + 1) {
+		q = memchr(p, ':', end - p);
+		if (!q)
+			q = end;
+		/* Only a list of variables has no name of its own */
+		if (!memchr(p, '=', q - p) || memchr(p, '(', q - p) ||
+		    strncmp(p, "keys=", 5) == 0 ||
+		    strncmp(p, "values=", 7) == 0 ||
+		    strncmp(p, "vals=", 5) == 0 ||
+		    strncmp(p, "sort=", 5) == 0 ||
+		    strncmp(p, "size=", 5) == 0 ||
+		    strncmp(p, "name=", 5) == 0)
+			continue;
+		for (cnt++; (p = memchr(p, ',', q - p)); p++)
+			cnt++;
+	}
+
+	return cnt;
+}
+
+/* The kernel does not take a histogram with too many variables */
+static int check_vars(struct sqlhist *sqlhist)
+{
+	struct sqlhist_span *spans;
+	int ret = 0;
+	int cnt;
+	int i;
+
+	cnt = sqlhist_spans(sqlhist, NULL, 0);
+	if (cnt <= 0)
+		return 0;
+	spans = calloc(cnt, sizeof(*spans));
+	if (!spans)
+		return -1;
+	sqlhist_spans(sqlhist, spans, cnt);
+
+	for (i = 0; i < cnt; i++) {
+		if (sqlhist_span_vars(&spans[i]) <= SQLHIST_MAX_VARS)
+			continue;
+		asprintf(&sqlhist->error,
+			 "%.*s\n%d variables in %s, the kernel allows %d in a histogram",
+			 (int)spans[i].iov.iov_len, (char *)spans[i].iov.iov_base,
+			 sqlhist_span_vars(&spans[i]), spans[i].path,
+			 SQLHIST_MAX_VARS);
+		ret = -1;
+		break;
+	}
+
+	free(spans);
+	return ret;
+}
+
+/*
+ * bucket() and log2() modify a key, which only a plain SELECT has.
+ * Aggregates are over the whole selection, not part of an expression.
+ */
+static const char *check_func(struct sql_table *table, struct expression *e,
+			      bool top)
+{
+	struct expression *A;
+	const char *err;
+	char *end;
+
+	if (!e)
+		return NULL;
+
+	switch (e->type) {
+	case EXPR_BUCKET:
+	case EXPR_LOG2:
+		A = e->A;
+		if (!top || table->to)
+			return "bucket() and log2() can only be selected, in a SELECT without a JOIN";
+		if (A->type != EXPR_FIELD)
+			return "bucket() and log2() only take a field";
+		if (e->type == EXPR_BUCKET &&
+		    (strtoull(e->B, &end, 0) == 0 || *end))
+			return "The size of bucket() must be a positive number";
+		return NULL;
+	case EXPR_COUNT:
+	case EXPR_COUNT_DISTINCT:
+	case EXPR_SUM:
+	case EXPR_MIN:
+	case EXPR_MAX:
+		return "Aggregates can not be part of an expression";
+	case EXPR_FIELD:
+	case EXPR_STRING:
+		return NULL;
+	default:
+		err = check_func(table, e->A, false);
+		if (!err)
+			err = check_func(table, e->B, false);
+		return err;
+	}
+}
+
+static int check_functions(struct sqlhist_bison *sb, struct sqlhist *sqlhist)
 {
 	struct selection *selection;
+	struct table_map *tmap;
+	const char *err;
 
-	trace_seq_printf(s, ".trace(%s", table->name);
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		for (selection = tmap->table->selections; selection;
+		     selection = selection->next) {
+			err = check_func(tmap->table, selection->item, true);
+			if (!err)
+				continue;
+			asprintf(&sqlhist->error, "%s\n%s",
+				 show_expr(selection->item), err);
+			return -1;
+		}
+	}
 
-	for (selection = table->selections; selection; selection = selection->next)
-		print_trace_field(s, table, selection);
-	trace_seq_printf(s, ")");
+	return 0;
 }
 
-static void print_compare(struct trace_seq *s,
-			  struct sql_table *table, const char *event)
+static const char *check_aggregate(struct sqlhist_bison *sb,
+				   struct sql_table *table,
+				   struct expression *e)
 {
-	struct expression *filter = table->filter;
-	struct expression *A, *B;
-	const char *op;
-	const char *actual;
-	const char *field;
-	int len;
+	if (table != sb->top_table)
+		return "Aggregates can only be in the outer SELECT";
+	if (e->type == EXPR_MIN)
+		return "min() is not supported, the kernel can only track a maximum";
+	if (table->to && !table->group_by)
+		return "Aggregates over a JOIN need a GROUP BY";
+	return NULL;
+}
 
-	if (filter->type != EXPR_FILTER) {
-		trace_seq_printf(s, "<NOT A FILTER>");
-		return;
+static int check_aggregates(struct sqlhist_bison *sb, struct sqlhist *sqlhist)
+{
+	struct selection *selection;
+	struct table_map *tmap;
+	struct sql_table *table;
+	const char *err;
+
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		table = tmap->table;
+		if (table->group_by && table != sb->top_table) {
+			asprintf(&sqlhist->error, "GROUP BY %s\n%s",
+				 show_expr(table->group_by->item),
+				 "GROUP BY can only be in the outer SELECT");
+			return -1;
+		}
+		for (selection = table->aggregates; selection;
+		     selection = selection->next) {
+			err = check_aggregate(sb, table, selection->item);
+			if (!err)
+				continue;
+			asprintf(&sqlhist->error, "%s\n%s",
+				 show_expr(selection->item), err);
+			return -1;
+		}
 	}
 
-	A = filter->A;
-	B = filter->B;
-	op = filter->op;
-
-	len = strlen(event);
-
-	actual = show_raw_expr(A);
-	field = event_match(event, actual, len);
-	if (!field)
-		return;
-
-	trace_seq_printf(s, " if %s %s %s", field, op, show_expr(B));
+	return 0;
 }
 
-static void print_filter(struct trace_seq *s,
-			 struct sql_table *table, const char *event)
+/* Only a SELECT with a JOIN has a synthetic event to select from */
+static int check_selects(struct sqlhist_bison *sb, struct sqlhist *sqlhist)
 {
-	if (!table->filter || !event)
-		return;
+	struct table_map *tmap;
+	struct sql_table *select;
+
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		select = tmap->table->from_table;
+		if (!select || select->split || select->to)
+			continue;
+		asprintf(&sqlhist->error, "FROM (SELECT ...) AS %s\n%s",
+			 select->name,
+			 "A SELECT in FROM needs a JOIN, for a synthetic event to select from");
+		return -1;
+	}
 
-	print_compare(s, table, event);
+	return 0;
 }
 
-static void print_system_event(struct trace_seq *s,
-			       const char *text, char delim)
+static const char *check_order_by(struct sqlhist_bison *sb,
+				  struct sql_table *table)
 {
-	struct tep_event *event;
-	char *name = strdup(text);
-	char *tok;
-
-	strtok(name, ".");
-	tok = strtok(NULL, ".");
-	if (tok) {
-		trace_seq_printf(s, "%s%c%s", tok, delim, name);
-		goto out;
-	}
+	struct selection *selection;
+	struct expression *e;
 
-	event = find_event(tep, name);
-	if (!event) {
-		trace_seq_printf(s, "(system)%c%s", delim, name);
-		goto out;
+	if (table != sb->top_table)
+		return "ORDER BY can only be in the outer SELECT";
+	if (is_sorted(table)) {
+		if (!sort_field(table, table->to ? table : NULL))
+			return "The histogram can only sort by COUNT(*), a SUM() or a key";
+		return NULL;
 	}
+	if (is_aggregate_label(table, table->order_by->A))
+		return "The histogram can only sort by COUNT(*), a SUM() or a key";
+	if (!is_onmax(table))
+		return "Only an aggregate or a key can be sorted, or a value tracked with DESC LIMIT 1";
 
-	trace_seq_printf(s, "%s%c%s", event->system, delim, name);
+	/* Without a GROUP BY, the end histogram tracks it per match */
+	if (!table->to || table->group_by)
+		return NULL;
+	selection = order_selection(table);
+	e = selection ? selection->item : NULL;
+	if (!e || e->type == EXPR_FIELD)
+		return "Must be a value computed by the JOIN, like a latency";
 
- out:
-	free(name);
+	return NULL;
 }
 
-static void make_histograms(struct trace_seq *s, struct sqlhist *sqlhist,
-			    struct sql_table *table)
+static int check_order(struct sqlhist_bison *sb, struct sqlhist *sqlhist)
 {
-	struct sql_table *save_curr = curr_table;
-	struct var_list *vars = NULL;
-	const char *from = NULL;
-	const char *to;
-
-	if (!table)
-		return;
-
-	/* Need to do children and younger siblings first */
-	make_histograms(s, sqlhist, find_table(table->from));
+	struct table_map *tmap;
+	struct sql_table *table;
+	const char *err;
+	char *end;
+
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		table = tmap->table;
+		if (table->limit && !table->order_by) {
+			asprintf(&sqlhist->error, "LIMIT %s\n%s", table->limit,
+				 "LIMIT needs an ORDER BY");
+			return -1;
+		}
+		if (table->limit &&
+		    (strtoull(table->limit, &end, 0) == 0 || *end)) {
+			asprintf(&sqlhist->error, "LIMIT %s\n%s", table->limit,
+				 "The limit must be a positive number");
+			return -1;
+		}
+		if (is_snapshot(table) && !is_onmax(table)) {
+			asprintf(&sqlhist->error, "WITH (snapshot = %s)\n%s",
+				 table->snapshot,
+				 "The snapshot is taken at a new maximum, which needs ORDER BY ... DESC LIMIT 1");
+			return -1;
+		}
+		if (!table->order_by)
+			continue;
+		err = check_order_by(sb, table);
+		if (!err)
+			continue;
+		asprintf(&sqlhist->error, "ORDER BY %s\n%s",
+			 show_expr(table->order_by), err);
+		return -1;
+	}
 
-	curr_table = table;
+	return 0;
+}
 
-	if (table->to)
-		from = resolve_expr(table, table->from);
+static int residual_error(struct sqlhist *sqlhist, struct sql_table *table)
+{
+	asprintf(&sqlhist->error,
+		 "WHERE %s\nCan only compare a field of one event, or of the synthetic event, with a constant",
+		 show_expr(table->residual));
+	return -1;
+}
 
-	trace_seq_reset(s);
-	trace_seq_printf(s, "hist:keys=");
-	print_keys(s, table, from);
-	print_values(s, table, from, VALUE_FROM, &vars);
-	print_filter(s, table, from);
-	trace_seq_terminate(s);
+/*
+ * What the pushdown left over can still be done by a filter on the
+ * synthetic event of the top table, if it is only about its fields
+ * (like the delta of a latency). The filter drops the synthetic events
+ * that do not match before they are committed to the ring buffer.
+ *
+ * Anything else compares the fields of both events, or is an OR
+ * across them, and no trigger can do that.
+ */
+static int check_residual(struct sqlhist_bison *sb, struct sqlhist *sqlhist)
+{
+	struct table_map *tmap;
+	struct sql_table *table;
 
-	sqlhist->start_hist = strdup(s->buffer);
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		table = tmap->table;
+		if (table->residual && (table != sb->top_table || !table->to))
+			return residual_error(sqlhist, table);
+	}
 
-	trace_seq_reset(s);
-	if (!table->to)
-		from = resolve_expr(table, table->from);
-	trace_seq_printf(s, "events/");
-	print_system_event(s, from, '/');
-	trace_seq_printf(s, "/trigger");
-	trace_seq_terminate(s);
+	return 0;
+}
 
-	sqlhist->start_path = strdup(s->buffer);
+/* Needs the synthetic field names, so comes after make_synthetic_events() */
+static int make_synth_filter(struct emit *out, struct sqlhist *sqlhist,
+			     struct sql_table *table)
+{
+	ssize_t start;
 
-	if (!table->to)
-		goto out;
+	if (!table->residual)
+		return 0;
 
-	trace_seq_reset(s);
-	trace_seq_printf(s, "hist:keys=");
-	to = resolve_expr(table, table->to);
-	print_keys(s, table, to);
-	print_values(s,table, to, VALUE_TO, &vars);
-	trace_seq_printf(s, ":onmatch(");
-	print_system_event(s, from, '.');
-	trace_seq_printf(s, ")");
-	print_trace(s, table);
-	print_filter(s, table, to);
-	trace_seq_terminate(s);
+	if (!cond_synth(table, table->residual))
+		return residual_error(sqlhist, table);
 
-	sqlhist->end_hist = strdup(s->buffer);
+	start = out->s.len;
+	print_cond(&out->s, table->residual, table);
+	end_str(out, SQLHIST_SYNTH_FILTER, start);
 
-	trace_seq_reset(s);
-	trace_seq_printf(s, "events/");
-	print_system_event(s, to, '/');
-	trace_seq_printf(s, "/trigger");
-	trace_seq_terminate(s);
+	start = out->s.len;
+	trace_seq_printf(&out->s, "events/synthetic/%s/filter", table->name);
+	end_str(out, SQLHIST_SYNTH_FILTER_PATH, start);
 
-	sqlhist->end_path = strdup(s->buffer);
+	return 0;
+}
 
-	while (vars) {
-		struct var_list *v = vars;
-		vars = v->next;
-		free(v);
+static int check_options(struct sqlhist_bison *sb, struct sqlhist *sqlhist)
+{
+	struct table_map *tmap;
+	struct sql_table *table;
+	unsigned long long size;
+	char *end;
+
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		table = tmap->table;
+		if (table->bad_option) {
+			asprintf(&sqlhist->error, "WITH (%s)\nUnknown option",
+				 table->bad_option);
+			return -1;
+		}
+		if (table->snapshot && !is_snapshot(table) &&
+		    strcasecmp(table->snapshot, "false") != 0) {
+			asprintf(&sqlhist->error,
+				 "WITH (snapshot = %s)\nThe snapshot is either true or false",
+				 table->snapshot);
+			return -1;
+		}
+		if (!table->size_hint)
+			continue;
+		size = strtoull(table->size_hint, &end, 0);
+		if (!size || *end || size > HIST_SIZE_MAX) {
+			asprintf(&sqlhist->error,
+				 "WITH (size = %s)\nThe size must be a number up to %llu",
+				 table->size_hint, HIST_SIZE_MAX);
+			return -1;
+		}
 	}
 
- out:
-	curr_table = save_curr;
+	return 0;
+}
 
-	if (table->to)
-		make_histograms(s, sqlhist, find_table(table->to));
+static int synth_hist_error(struct sqlhist *sqlhist, struct expression *e)
+{
+	asprintf(&sqlhist->error, "%s\nIs not a field of the synthetic event",
+		 show_expr(e));
+	return -1;
 }
 
-static void dump_tables(void)
+/*
+ * Aggregates over a join are done by a histogram on the synthetic
+ * event, so the kernel does the counting instead of every synthetic
+ * event going to the ring buffer. Also needs the synthetic field names.
+ */
+static int make_synth_hist(struct emit *out, struct sqlhist *sqlhist,
+			   struct sql_table *table)
 {
-	struct trace_seq s;
-	static int debug;
+	struct trace_seq *s = &out->s;
+	struct expression *e;
+	bool values = true;
+	ssize_t start;
+	int keys = 0;
 
-	if (!debug)
-		return;
+	if (!table->to || !table->group_by)
+		return 0;
 
-	trace_seq_init(&s);
-	dump_table(&s, curr_table);
+	start = s->len;
+	trace_seq_printf(s, "hist:keys=");
+	e = print_group_keys(s, table, table, &keys);
+	if (!e)
+		e = print_sums(s, table, table, &values);
+	if (!e)
+		e = print_maxes(s, table, table);
+	if (!e)
+		e = print_order_max(s, table, table);
+	if (e)
+		return synth_hist_error(sqlhist, e);
+	print_sort(s, table, table);
+	print_size(s, table, group_entries(table));
+	end_str(out, SQLHIST_SYNTH_HIST, start);
+
+	start = s->len;
+	trace_seq_printf(s, "events/synthetic/%s/trigger", table->name);
+	end_str(out, SQLHIST_SYNTH_HIST_PATH, start);
 
-	trace_seq_do_printf(&s);
-	trace_seq_destroy(&s);
+	return 0;
 }
 
-static char *buffer;
-static size_t buffer_size;
-static size_t buffer_idx;
-static char *parse_error_str;
-
-void parse_error(int line, int idx, const char *text,
-		 const char *fmt, va_list ap)
+/*
+ * Returns the events the tables start from and join to, which are the
+ * only events whose formats the output needs.
+ */
+static const char **referenced_events(struct sqlhist_bison *sb, int *nr)
 {
-	struct trace_seq s;
-	int i;
+	struct table_map *tmap;
+	const char **events;
+	int cnt = 0;
 
-	if (!buffer)
-		return;
+	for (tmap = sb->table_list; tmap; tmap = tmap->next)
+		cnt += 2;
 
-	trace_seq_init(&s);
-	if (!s.buffer) {
-		fprintf(stderr, "Error allocating internal buffer\n");
-		return;
-	}
+	events = arena_alloc(sb, (cnt + 1) * sizeof(*events));
+	if (!events)
+		return NULL;
 
-	for (i = 0; line && buffer[i]; i++) {
-		if (buffer[i] == '\n')
-			line--;
+	cnt = 0;
+	for (tmap = sb->table_list; tmap; tmap = tmap->next) {
+		if (tmap->table->from && !tmap->table->from_table)
+			events[cnt++] = tmap->table->from_event.text;
+		if (tmap->table->to)
+			events[cnt++] = tmap->table->to_event.text;
 	}
-	for (; buffer[i] && buffer[i] != '\n'; i++)
-		trace_seq_putc(&s, buffer[i]);
-	trace_seq_putc(&s, '\n');
-	for (i = idx; i > 0; i--)
-		trace_seq_putc(&s, ' ');
-	trace_seq_puts(&s, "^\n");
-	trace_seq_printf(&s, "ERROR: '%s'\n", text);
-	trace_seq_vprintf(&s, fmt, ap);
-
-	trace_seq_terminate(&s);
 
-	parse_error_str = strdup(s.buffer);
-	trace_seq_destroy(&s);
+	*nr = cnt;
+	return events;
 }
 
-void print_buffer_line(int line, int idx)
+/*
+ * Emits the strings of @sqlhist from the bound tables of @sb. Returns 0
+ * when done, even if it only set sqlhist->error, and -1 on error.
+ */
+static int emit_output(struct sqlhist_bison *sb, struct sqlhist *sqlhist)
 {
+	struct sql_table *table;
+	struct emit out;
+	ssize_t start;
+	int ret = 0;
 	int i;
 
-	if (!buffer)
-		return;
-
-	for (i = 0; line && buffer[i]; i++) {
-		if (buffer[i] == '\n')
-			line--;
-	}
-	for (; buffer[i] && buffer[i] != '\n'; i++)
-		printf("%c", buffer[i]);
-	printf("\n");
-	for (i = idx; i > 0; i--)
-		printf(" ");
-	printf("^\n");
-}
-
-int my_yyinput(char *buf, int max)
-{
-	if (!buffer)
-		return read(0, buf, max);
-	
-	if (buffer_idx + max > buffer_size)
-		max = buffer_size - buffer_idx;
-
-	if (max)
-		memcpy(buf, buffer + buffer_idx, max);
-
-	buffer_idx += max;
-	
-	return max;
-}
+	trace_seq_init(&out.s);
+	if (!out.s.buffer)
+		return -1;
+	for (i = 0; i < SQLHIST_NR_STRS; i++)
+		out.offs[i] = -1;
 
-const char *sqlhist_start_event(struct sqlhist *sqlhist)
-{
-	return sqlhist->start_event;
-}
+	add_str(&out, SQLHIST_TRACE_DIR, sb->catalog->trace_dir);
 
-const char *sqlhist_end_event(struct sqlhist *sqlhist)
-{
-	return sqlhist->end_event;
-}
+	/* The event the first stage starts from */
+	for (table = sb->top_table; table->from_table; table = table->from_table)
+		;
+	add_str(&out, SQLHIST_START_EVENT, table->from_event.text);
 
-const char *sqlhist_synth_event(struct sqlhist *sqlhist)
-{
-	return sqlhist->synth_event;
-}
+	table = sb->top_table;
+	if (table->to) {
+		add_str(&out, SQLHIST_END_EVENT, table->to_event.text);
+		add_str(&out, SQLHIST_SYNTH_EVENT, table->name);
+	}
+	if (table->to || table->from_table) {
+		start = out.s.len;
+		make_synthetic_events(&out.s, table);
+		end_str(&out, SQLHIST_SYNTH_EVENT_DEF, start);
+	}
 
-const char *sqlhist_synth_event_def(struct sqlhist *sqlhist)
-{
-	return sqlhist->synth_event_def;
-}
+	if (make_synth_filter(&out, sqlhist, table) < 0 ||
+	    make_synth_hist(&out, sqlhist, table) < 0)
+		goto out;
 
-const char *sqlhist_start_hist(struct sqlhist *sqlhist)
-{
-	return sqlhist->start_hist;
-}
+	make_histograms(&out, table);
+	make_result(&out, table);
 
-const char *sqlhist_end_hist(struct sqlhist *sqlhist)
-{
-	return sqlhist->end_hist;
-}
+	start = out.s.len;
+	print_formats(&out.s, sb);
+	end_str(&out, SQLHIST_FORMATS, start);
+	sb->emitted = true;
 
-const char *sqlhist_start_path(struct sqlhist *sqlhist)
-{
-	return sqlhist->start_path;
-}
+	/* The buffer is done moving, copy it out once */
+	sqlhist->output = malloc(out.s.len);
+	if (!sqlhist->output) {
+		ret = -1;
+		goto out;
+	}
+	memcpy(sqlhist->output, out.s.buffer, out.s.len);
 
-const char *sqlhist_end_path(struct sqlhist *sqlhist)
-{
-	return sqlhist->end_path;
-}
+	for (i = 0; i < SQLHIST_NR_STRS; i++) {
+		if (out.offs[i] < 0)
+			continue;
+		sqlhist->strs[i] = sqlhist->output + out.offs[i];
+		sqlhist->lens[i] = out.lens[i];
+	}
 
-const char *sqlhist_synth_filter(struct sqlhist *sqlhist)
-{
-	return sqlhist->synth_filter;
-}
+	if (check_vars(sqlhist) < 0) {
+		if (!sqlhist->error)
+			ret = -1;
+		/* Return it with the error only */
+		memset(sqlhist->strs, 0, sizeof(sqlhist->strs));
+		free(sqlhist->output);
+		sqlhist->output = NULL;
+	}
 
-const char *sqlhist_trace_dir(struct sqlhist *sqlhist)
-{
-	return sqlhist->trace_dir;
+ out:
+	trace_seq_destroy(&out.s);
+	return ret;
 }
 
-const char *sqlhist_error(struct sqlhist *sqlhist)
+static void free_bison(struct sqlhist_bison *sb)
 {
-	return sqlhist->error;
+	free(sb->parse_error_str);
+	clean_stores(sb);
+	free(sb);
 }
 
-struct sqlhist *sqlhist_parse(const char *sql_buffer, const char *trace_dir)
+/*
+ * If @catalog is NULL, only the formats of the events that the
+ * statement references are loaded from @trace_dir, after the statement
+ * has been parsed successfully. Otherwise the bound tables are kept
+ * with the result, for sqlhist_emit().
+ */
+static struct sqlhist *parse(const char *sql_buffer, const char *trace_dir,
+			     struct sqlhist_catalog *catalog)
 {
-	struct sql_table *table;
-	struct sqlhist *sqlhist;
-	struct trace_seq s;
-	struct sqlhist_bison sb;
+	struct sqlhist_bison *sb;
+	struct sqlhist *sqlhist = NULL;
 	int ret;
 
 	if (!sql_buffer)
 		return NULL;
 
-	buffer = strdup(sql_buffer);
-	if (!buffer)
+	sb = calloc(1, sizeof(*sb));
+	if (!sb)
 		return NULL;
-	buffer_size = strlen(buffer);
 
-	yylex_init(&sb.scanner);
-	yylex_init_extra(&sb, sb.scanner);
-	ret = yyparse(&sb);
-	yylex_destroy(sb.scanner);
-	free(buffer);
+	sb->buffer = sql_buffer;
+	sb->buffer_size = strlen(sql_buffer);
+
+	yylex_init_extra(sb, &sb->scanner);
+	ret = yyparse(sb);
+	yylex_destroy(sb->scanner);
+	sb->buffer = NULL;
 
 	if (ret == -ENOMEM)
-		return NULL;
+		goto out;
 
-	dump_tables();
+	dump_tables(sb);
 
 	sqlhist = calloc(1, sizeof(*sqlhist));
 
 	if (!sqlhist)
-		return NULL;
+		goto out;
 
 	if (ret) {
-		sqlhist->error = parse_error_str;
-		return sqlhist;
+		sqlhist->error = sb->parse_error_str;
+		sb->parse_error_str = NULL;
+		goto out;
 	}
 
-	tep = tracefs_local_events(trace_dir);
-	if (!tep) {
+	bind_names(sb);
+
+	if (check_selects(sb, sqlhist) < 0 ||
+	    check_residual(sb, sqlhist) < 0 ||
+	    check_functions(sb, sqlhist) < 0 ||
+	    check_aggregates(sb, sqlhist) < 0 ||
+	    check_options(sb, sqlhist) < 0 ||
+	    check_order(sb, sqlhist) < 0)
+		goto out;
+
+	sb->catalog = catalog;
+	if (!sb->catalog) {
+		const char **events;
+		int nr = 0;
+
+		events = referenced_events(sb, &nr);
+		if (!events)
+			goto fail;
+		sb->catalog = catalog_open_events(trace_dir, events, nr);
+	}
+	if (!sb->catalog) {
 		if (!trace_dir)
 			trace_dir = "tracefs directory";
 		/* Return an empty sqlhist */
 		asprintf(&sqlhist->error, "%s\nFailed to read %s",
 			 strerror(errno), trace_dir);
-		return sqlhist;
+		goto out;
 	}
 
-	if (!trace_dir)
-		trace_dir = tracefs_tracing_dir();
-
-	sqlhist->trace_dir = strdup(trace_dir);
-	if (!sqlhist->trace_dir)
-		goto fail;
+	if (bind_types(sb, sqlhist) < 0)
+		goto out;
+	sqlhist->max_entries = hist_entries(sb, sb->top_table,
+					    &sb->top_table->from_event);
 
-	trace_seq_init(&s);
-	if (!s.buffer)
+	if (emit_output(sb, sqlhist) < 0)
 		goto fail;
 
-	table = top_table;
-	make_synthetic_events(&s, top_table);
-	trace_seq_terminate(&s);
-	sqlhist->start_event = strdup(resolve_expr(table, table->from));
-	if (table->to) {
-		sqlhist->end_event = strdup(resolve_expr(table, table->from));
-		sqlhist->synth_event = strdup(table->name);
-		sqlhist->synth_event_def = strdup(s.buffer);
+	if (catalog && !sqlhist->error) {
+		sqlhist->sb = sb;
+		sb = NULL;
 	}
 
-	trace_seq_reset(&s);
-	make_histograms(&s, sqlhist, top_table);
-	trace_seq_destroy(&s);
-
-	clean_stores();
+ out:
+	if (sb) {
+		if (sb->catalog != catalog)
+			sqlhist_catalog_close(sb->catalog);
+		free_bison(sb);
+	}
 
 	return sqlhist;
 
  fail:
 	sqlhist_destroy(sqlhist);
-	return NULL;
+	sqlhist = NULL;
+	goto out;
 }
 
-int sqlhist_lex_it(void)
+/**
+ * sqlhist_emit - emit the strings of a statement again
+ * @sqlhist: A statement from sqlhist_parse_catalog()
+ *
+ * Replaces the strings of @sqlhist with ones emitted from its bound
+ * tables, as sqlhist_share_starts() left them. The catalog it was
+ * compiled against must still be open.
+ *
+ * Returns 0 on success, or -1 with sqlhist->error set or errno set.
+ */
+int sqlhist_emit(struct sqlhist *sqlhist)
 {
-	struct sqlhist_bison sb;
-	void *scanner;
-	int ret;
+	if (!sqlhist->sb) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	yylex_init(&scanner);
-	yylex_init_extra(&sb, scanner);
-	ret = lex_it();
-	yylex_destroy(scanner);
-	return ret;
+	memset(sqlhist->strs, 0, sizeof(sqlhist->strs));
+	memset(sqlhist->lens, 0, sizeof(sqlhist->lens));
+	free(sqlhist->output);
+	sqlhist->output = NULL;
+
+	if (emit_output(sqlhist->sb, sqlhist) < 0)
+		return -1;
+
+	return sqlhist->error ? -1 : 0;
+}
+
+struct sqlhist *sqlhist_parse(const char *sql_buffer, const char *trace_dir)
+{
+	return parse(sql_buffer, trace_dir, NULL);
+}
+
+/**
+ * sqlhist_parse_catalog - compile against already loaded event formats
+ * @sql_buffer: The SQL statement to compile
+ * @catalog: The catalog from sqlhist_catalog_open()
+ *
+ * The @catalog is only read, so it can be shared by several threads
+ * compiling at the same time. It must stay open for as long as the
+ * result is used with sqlhist_share_starts().
+ */
+struct sqlhist *sqlhist_parse_catalog(const char *sql_buffer,
+				      struct sqlhist_catalog *catalog)
+{
+	if (!catalog)
+		return NULL;
+
+	return parse(sql_buffer, catalog->trace_dir, catalog);
+}
+
+int sqlhist_lex_it(void)
+{
+	return lex_it();
 }
 
 void sqlhist_destroy(struct sqlhist *sqlhist)
@@ -1086,17 +3586,10 @@ void sqlhist_destroy(struct sqlhist *sqlhist)
 	if (!sqlhist)
 		return;
 
-	free(sqlhist->start_event);
-	free(sqlhist->end_event);
-	free(sqlhist->synth_event);
-	free(sqlhist->synth_event_def);
-	free(sqlhist->start_hist);
-	free(sqlhist->end_hist);
-	free(sqlhist->start_path);
-	free(sqlhist->end_path);
-	free(sqlhist->synth_filter);
-	free(sqlhist->trace_dir);
+	free(sqlhist->output);
 	free(sqlhist->error);
+	if (sqlhist->sb)
+		free_bison(sqlhist->sb);
 
 	free(sqlhist);
 }
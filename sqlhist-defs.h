@@ -10,6 +10,7 @@ struct label_map {
 	struct label_map	*next;
 	enum label_type		type;
 	char			*label;
+	unsigned int		label_id;
 	void			*value;
 };
 
@@ -17,11 +18,14 @@ struct match_map {
 	struct match_map	*next;
 	const char		*A;
 	const char		*B;
+	const char		*from_key;
+	const char		*to_key;
 };
 
 struct selection {
 	struct selection	*next;
 	const char		*name;
+	const char		*synth_name;
 	void			*item;
 };
 
@@ -32,12 +36,38 @@ enum expr_type {
 	EXPR_MULT,
 	EXPR_DIVID,
 	EXPR_FILTER,
+	EXPR_AND,
+	EXPR_OR,
+	EXPR_NOT,
+	EXPR_STRING,
+	EXPR_BUCKET,
+	EXPR_LOG2,
+	EXPR_COUNT,
+	EXPR_COUNT_DISTINCT,
+	EXPR_SUM,
+	EXPR_MIN,
+	EXPR_MAX,
 };
 
 struct sql_table;
+struct catalog_event;
+struct catalog_field;
+
+/*
+ * An event that a table starts from or joins to, with labels resolved.
+ * If it is the synthetic event of an earlier stage of a join, @table is
+ * that stage and @event is NULL.
+ */
+struct bound_event {
+	const char			*text;
+	const char			*system;
+	const char			*name;
+	const struct catalog_event	*event;
+	struct expression		*filter;
+	struct sql_table		*table;
+};
 
 struct expression {
-	struct expression	*next;
 	struct sqlhist_bison	*sb;
 	enum expr_type		type;
 	void			*A;
@@ -45,41 +75,144 @@ struct expression {
 	const char		*op;
 	const char		*name;
 	struct sql_table	*table;
+
+	/* Set by the binding pass, for EXPR_FIELD only */
+	const char		*raw;
+	struct bound_event	*event;
+	const char		*field;
+	const struct catalog_field *format;
+	const char		*field_type;
+	const char		*type_error;
 };
 
 struct table_map {
 	struct table_map	*next;
 	char			*name;
+	unsigned int		name_id;
 	struct sql_table	*table;
 };
 
+struct var_list {
+	struct var_list		*next;
+	const char		*var;
+	unsigned int		val_id;
+};
+
+/* A variable that a histogram of a table defines on @event ("system/name") */
+struct hist_var {
+	struct hist_var		*next;
+	const char		*event;
+	const char		*name;
+};
+
+/* A variable of a table that is defined as @var, so as not to clash */
+struct var_rename {
+	struct var_rename	*next;
+	const char		*name;
+	const char		*var;
+};
+
+/*
+ * @from_table is the table whose synthetic event this one starts from:
+ * either a SELECT in FROM, or the table so far that a JOIN after the
+ * first one split off as a stage (@split). A split stage carries any
+ * field that the tables after it use, a SELECT only what it selects.
+ */
 struct sql_table {
 	char			*name;
 	struct sql_table	*parent;
 	struct sql_table	*child;
+	struct sql_table	*from_table;
+	struct match_map	*join_matches;
+	struct var_list		*vars;
+	bool			split;
+	bool			bound;
 	struct sqlhist_bison	*sb;
 	struct label_map	*labels;
 	struct match_map	*matches;
 	struct table_map	*tables;
 	struct selection	*selections;
 	struct selection	**next_selection;
+	struct selection	*aggregates;
+	struct selection	**next_aggregate;
+	struct selection	*group_by;
+	struct selection	**next_group_by;
 	struct expression	*from;
 	struct expression	*to;
 	struct expression	*filter;
+	struct expression	*residual;
+	struct expression	*order_by;
+	bool			order_desc;
+	const char		*limit;
+	const char		*size_hint;
+	const char		*snapshot;
+	const char		*bad_option;
+	struct bound_event	from_event;
+	struct bound_event	to_event;
+	/* What onmax() tracks the ORDER BY value in */
+	const char		*order_var;
+	/* Recorded as the histograms are first emitted */
+	struct hist_var		*hist_vars;
+	int			nr_start_vars;
+	/* Set by sqlhist_share_starts() */
+	struct var_rename	*renames;
+	struct sql_table	*shared_start;
+	struct sql_table	*sharers;
+	struct sql_table	*next_sharer;
 };
 
+/*
+ * All the output strings of a compiled statement live in the one
+ * @output arena; @strs[] and @lens[] point into it.
+ *
+ * SQLHIST_SYNTH_EVENT_DEF has one line per synthetic event. The
+ * SQLHIST_STAGE_* strings are lists of the triggers of the earlier
+ * stages of a join, first stage first, each ending with its '\0'.
+ */
+enum sqlhist_str {
+	SQLHIST_START_EVENT,
+	SQLHIST_END_EVENT,
+	SQLHIST_SYNTH_EVENT,
+	SQLHIST_SYNTH_EVENT_DEF,
+	SQLHIST_START_HIST,
+	SQLHIST_END_HIST,
+	SQLHIST_START_PATH,
+	SQLHIST_END_PATH,
+	SQLHIST_SYNTH_FILTER,
+	SQLHIST_SYNTH_FILTER_PATH,
+	SQLHIST_SYNTH_HIST,
+	SQLHIST_SYNTH_HIST_PATH,
+	SQLHIST_STAGE_START_HISTS,
+	SQLHIST_STAGE_START_PATHS,
+	SQLHIST_STAGE_END_HISTS,
+	SQLHIST_STAGE_END_PATHS,
+	SQLHIST_FOLD_PATH,
+	SQLHIST_FOLD_KEY,
+	SQLHIST_FOLD_VALUE,
+	SQLHIST_RESULT_PATH,
+	SQLHIST_LIMIT,
+	SQLHIST_RESULT_COLS,
+	SQLHIST_TRACE_DIR,
+	SQLHIST_FORMATS,
+	SQLHIST_NR_STRS,
+};
+
+/* The sizes the kernel takes for a histogram */
+#define HIST_SIZE_MIN		(1ULL << 7)
+#define HIST_SIZE_MAX		(1ULL << 17)
+/* TRACING_MAP_BITS_DEFAULT, for a histogram without a :size= */
+#define HIST_SIZE_DEFAULT	(1ULL << 11)
+/* Larger estimates are too loose to preallocate for (pids, wide ints) */
+#define HIST_SIZE_AUTO_MAX	(1ULL << 13)
+
 struct sqlhist {
-	char			*start_event;
-	char			*end_event;
-	char			*synth_event;
-	char			*synth_event_def;
-	char			*start_hist;
-	char			*end_hist;
-	char			*start_path;
-	char			*end_path;
-	char			*synth_filter;
-	char			*trace_dir;
+	const char		*strs[SQLHIST_NR_STRS];
+	size_t			lens[SQLHIST_NR_STRS];
+	unsigned long long	max_entries;
+	char			*output;
 	char			*error;
+	/* The bound tables, kept by sqlhist_parse_catalog() */
+	struct sqlhist_bison	*sb;
 };
 
 #endif
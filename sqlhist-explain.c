@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#ifdef HAVE_TRACEFS
+#include <tracefs/tracefs.h>
+#else
+#include "tracefs-stubs.h"
+#endif
+
+#include "sqlhist.h"
+#include "sqlhist-catalog.h"
+
+/*
+ * EXPLAIN: what each trigger of a compiled statement costs on every hit
+ * of its event, before anything is installed.
+ *
+ * It goes by the triggers as they would be written (so in batch mode,
+ * after they were shared and folded), and by the formats of their
+ * events: the width of the key that is hashed and compared on every
+ * hit, the variables saved, the size of the map, and the size of every
+ * synthetic event that is generated. Patterns that are known to be
+ * expensive are warned about.
+ */
+
+/* TRACING_MAP_BITS_DEFAULT: the entries of a histogram without a size */
+#define DEFAULT_HIST_SIZE	2048
+
+/* MAX_FILTER_STR_VAL: the key width of a dynamic string */
+#define DYN_STR_SIZE		256
+
+/* STR_VAR_LEN_MAX: what a string field takes in a synthetic event */
+#define SYNTH_STR_SIZE		256
+
+/* Events that fire often enough to make any work on every hit count */
+static const char *busy_events[] = {
+	"sched/sched_switch",
+	"sched/sched_waking",
+	"sched/sched_wakeup",
+	"sched/sched_stat_runtime",
+	"raw_syscalls/",
+	"syscalls/",
+	"irq/",
+	"timer/",
+	"kmem/",
+	"exceptions/",
+	"napi/",
+	"net/",
+	"block/",
+};
+
+struct explain {
+	FILE			*fp;
+	struct sqlhist		*sqlhist;
+	struct sqlhist_catalog	*catalog;
+	struct sqlhist_span	*spans;
+	int			nr_spans;
+	int			warnings;
+};
+
+static void warn(struct explain *ex, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(ex->fp, "  warning: ");
+	va_start(ap, fmt);
+	vfprintf(ex->fp, fmt, ap);
+	va_end(ap);
+	fprintf(ex->fp, "\n");
+	ex->warnings++;
+}
+
+static bool is_busy(const char *system, const char *event)
+{
+	size_t len = strlen(system);
+	const char *busy;
+	size_t i;
+
+	for (i = 0; i < sizeof(busy_events) / sizeof(busy_events[0]); i++) {
+		busy = busy_events[i];
+		if (strncmp(busy, system, len) != 0 || busy[len] != '/')
+			continue;
+		if (!busy[len + 1] || strcmp(busy + len + 1, event) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* "events/<system>/<event>/trigger" */
+static int split_path(const char *path, char **system, char **event)
+{
+	const char *s, *e;
+
+	if (strncmp(path, "events/", 7) != 0)
+		return -1;
+	s = path + 7;
+	e = strchr(s, '/');
+	if (!e)
+		return -1;
+	*system = strndup(s, e - s);
+	*event = strndup(e + 1, strcspn(e + 1, "/"));
+	if (!*system || !*event) {
+		free(*system);
+		free(*event);
+		return -1;
+	}
+	return 0;
+}
+
+/* The size of a type of a synthetic event field */
+static int type_size(const char *type, bool *string)
+{
+	const char *bracket = strchr(type, '[');
+
+	*string = false;
+	if (bracket) {
+		*string = true;
+		return atoi(bracket + 1) ? : DYN_STR_SIZE;
+	}
+	if (!strcmp(type, "u8") || !strcmp(type, "s8") ||
+	    !strcmp(type, "char") || !strcmp(type, "bool"))
+		return 1;
+	if (!strcmp(type, "u16") || !strcmp(type, "s16") ||
+	    !strcmp(type, "short") || !strcmp(type, "unsigned short"))
+		return 2;
+	if (!strcmp(type, "u32") || !strcmp(type, "s32") ||
+	    !strcmp(type, "int") || !strcmp(type, "unsigned int") ||
+	    !strcmp(type, "pid_t"))
+		return 4;
+	return 8;
+}
+
+/*
+ * Walks the fields of one line of the synthetic event definitions:
+ * "name type field type field ...", where a type may be two words
+ * (like "unsigned int" or "__data_loc char[]").
+ * Returns the next field after @p, or NULL at the end of the line.
+ */
+static const char *next_synth_field(const char *p, char **type, char **field)
+{
+	const char *t, *f;
+	size_t len;
+
+	p += strspn(p, " ");
+	if (!*p || *p == '\n')
+		return NULL;
+
+	t = p;
+	len = strcspn(p, " \n");
+	if ((len == 8 && !strncmp(t, "unsigned", 8)) ||
+	    (len == 6 && !strncmp(t, "signed", 6)) ||
+	    (len == 10 && !strncmp(t, "__data_loc", 10)))
+		len += 1 + strcspn(p + len + 1, " \n");
+	f = t + len;
+	f += strspn(f, " ");
+
+	*type = strndup(t, len);
+	*field = strndup(f, strcspn(f, " \n"));
+	return f + strcspn(f, " \n");
+}
+
+static const char *next_line(const char *p)
+{
+	p += strcspn(p, "\n");
+	return *p ? p + 1 : p;
+}
+
+static const char *synth_def(struct explain *ex, const char *event)
+{
+	const char *def = sqlhist_synth_event_def(ex->sqlhist);
+	size_t len = strlen(event);
+
+	for (; def && *def; def = next_line(def)) {
+		if (strncmp(def, event, len) == 0 && def[len] == ' ')
+			return def + len;
+	}
+	return NULL;
+}
+
+static int synth_key_size(struct explain *ex, const char *event,
+			  const char *name, bool *string)
+{
+	const char *p = synth_def(ex, event);
+	char *type, *field;
+	int size = 8;
+
+	while (p && (p = next_synth_field(p, &type, &field))) {
+		if (type && field && strcmp(field, name) == 0)
+			size = type_size(type, string);
+		free(type);
+		free(field);
+	}
+	return size;
+}
+
+static int event_key_size(struct explain *ex, const char *system,
+			  const char *event, const char *name, bool *string)
+{
+	const struct catalog_event *cevent;
+	const struct catalog_field *field;
+
+	if (!ex->catalog)
+		return 8;
+	cevent = catalog_find_event(ex->catalog, system, event);
+	if (!cevent)
+		return 8;
+	field = catalog_find_field(ex->catalog, cevent, name);
+	if (!field)
+		return 8;
+
+	if (field->flags & TEP_FIELD_IS_STRING) {
+		*string = true;
+		if (field->flags & TEP_FIELD_IS_DYNAMIC)
+			return DYN_STR_SIZE;
+	}
+	return field->size;
+}
+
+/* What a key takes in the map, each aligned to a u64 like the kernel does */
+static int key_size(struct explain *ex, const char *system, const char *event,
+		    const char *key, size_t len, bool *string)
+{
+	const char *mod = memchr(key, '.', len);
+	char *name;
+	int size;
+
+	*string = false;
+	if (mod && (!strncmp(mod, ".buckets", 8) || !strncmp(mod, ".log2", 5)))
+		return 8;
+
+	name = strndup(key, mod ? mod - key : len);
+	if (!name)
+		return 8;
+	if (!strcmp(name, "common_timestamp"))
+		size = 8;
+	else if (!strcmp(system, "synthetic"))
+		size = synth_key_size(ex, event, name, string);
+	else
+		size = event_key_size(ex, system, event, name, string);
+	free(name);
+
+	return (size + 7) & ~7;
+}
+
+/* The value of ":@name" in the trigger, up to the next ':' */
+static const char *hist_part(const char *hist, const char *end,
+			     const char *name, size_t *len)
+{
+	size_t nlen = strlen(name);
+	const char *p;
+
+	for (p = hist; (p = memmem(p, end - p, name, nlen)); p++) {
+		if (p > hist && p[-1] == ':') {
+			p += nlen;
+			*len = strcspn(p, ": ");
+			if (p + *len > end)
+				*len = end - p;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static int list_len(const char *list, size_t len)
+{
+	int cnt = 1;
+	size_t i;
+
+	if (!len)
+		return 0;
+	for (i = 0; i < len; i++)
+		cnt += list[i] == ',';
+	return cnt;
+}
+
+static void explain_hist(struct explain *ex, struct sqlhist_span *span,
+			 const char *system, const char *event)
+{
+	const char *hist = span->iov.iov_base;
+	const char *end = hist + span->iov.iov_len;
+	const char *filter;
+	const char *keys, *key;
+	const char *vals;
+	const char *size;
+	unsigned long long entries;
+	bool string;
+	size_t keys_len, len;
+	int width = 0;
+	int entry;
+	int nr_vals;
+	int nr_vars;
+	int ksize;
+
+	filter = memmem(hist, span->iov.iov_len, " if ", 4);
+
+	keys = hist_part(hist, filter ? filter : end, "keys=", &keys_len);
+	for (key = keys; key && key < keys + keys_len; key += len + 1) {
+		len = strcspn(key, ",: ");
+		if (key + len > keys + keys_len)
+			len = keys + keys_len - key;
+		ksize = key_size(ex, system, event, key, len, &string);
+		fprintf(ex->fp, "    key %.*s: %d bytes%s\n", (int)len, key, ksize,
+			string ? ", string" : "");
+		width += ksize;
+		if (string)
+			warn(ex, "string key %.*s: %d bytes hashed and compared on every hit",
+			     (int)len, key, ksize);
+	}
+	fprintf(ex->fp, "    key width: %d bytes\n", width);
+
+	nr_vars = sqlhist_span_vars(span);
+	fprintf(ex->fp, "    variables: %d of %d\n", nr_vars, SQLHIST_MAX_VARS);
+
+	/* The hitcount, and the sums */
+	nr_vals = 1;
+	vals = hist_part(hist, filter ? filter : end, "values=", &len);
+	if (vals)
+		nr_vals += list_len(vals, len);
+
+	size = hist_part(hist, filter ? filter : end, "size=", &len);
+	entries = size ? strtoull(size, NULL, 0) : DEFAULT_HIST_SIZE;
+	entry = width + 8 * (nr_vals + nr_vars);
+	fprintf(ex->fp, "    map: %llu entries of %d bytes (%llu KiB)\n",
+		entries, entry, (entries * entry + 1023) / 1024);
+	if (!size)
+		warn(ex, "no size, so the default of %d entries (see WITH (size = n))",
+		     DEFAULT_HIST_SIZE);
+
+	if (memmem(hist, span->iov.iov_len, ":onmatch(", 9))
+		fprintf(ex->fp, "    action: onmatch().trace(), generates a synthetic event\n");
+	if (memmem(hist, span->iov.iov_len, ".save(", 6))
+		fprintf(ex->fp, "    action: onmax().save(), on a new maximum\n");
+	if (memmem(hist, span->iov.iov_len, ".snapshot()", 11))
+		fprintf(ex->fp, "    action: onmax().snapshot(), swaps the trace buffer on a new maximum\n");
+
+	if (filter)
+		fprintf(ex->fp, "    filter:%.*s\n", (int)(end - filter - 3),
+			filter + 3);
+	else if (is_busy(system, event))
+		warn(ex, "no filter, on %s/%s which fires very often", system, event);
+}
+
+static void explain_synth(struct explain *ex)
+{
+	const char *def = sqlhist_synth_event_def(ex->sqlhist);
+	const char *p;
+	char *type, *field;
+	bool string;
+	int nr, bytes;
+
+	for (; def && *def; def = next_line(def)) {
+		fprintf(ex->fp, "synthetic event %.*s\n", (int)strcspn(def, " \n"), def);
+		nr = 0;
+		/* The common fields of every event */
+		bytes = 8;
+		p = def + strcspn(def, " \n");
+		while ((p = next_synth_field(p, &type, &field))) {
+			if (type && field) {
+				type_size(type, &string);
+				nr++;
+				bytes += string ? SYNTH_STR_SIZE : 8;
+				fprintf(ex->fp, "    field %s: %d bytes%s\n", field,
+					string ? SYNTH_STR_SIZE : 8,
+					string ? ", string" : "");
+				if (string)
+					warn(ex, "string field %s: %d bytes copied into every event",
+					     field, SYNTH_STR_SIZE);
+			}
+			free(type);
+			free(field);
+		}
+		fprintf(ex->fp, "    %d fields, %d bytes an event\n", nr, bytes);
+	}
+}
+
+static int triggers_on(struct explain *ex, const char *path)
+{
+	int cnt = 0;
+	int i;
+
+	for (i = 0; i < ex->nr_spans; i++) {
+		if (ex->spans[i].type != SQLHIST_SPAN_SYNTH &&
+		    ex->spans[i].type != SQLHIST_SPAN_FILTER &&
+		    strcmp(ex->spans[i].path, path) == 0)
+			cnt++;
+	}
+	return cnt;
+}
+
+static void explain_span(struct explain *ex, struct sqlhist_span *span)
+{
+	char *system, *event;
+
+	if (span->type == SQLHIST_SPAN_SYNTH)
+		return;
+
+	fprintf(ex->fp, "%s\n", span->path);
+	fprintf(ex->fp, "    %.*s\n", (int)span->iov.iov_len,
+		(char *)span->iov.iov_base);
+
+	if (span->type == SQLHIST_SPAN_FILTER)
+		return;
+
+	if (split_path(span->path, &system, &event) < 0)
+		return;
+
+	fprintf(ex->fp, "    triggers of the statement on this event: %d\n",
+		triggers_on(ex, span->path));
+	explain_hist(ex, span, system, event);
+
+	free(system);
+	free(event);
+}
+
+/* Only the formats of the events that the triggers are on */
+static struct sqlhist_catalog *open_catalog(struct explain *ex)
+{
+	struct sqlhist_catalog *catalog;
+	char *system, *event;
+	char **events;
+	int nr = 0;
+	int i;
+
+	events = calloc(ex->nr_spans, sizeof(*events));
+	if (!events)
+		return NULL;
+
+	for (i = 0; i < ex->nr_spans; i++) {
+		if (ex->spans[i].type == SQLHIST_SPAN_SYNTH ||
+		    split_path(ex->spans[i].path, &system, &event) < 0)
+			continue;
+		if (strcmp(system, "synthetic") != 0 &&
+		    asprintf(&events[nr], "%s.%s", system, event) >= 0)
+			nr++;
+		free(system);
+		free(event);
+	}
+
+	catalog = catalog_open_events(sqlhist_trace_dir(ex->sqlhist),
+				      (const char * const *)events, nr);
+
+	for (i = 0; i < nr; i++)
+		free(events[i]);
+	free(events);
+
+	return catalog;
+}
+
+/**
+ * sqlhist_explain - report what the triggers of a statement cost
+ * @sqlhist: The compiled statement
+ * @catalog: The event formats, or NULL to read them from sqlhist_trace_dir()
+ * @fp: Where to write the report
+ *
+ * For every synthetic event of @sqlhist, writes the number and size of
+ * its fields. For every trigger, writes the number of triggers of
+ * @sqlhist on the same event, its keys and their width, its variables,
+ * the size of its map and its filter. It warns about string keys and
+ * fields, histograms without a size, and unfiltered histograms on
+ * events that fire very often.
+ *
+ * Returns the number of warnings, or -1 with errno set.
+ */
+int sqlhist_explain(struct sqlhist *sqlhist, struct sqlhist_catalog *catalog,
+		    FILE *fp)
+{
+	struct explain ex = { .fp = fp, .sqlhist = sqlhist };
+	int i;
+
+	if (!sqlhist_start_event(sqlhist)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ex.nr_spans = sqlhist_spans(sqlhist, NULL, 0);
+	ex.spans = calloc(ex.nr_spans, sizeof(*ex.spans));
+	if (!ex.spans)
+		return -1;
+	sqlhist_spans(sqlhist, ex.spans, ex.nr_spans);
+
+	/* Without the formats, every key is taken to be a u64 */
+	ex.catalog = catalog;
+	if (!ex.catalog)
+		ex.catalog = open_catalog(&ex);
+
+	explain_synth(&ex);
+	for (i = 0; i < ex.nr_spans; i++)
+		explain_span(&ex, &ex.spans[i]);
+
+	if (ex.catalog != catalog)
+		sqlhist_catalog_close(ex.catalog);
+	free(ex.spans);
+
+	return ex.warnings;
+}
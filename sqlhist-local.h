@@ -1,6 +1,22 @@
 #ifndef _SQLHIST_LOCAL_H
 #define _SQLHIST_LOCAL_H
 
+/*
+ * Bump this when a change to the compiler changes the commands it
+ * generates for the same statement, so that cached output goes stale.
+ */
+#define SQLHIST_CODEGEN_VERSION	2
+
 const char *__show_expr(struct expression *e, bool eval);
 
+/* For sqlhist_share_starts(), on the tables that it keeps */
+const char *sqlhist_event_key(struct sql_table *table,
+			      struct bound_event *event);
+const char *sqlhist_var_name(struct sql_table *table, const char *name);
+int sqlhist_emit(struct sqlhist *sqlhist);
+
+/* What the :size= of a histogram is estimated from */
+unsigned long long sqlhist_pid_max(void);
+unsigned long long sqlhist_nr_cpus(void);
+
 #endif
@@ -4,6 +4,10 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <tracefs.h>
 
 #include "sqlhist.h"
@@ -51,41 +55,180 @@ static void usage(char **argv)
 		p--;
 	p++;
 
-	printf("\nusage: %s [-hl][-t tracefs-path]([-f file]|sql-select-statement)\n"
+	printf("\nusage: %s [-hlbadre][-E secs][-t tracefs-path][-c catalog][-C cache-dir][-j threads]([-f file]|sql-select-statement)\n"
 	       " file : holds sql statement (read from stdin if not present)\n"
 	       " -h : show this message\n"
 	       " -l : Only run the lexer (for testing)\n"
 	       " -t : Path to tracefs directory (looks for it via /proc/mounts if not set)\n"
 	       " -f : file to read sql-statement from, instead of command line (use '-' for stdin)\n"
+	       " -c : file to cache the event formats in (rebuilt when tracefs changes)\n"
+	       " -C : directory to keep compiled statements in, to reuse them\n"
+	       "      (not in batch mode, which shares histograms between them)\n"
+	       " -b : batch mode, compile all the ';' separated statements into one script\n"
+	       " -j : number of threads to compile with in batch mode (default 1)\n"
+	       " -a : install into tracefs instead of printing the commands\n"
+	       " -d : with -a, the -t path is a plain directory with a copy of the\n"
+	       "      event formats, to create the files in (for testing)\n"
+	       " -r : print the rows of the installed statement, up to its LIMIT\n"
+	       " -e : explain what each trigger costs, instead of printing the commands\n"
+	       " -E : report the hits and drops of the installed statement over secs seconds\n"
+	       "      (0 for all of them since it was installed)\n"
 	       "\n",p);
 	exit(-1);
 }
 
+static const char *catalog_file;
+static struct sqlhist_cache *cache;
+static bool apply;
+static unsigned int apply_flags;
+static bool read_rows;
+static bool explain;
+static bool analyze;
+static unsigned int analyze_secs;
+
+static struct sqlhist *compile(const char *buffer, const char *trace_dir,
+			       struct sqlhist_catalog *catalog)
+{
+	if (cache)
+		return sqlhist_cache_parse(cache, buffer, trace_dir, catalog);
+	if (catalog)
+		return sqlhist_parse_catalog(buffer, catalog);
+	return sqlhist_parse(buffer, trace_dir);
+}
+
+static void print_cache_stats(void)
+{
+	unsigned long hits, misses;
+
+	if (!cache)
+		return;
+
+	sqlhist_cache_stats(cache, &hits, &misses);
+	fprintf(stderr, "cache: %lu hits, %lu misses\n", hits, misses);
+}
+
+/*
+ * Writing to synthetic_events or to a trigger file with '>' removes
+ * everything that was there, so a script of several statements must
+ * use @append for every path an earlier statement may have written.
+ * The same goes for a trigger file that a join writes to twice.
+ */
+static void print_sqlhist(FILE *fp, struct sqlhist *sqlhist, bool append)
+{
+	struct sqlhist_span *spans;
+	const char *redirect;
+	int cnt;
+	int i, j;
+
+	cnt = sqlhist_spans(sqlhist, NULL, 0);
+	if (cnt <= 0)
+		return;
+
+	spans = calloc(cnt, sizeof(*spans));
+	if (!spans)
+		return;
+	sqlhist_spans(sqlhist, spans, cnt);
+
+	for (i = 0; i < cnt; i++) {
+		redirect = append ? ">>" : ">";
+		for (j = 0; j < i; j++) {
+			if (strcmp(spans[j].path, spans[i].path) == 0)
+				redirect = ">>";
+		}
+		fprintf(fp, "echo '%.*s' %s %s\n", (int)spans[i].iov.iov_len,
+			(char *)spans[i].iov.iov_base, redirect, spans[i].path);
+	}
+
+	free(spans);
+}
+
+/*
+ * The variables each histogram of @sqlhist has, against what the kernel
+ * allows. Returns the most of them in one histogram.
+ */
+static int report_vars(struct sqlhist *sqlhist, bool print)
+{
+	struct sqlhist_span *spans;
+	int max = 0;
+	int cnt;
+	int nr;
+	int i;
+
+	cnt = sqlhist_spans(sqlhist, NULL, 0);
+	if (cnt <= 0)
+		return 0;
+
+	spans = calloc(cnt, sizeof(*spans));
+	if (!spans)
+		return 0;
+	sqlhist_spans(sqlhist, spans, cnt);
+
+	for (i = 0; i < cnt; i++) {
+		nr = sqlhist_span_vars(&spans[i]);
+		if (nr > max)
+			max = nr;
+		if (nr && print)
+			fprintf(stderr, "%s: %d of %d variables\n",
+				spans[i].path, nr, SQLHIST_MAX_VARS);
+	}
+
+	free(spans);
+	return max;
+}
+
 static int do_parse(const char *buffer, const char *trace_dir)
 {
+	struct sqlhist_catalog *catalog = NULL;
 	struct sqlhist *sqlhist;
+	int ret;
 
-	sqlhist = sqlhist_parse(buffer, trace_dir);
+	if (catalog_file) {
+		catalog = sqlhist_catalog_open(trace_dir, catalog_file);
+		if (!catalog)
+			pdie("Failed to load event formats");
+	}
+	sqlhist = compile(buffer, trace_dir, catalog);
 	if (!sqlhist)
 		pdie("Error parsing sqlhist\n");
 
 	if (!sqlhist_start_event(sqlhist))
 		die("Error:\n%s", sqlhist_error(sqlhist));
 
-	if (sqlhist_end_event(sqlhist)) {
-		printf("echo '%s' > synthetic_events\n",
-		       sqlhist_synth_event_def(sqlhist));
-	}
-
-	printf("echo '%s' > %s\n",
-	       sqlhist_start_hist(sqlhist), sqlhist_start_path(sqlhist));
+	if (sqlhist_max_entries(sqlhist) == ULLONG_MAX)
+		fprintf(stderr, "start histogram: no bound on the entries\n");
+	else
+		fprintf(stderr, "start histogram: at most %llu entries\n",
+			sqlhist_max_entries(sqlhist));
+	report_vars(sqlhist, true);
 
-	if (sqlhist_end_event(sqlhist)) {
-		printf("echo '%s' > %s\n",
-		       sqlhist_end_hist(sqlhist), sqlhist_end_path(sqlhist));
+	if (apply) {
+		if (sqlhist_apply_list_flags(&sqlhist, 1, apply_flags) < 0)
+			pdie("Failed to install into %s",
+			     sqlhist_trace_dir(sqlhist));
+	} else if (read_rows) {
+		if (!sqlhist_result_path(sqlhist))
+			die("The rows of this statement are not in a histogram");
+		if (sqlhist_print_top(sqlhist, stdout) < 0)
+			pdie("Failed to read %s/%s", sqlhist_trace_dir(sqlhist),
+			     sqlhist_result_path(sqlhist));
+	} else if (explain) {
+		if (sqlhist_explain(sqlhist, catalog, stdout) < 0)
+			pdie("Failed to explain the statement");
+	} else if (analyze) {
+		ret = sqlhist_analyze(sqlhist, analyze_secs, stdout);
+		if (ret < 0)
+			pdie("Failed to read the histograms in %s",
+			     sqlhist_trace_dir(sqlhist));
+		if (ret)
+			fprintf(stderr, "%d histograms dropped hits, recompile with the suggested size\n",
+				ret);
+	} else {
+		print_sqlhist(stdout, sqlhist, false);
 	}
 
+	print_cache_stats();
 	sqlhist_destroy(sqlhist);
+	sqlhist_catalog_close(catalog);
 	return 0;
 }
 
@@ -128,6 +271,197 @@ static int do_sql(const char *buffer, const char *trace_dir)
 }
 #endif
 
+/*
+ * Batch mode: every statement is compiled against one catalog, by as
+ * many threads as asked for. Each result is kept in its slot and they
+ * are printed in the order of the input, so the script is the same no
+ * matter how the work was spread over the threads.
+ *
+ * Start histograms that the statements have in common are shared (see
+ * sqlhist_share_starts()), and histograms that only differ in a
+ * constant of their filter are folded into one (see
+ * sqlhist_fold_filters()), so the script only works as a whole. The
+ * sharing is done on the bound statements, which a cached one does not
+ * have, so they are always compiled.
+ *
+ * With -a, nothing is printed. Instead, if all the statements compiled,
+ * they are installed together with sqlhist_apply_list().
+ */
+struct batch {
+	struct sqlhist_catalog	*catalog;
+	char			**stmts;
+	struct sqlhist		**sqlhists;
+	int			nr_stmts;
+	int			next;
+	int			failed;
+};
+
+static void *batch_thread(void *data)
+{
+	struct batch *batch = data;
+	struct sqlhist *sqlhist;
+	int i;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+	       batch->nr_stmts) {
+		sqlhist = sqlhist_parse_catalog(batch->stmts[i], batch->catalog);
+		if (!sqlhist)
+			pdie("Error parsing sqlhist\n");
+
+		if (!sqlhist_start_event(sqlhist)) {
+			fprintf(stderr, "Error in statement %d:\n%s\n",
+				i + 1, sqlhist_error(sqlhist));
+			__atomic_fetch_add(&batch->failed, 1, __ATOMIC_RELAXED);
+		}
+
+		batch->sqlhists[i] = sqlhist;
+	}
+
+	return NULL;
+}
+
+static void add_statement(char ***stmts, int *nr, char *stmt)
+{
+	if (!stmt[strspn(stmt, " \t\n")])
+		return;
+	*stmts = realloc(*stmts, sizeof(**stmts) * (*nr + 1));
+	if (!*stmts)
+		pdie("Failed to allocate statements");
+	(*stmts)[(*nr)++] = stmt;
+}
+
+/*
+ * Splits @buffer in place into its ';' separated statements. A ';' in
+ * a quoted string is part of the string, which like in the scanner
+ * ends at its closing quote or at the end of the line.
+ */
+static int split_statements(char *buffer, char ***pstmts)
+{
+	char **stmts = NULL;
+	char *stmt = buffer;
+	char quote = 0;
+	int nr = 0;
+	char *p;
+
+	for (p = buffer; *p; p++) {
+		if (quote) {
+			if (*p == quote || *p == '\n')
+				quote = 0;
+		} else if (*p == '"' || *p == '\'') {
+			quote = *p;
+		} else if (*p == ';') {
+			*p = '\0';
+			add_statement(&stmts, &nr, stmt);
+			stmt = p + 1;
+		}
+	}
+	add_statement(&stmts, &nr, stmt);
+
+	*pstmts = stmts;
+	return nr;
+}
+
+static int do_batch(char *buffer, const char *trace_dir, int nr_threads)
+{
+	struct batch batch = { };
+	struct timespec start, end;
+	pthread_t *threads;
+	double delta;
+	int max_vars = 0;
+	int folded;
+	int shared;
+	int vars;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	batch.nr_stmts = split_statements(buffer, &batch.stmts);
+	if (!batch.nr_stmts)
+		die("No statements found");
+
+	batch.sqlhists = calloc(batch.nr_stmts, sizeof(*batch.sqlhists));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!batch.sqlhists || !threads)
+		pdie("Failed to allocate batch");
+
+	batch.catalog = sqlhist_catalog_open(trace_dir, catalog_file);
+	if (!batch.catalog)
+		pdie("Failed to load event formats");
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, batch_thread, &batch))
+			die("Failed to create thread");
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Emits the statements again, so it goes before the folding */
+	shared = sqlhist_share_starts(batch.sqlhists, batch.nr_stmts);
+	if (shared < 0)
+		pdie("Failed to share the start histograms");
+
+	folded = sqlhist_fold_filters(batch.sqlhists, batch.nr_stmts);
+	if (folded < 0)
+		pdie("Failed to fold the histograms");
+
+	for (i = 0; i < batch.nr_stmts; i++) {
+		vars = report_vars(batch.sqlhists[i], false);
+		if (vars > max_vars)
+			max_vars = vars;
+	}
+
+	for (i = 0; i < batch.nr_stmts && !apply; i++) {
+		printf("# statement %d\n", i + 1);
+		if (sqlhist_fold_path(batch.sqlhists[i]))
+			printf("# its rows are those with %s=%s in %s\n",
+			       sqlhist_fold_key(batch.sqlhists[i]),
+			       sqlhist_fold_value(batch.sqlhists[i]),
+			       sqlhist_fold_path(batch.sqlhists[i]));
+		if (!sqlhist_start_event(batch.sqlhists[i]))
+			printf("# failed to compile\n");
+		else if (explain)
+			sqlhist_explain(batch.sqlhists[i], batch.catalog, stdout);
+		else
+			print_sqlhist(stdout, batch.sqlhists[i], true);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	delta = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+	fprintf(stderr, "%d statements (%d failed) in %.3f secs, %.1f statements/sec\n",
+		batch.nr_stmts, batch.failed, delta, batch.nr_stmts / delta);
+	fprintf(stderr, "%d histograms folded into another by their filter\n",
+		folded);
+	fprintf(stderr, "%d start histograms shared with another statement\n",
+		shared);
+	fprintf(stderr, "at most %d of %d variables in a histogram\n",
+		max_vars, SQLHIST_MAX_VARS);
+
+	if (apply && !batch.failed) {
+		start = end;
+		if (sqlhist_apply_list_flags(batch.sqlhists, batch.nr_stmts,
+					     apply_flags) < 0)
+			pdie("Failed to install into %s",
+			     sqlhist_trace_dir(batch.sqlhists[0]));
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		delta = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+		fprintf(stderr, "installed %d statements in %.3f secs, %.1f statements/sec\n",
+			batch.nr_stmts, delta, batch.nr_stmts / delta);
+	}
+
+	for (i = 0; i < batch.nr_stmts; i++)
+		sqlhist_destroy(batch.sqlhists[i]);
+
+	sqlhist_catalog_close(batch.catalog);
+	free(batch.sqlhists);
+	free(batch.stmts);
+	free(threads);
+
+	return batch.failed ? -1 : 0;
+}
+
 int main (int argc, char **argv)
 {
 	char *trace_dir = NULL;
@@ -135,13 +469,16 @@ int main (int argc, char **argv)
 	char buf[BUFSIZ];
 	int buffer_size = 0;
 	const char *file = NULL;
+	bool batch = false;
+	int nr_threads = 1;
+	int ret = 0;
 	FILE *fp;
 	size_t r;
 	int c;
 	int i;
 
 	for (;;) {
-		c = getopt(argc, argv, "hlt:f:");
+		c = getopt(argc, argv, "hlbadret:E:f:c:C:j:");
 		if (c == -1)
 			break;
 
@@ -156,6 +493,38 @@ int main (int argc, char **argv)
 		case 'f':
 			file = optarg;
 			break;
+		case 'c':
+			catalog_file = optarg;
+			break;
+		case 'C':
+			cache = sqlhist_cache_open(optarg);
+			if (!cache)
+				pdie("Failed to open cache %s", optarg);
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 'a':
+			apply = true;
+			break;
+		case 'd':
+			apply_flags |= SQLHIST_APPLY_DIR;
+			break;
+		case 'r':
+			read_rows = true;
+			break;
+		case 'e':
+			explain = true;
+			break;
+		case 'E':
+			analyze = true;
+			analyze_secs = atoi(optarg);
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1)
+				usage(argv);
+			break;
 		}
 	}
 
@@ -187,8 +556,20 @@ int main (int argc, char **argv)
 		}
 	}
 
-	do_sql(buffer, trace_dir);
+	if (!buffer)
+		die("No statement given");
+
+	if (batch && analyze)
+		die("-E reads back a single statement");
+
+	if (batch)
+		ret = do_batch(buffer, trace_dir, nr_threads);
+	else if (apply || read_rows || explain || analyze || cache)
+		do_parse(buffer, trace_dir);
+	else
+		do_sql(buffer, trace_dir);
 	free(buffer);
+	sqlhist_cache_close(cache);
 
-	return 0;
+	return ret;
 }
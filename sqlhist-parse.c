@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <errno.h>
@@ -10,121 +11,253 @@
 #include "sqlhist-parse.h"
 #include "sqlhist-local.h"
 
-struct sql_table *curr_table;
-struct sql_table *top_table;
-struct table_map *table_list;
-
-#define HASH_BITS 10
-
-struct str_hash {
-	struct str_hash		*next;
-	char			*str;
+/*
+ * Everything a parse allocates (the tables, expressions, maps and
+ * strings) comes out of one arena hanging off the sqlhist_bison.
+ * Nothing is freed individually, the blocks are all released at once
+ * by clean_stores().
+ */
+#define ARENA_BLOCK_SIZE	4096
+#define ARENA_ALIGN		sizeof(long)
+
+struct arena_block {
+	struct arena_block	*next;
+	size_t			size;
+	size_t			used;
+	char			data[];
 };
 
-static struct str_hash *str_hash[1 << HASH_BITS];
+#define STR_HASH_MIN_BITS	8
 
 static struct expression *create_expression(struct sqlhist_bison *sb,
 					    void *A, void *B,
 					    enum expr_type type);
 
-static int no_table(void)
+static int no_table(struct sqlhist_bison *sb)
 {
-	static int once;
-
-	if (curr_table)
+	if (sb->curr_table)
 		return 0;
-	if (!once++)
+	if (!sb->no_table)
 		printf("No table?\n");
+	sb->no_table = true;
 	return 1;
 }
 
+void *arena_alloc(struct sqlhist_bison *sb, size_t size)
+{
+	struct arena_block *block = sb->arena;
+	size_t bsize = ARENA_BLOCK_SIZE - sizeof(*block);
+	void *ret;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (!block || block->used + size > block->size) {
+		if (size > bsize)
+			bsize = size;
+
+		block = malloc(sizeof(*block) + bsize);
+		if (!block)
+			return NULL;
+
+		block->size = bsize;
+		block->used = 0;
+
+		/* Keep filling the current block if this one is just for @size */
+		if (sb->arena && size > ARENA_BLOCK_SIZE / 2) {
+			block->next = sb->arena->next;
+			sb->arena->next = block;
+		} else {
+			block->next = sb->arena;
+			sb->arena = block;
+		}
+	}
+
+	ret = block->data + block->used;
+	block->used += size;
+
+	memset(ret, 0, size);
+	return ret;
+}
+
 int table_start(struct sqlhist_bison *sb)
 {
 	struct sql_table *table;;
 
-	table = calloc(1, sizeof(*table));
+	table = arena_alloc(sb, sizeof(*table));
 	if (!table)
 		return -ENOMEM;
 
 	table->sb = sb;
 	table->next_selection = &table->selections;
+	table->next_aggregate = &table->aggregates;
+	table->next_group_by = &table->group_by;
 
-	table->parent = curr_table;
-	if (curr_table)
-		curr_table->child = table;
+	table->parent = sb->curr_table;
+	if (sb->curr_table)
+		sb->curr_table->child = table;
 	else
-		top_table = table;
+		sb->top_table = table;
 
-	curr_table = table;
+	sb->curr_table = table;
 
 	return 0;
 }
 
 void add_from(struct sqlhist_bison *sb, void *item)
 {
-	curr_table->from = item;
+	sb->curr_table->from = item;
 }
 
-void add_to(struct sqlhist_bison *sb, void *item)
+/*
+ * "FROM a JOIN b ON ... JOIN c ON ..." is done in stages: a JOIN b
+ * becomes a table of its own, and its synthetic event is what the
+ * table then joins to c. The stage gets the matches of its own JOIN,
+ * which are the ones added before the previous add_to().
+ */
+static int split_join(struct sqlhist_bison *sb, struct sql_table *table)
 {
-	curr_table->to = item;
+	struct sql_table *stage;
+	struct match_map *map;
+
+	stage = arena_alloc(sb, sizeof(*stage));
+	if (!stage)
+		return -ENOMEM;
+
+	stage->sb = sb;
+	stage->split = true;
+	stage->next_selection = &stage->selections;
+	stage->next_aggregate = &stage->aggregates;
+	stage->next_group_by = &stage->group_by;
+	stage->labels = table->labels;
+	stage->from = table->from;
+	stage->from_table = table->from_table;
+	stage->to = table->to;
+	stage->matches = table->join_matches;
+
+	for (map = table->matches; map; map = map->next) {
+		if (map->next == table->join_matches) {
+			map->next = NULL;
+			break;
+		}
+	}
+
+	/* Named by table_end(), once the name of the table is known */
+	table->from = NULL;
+	table->from_table = stage;
+
+	return 0;
 }
 
-static int add_table(struct sqlhist_bison *sb, const char *label)
+int add_to(struct sqlhist_bison *sb, void *item)
 {
-	struct table_map *tmap;
+	struct sql_table *table = sb->curr_table;
+	int ret;
 
-	if (no_table())
-		return 0;
+	if (table->to) {
+		ret = split_join(sb, table);
+		if (ret < 0)
+			return ret;
+	}
 
-	tmap = malloc(sizeof(*tmap));
+	table->to = item;
+	table->join_matches = table->matches;
+
+	return 0;
+}
+
+static int add_table_map(struct sqlhist_bison *sb, struct sql_table *table,
+			 const char *label)
+{
+	struct table_map *tmap;
+
+	tmap = arena_alloc(sb, sizeof(*tmap));
 	if (!tmap)
 		return -ENOMEM;
 
-	tmap->table = curr_table;
+	tmap->table = table;
 	tmap->name = store_str(sb, label);
-	if (!tmap->name) {
-		free(tmap);
+	if (!tmap->name)
 		return -ENOMEM;
-	}
+	tmap->name_id = str_id(tmap->name);
 
-	tmap->next = table_list;
-	table_list = tmap;
+	tmap->next = sb->table_list;
+	sb->table_list = tmap;
 
 	return 0;
 }
 
+static int add_table(struct sqlhist_bison *sb, const char *label)
+{
+	if (no_table(sb))
+		return 0;
+
+	return add_table_map(sb, sb->curr_table, label);
+}
+
+/* The stages are named after the table, first stage first */
+static int name_stages(struct sqlhist_bison *sb, struct sql_table *table,
+		       const char *name)
+{
+	struct sql_table *stage = table->from_table;
+	int ret;
+
+	/* A SELECT in FROM has its own name */
+	if (!stage || !stage->split)
+		return 0;
+
+	ret = name_stages(sb, stage, name);
+	if (ret < 0)
+		return ret;
+
+	stage->name = store_printf(sb, "%s_%d", name, sb->stage_cnt++);
+	if (!stage->name)
+		return -ENOMEM;
+	stage->size_hint = table->size_hint;
+
+	table->from = create_expression(sb, stage->name, NULL, EXPR_FIELD);
+	if (!table->from)
+		return -ENOMEM;
+
+	return add_table_map(sb, stage, stage->name);
+}
+
 int table_end(struct sqlhist_bison *sb, const char *name)
 {
-	static int anony_cnt;
 	char *tname;
 	int ret;
 
 	if (!name)
-		tname = store_printf(sb, "Anonymous%d", anony_cnt++);
+		tname = store_printf(sb, "Anonymous%d", sb->anony_cnt++);
 	else
 		tname = store_str(sb, name);
 
 	if (!tname)
 		return -ENOMEM;
 
+	ret = name_stages(sb, sb->curr_table, tname);
+	if (ret)
+		return ret;
+
 	ret = add_table(sb, tname);
 	if (ret)
 		return ret;
 
-	curr_table->name = tname;
-	curr_table = curr_table->parent;
+	sb->curr_table->name = tname;
+	sb->curr_table = sb->curr_table->parent;
 
 	return 0;
 }
 
 int from_table_end(struct sqlhist_bison *sb, const char *name)
 {
-	if (curr_table->parent) {
-		curr_table->parent->from =
+	struct sql_table *table = sb->curr_table;
+
+	if (table->parent) {
+		table->parent->from =
 			create_expression(sb, store_str(sb, name), NULL, EXPR_FIELD);
-		if (!curr_table->parent->from)
+		if (!table->parent->from)
 			return -ENOMEM;
+		table->parent->from_table = table;
 	}
 
 	return table_end(sb, name);
@@ -140,24 +273,23 @@ static int insert_label(struct sqlhist_bison *sb, const char *label,
 			void *val, enum label_type type)
 {
 	struct label_map *lmap;
-	struct sql_table *table = curr_table;
+	struct sql_table *table = sb->curr_table;
 
 	if (!table)
-		table = top_table;
+		table = sb->top_table;
 
 	if (!table) {
-		no_table();
+		no_table(sb);
 		return 0;
 	}
 
-	lmap = malloc(sizeof(*lmap));
+	lmap = arena_alloc(sb, sizeof(*lmap));
 	if (!lmap)
 		return -ENOMEM;
 	lmap->label = store_str(sb, label);
-	if (!lmap->label) {
-		free(lmap);
+	if (!lmap->label)
 		return -ENOMEM;
-	}
+	lmap->label_id = str_id(lmap->label);
 	lmap->value = val;
 	lmap->type = type;
 
@@ -175,22 +307,20 @@ int add_match(struct sqlhist_bison *sb, const char *A, const char *B)
 {
 	struct match_map *map;
 
-	if (no_table())
+	if (no_table(sb))
 		return 0;
 
-	map = malloc(sizeof(*map));
+	map = arena_alloc(sb, sizeof(*map));
 	if (!map)
 		return -ENOMEM;
 	map->A = store_str(sb, A);
 	map->B = store_str(sb, B);
 
-	if (!map->A || !map->B) {
-		free(map);
+	if (!map->A || !map->B)
 		return -ENOMEM;
-	}
 
-	map->next = curr_table->matches;
-	curr_table->matches = map;
+	map->next = sb->curr_table->matches;
+	sb->curr_table->matches = map;
 
 	return 0;
 }
@@ -200,18 +330,26 @@ int add_selection(struct sqlhist_bison *sb, void *item)
 	struct selection *selection;
 	struct expression *e = item;
 
-	if (no_table())
+	if (no_table(sb))
 		return 0;
 
-	selection = malloc(sizeof(*selection));
+	selection = arena_alloc(sb, sizeof(*selection));
 	if (!selection)
 		return -ENOMEM;
 
 	selection->item = e;
 	selection->name = e->name;
 	selection->next = NULL;
-	*curr_table->next_selection = selection;
-	curr_table->next_selection = &selection->next;
+
+	/* Aggregates are not fields of the table, but done over them */
+	if (is_aggregate(e)) {
+		*sb->curr_table->next_aggregate = selection;
+		sb->curr_table->next_aggregate = &selection->next;
+		return 0;
+	}
+
+	*sb->curr_table->next_selection = selection;
+	sb->curr_table->next_selection = &selection->next;
 
 	return 0;
 }
@@ -226,15 +364,13 @@ const char *show_expr(void *expr)
 	return __show_expr(expr, false);
 }
 
-static struct expression *estore;
-
 static struct expression *create_expression_op(struct sqlhist_bison *sb,
 					       void *A, void *B, const char *op,
 					       enum expr_type type)
 {
 	struct expression *e;
 
-	e = calloc(sizeof(*e), 1);
+	e = arena_alloc(sb, sizeof(*e));
 	if (!e)
 		return NULL;
 	e->sb = sb;
@@ -242,10 +378,7 @@ static struct expression *create_expression_op(struct sqlhist_bison *sb,
 	e->B = B;
 	e->op = op;
 	e->type = type;
-	e->table = curr_table;
-
-	e->next = estore;
-	estore = e;
+	e->table = sb->curr_table;
 
 	return e;
 }
@@ -313,35 +446,160 @@ void *add_field(struct sqlhist_bison *sb, const char *field, const char *label)
 	return e;
 }
 
-void *add_filter(struct sqlhist_bison *sb, char *a, char *b, const char *op)
+/* The right side of a compare: a field of the other event, or a number */
+void *add_value(struct sqlhist_bison *sb, const char *value)
+{
+	return create_expression(sb, store_str(sb, value), NULL, EXPR_FIELD);
+}
+
+/* A quoted string, kept without its quotes */
+void *add_string(struct sqlhist_bison *sb, const char *str)
+{
+	return create_expression(sb, store_str(sb, str), NULL, EXPR_STRING);
+}
+
+void *add_filter(struct sqlhist_bison *sb, char *a, void *B, const char *op)
 {
 	void *A;
-	void *B;
 
 	A = create_expression(sb, store_str(sb, a), NULL, EXPR_FIELD);
-	B = create_expression(sb, store_str(sb, b), NULL, EXPR_FIELD);
-
 	if (!A || !B)
 		return NULL;
 
 	return create_expression_op(sb, A, B, op, EXPR_FILTER);
 }
 
-void add_where(void *A)
+/* Key modifiers: @A grouped into buckets of @size, or by its log2 */
+void *add_bucket(struct sqlhist_bison *sb, void *A, const char *size)
 {
-	struct expression *e = A;
+	return create_expression(sb, A, store_str(sb, size), EXPR_BUCKET);
+}
+
+void *add_log2(struct sqlhist_bison *sb, void *A)
+{
+	return create_expression(sb, A, NULL, EXPR_LOG2);
+}
+
+/* COUNT(*) has no @field */
+void *add_aggregate(struct sqlhist_bison *sb, enum expr_type type,
+		    const char *field)
+{
+	void *A = NULL;
 
-	if (curr_table->filter) {
-		printf("more than one filter!\n");
-		return;
+	if (field) {
+		A = create_expression(sb, store_str(sb, field), NULL, EXPR_FIELD);
+		if (!A)
+			return NULL;
 	}
-	curr_table->filter = e;
+
+	return create_expression(sb, A, NULL, type);
 }
 
-static inline unsigned int quick_hash(const char *str)
+bool is_aggregate(struct expression *e)
+{
+	switch (e->type) {
+	case EXPR_COUNT:
+	case EXPR_COUNT_DISTINCT:
+	case EXPR_SUM:
+	case EXPR_MIN:
+	case EXPR_MAX:
+		return true;
+	default:
+		return false;
+	}
+}
+
+int add_group_by(struct sqlhist_bison *sb, const char *field)
+{
+	struct selection *selection;
+
+	if (no_table(sb))
+		return 0;
+
+	selection = arena_alloc(sb, sizeof(*selection));
+	if (!selection)
+		return -ENOMEM;
+
+	selection->item = create_expression(sb, store_str(sb, field), NULL,
+					    EXPR_FIELD);
+	if (!selection->item)
+		return -ENOMEM;
+
+	*sb->curr_table->next_group_by = selection;
+	sb->curr_table->next_group_by = &selection->next;
+
+	return 0;
+}
+
+int add_order_by(struct sqlhist_bison *sb, const char *field, bool desc)
+{
+	struct sql_table *table = sb->curr_table;
+
+	if (no_table(sb))
+		return 0;
+
+	table->order_by = create_expression(sb, store_str(sb, field), NULL,
+					    EXPR_FIELD);
+	if (!table->order_by)
+		return -ENOMEM;
+	table->order_desc = desc;
+
+	return 0;
+}
+
+/* The number is checked after the parse */
+int add_limit(struct sqlhist_bison *sb, const char *limit)
+{
+	if (no_table(sb))
+		return 0;
+
+	sb->curr_table->limit = limit;
+
+	return 0;
+}
+
+/* WITH (name = value, ...): "size" and "snapshot" */
+int add_option(struct sqlhist_bison *sb, const char *name, const char *value)
+{
+	struct sql_table *table = sb->curr_table;
+
+	if (no_table(sb))
+		return 0;
+
+	/* Unknown options are reported after the parse */
+	if (strcasecmp(name, "size") == 0)
+		table->size_hint = value;
+	else if (strcasecmp(name, "snapshot") == 0)
+		table->snapshot = value;
+	else
+		table->bad_option = name;
+
+	return 0;
+}
+
+void *add_and(struct sqlhist_bison *sb, void *A, void *B)
+{
+	return create_expression(sb, A, B, EXPR_AND);
+}
+
+void *add_or(struct sqlhist_bison *sb, void *A, void *B)
+{
+	return create_expression(sb, A, B, EXPR_OR);
+}
+
+void *add_not(struct sqlhist_bison *sb, void *A)
+{
+	return create_expression(sb, A, NULL, EXPR_NOT);
+}
+
+void add_where(struct sqlhist_bison *sb, void *A)
+{
+	sb->curr_table->filter = A;
+}
+
+static inline unsigned int quick_hash(const char *str, unsigned int len)
 {
 	unsigned int val = 0;
-	int len = strlen(str);
 
 	for (; len >= 4; str += 4, len -= 4) {
 		val += str[0];
@@ -352,95 +610,118 @@ static inline unsigned int quick_hash(const char *str)
 	for (; len > 0; str++, len--)
 		val += str[0] << (len * 8);
 
-        val *= 2654435761;
-
-        return val & ((1 << HASH_BITS) - 1);
+	return val * 2654435761u;
 }
 
+/*
+ * The multiply only carries entropy upwards, so take the slot from
+ * the top bits of the hash rather than masking off the low ones.
+ */
+static inline unsigned int str_slot(unsigned int val, unsigned int bits)
+{
+	return val >> (32 - bits);
+}
 
-static struct str_hash *find_string(const char *str)
+/* Double the open addressed intern table, rehashing from the cached hashes */
+static int grow_str_hash(struct sqlhist_bison *sb)
 {
-	unsigned int key = quick_hash(str);
-	struct str_hash *hash;
+	unsigned int bits = sb->str_hash_bits ? sb->str_hash_bits + 1 : STR_HASH_MIN_BITS;
+	unsigned int size = 1U << bits;
+	struct str_hash **hash;
+	unsigned int i, key;
 
-	for (hash = str_hash[key]; hash; hash = hash->next) {
-		if (!strcmp(hash->str, str))
-			return hash;
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return -ENOMEM;
+
+	for (i = 0; i < sb->str_hash_size; i++) {
+		if (!sb->str_hash[i])
+			continue;
+		key = str_slot(sb->str_hash[i]->hash, bits);
+		while (hash[key])
+			key = (key + 1) & (size - 1);
+		hash[key] = sb->str_hash[i];
 	}
-	return NULL;
+
+	free(sb->str_hash);
+	sb->str_hash = hash;
+	sb->str_hash_size = size;
+	sb->str_hash_bits = bits;
+
+	return 0;
 }
 
-/*
- * If @str is found, then return the hash string.
- * This lets store_str() know to free str.
- */
-static char **add_hash(const char *str)
+char *store_str(struct sqlhist_bison *sb, const char *str)
 {
+	unsigned int len = strlen(str);
+	unsigned int val = quick_hash(str, len);
 	struct str_hash *hash;
 	unsigned int key;
 
-	if ((hash = find_string(str))) {
-		return &hash->str;
-	}
+	if ((sb->nr_syms + 1) * 2 > sb->str_hash_size && grow_str_hash(sb) < 0)
+		return NULL;
 
-	hash = malloc(sizeof(*hash));
-	key = quick_hash(str);
-	hash->next = str_hash[key];
-	str_hash[key] = hash;
-	hash->str = NULL;
-	return &hash->str;
-}
+	key = str_slot(val, sb->str_hash_bits);
+	while ((hash = sb->str_hash[key])) {
+		if (hash->hash == val && hash->len == len &&
+		    !memcmp(hash->str, str, len))
+			return hash->str;
+		key = (key + 1) & (sb->str_hash_size - 1);
+	}
 
-char *store_str(struct sqlhist_bison *sb, const char *str)
-{
-	char **pstr = add_hash(str);
+	hash = arena_alloc(sb, sizeof(*hash) + len + 1);
+	if (!hash)
+		return NULL;
 
-	if (!(*pstr))
-		*pstr = strdup(str);
+	memcpy(hash->str, str, len + 1);
+	hash->hash = val;
+	hash->len = len;
+	hash->id = sb->nr_syms++;
+	sb->str_hash[key] = hash;
 
-	return *pstr;
+	return hash->str;
 }
 
 char * store_printf(struct sqlhist_bison *sb, const char *fmt, ...)
 {
+	char buf[256];
 	va_list ap;
-	char **pstr;
 	char *str;
 	int ret;
 
 	va_start(ap, fmt);
-	ret = vasprintf(&str, fmt, ap);
+	ret = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
 
-	if (!ret)
-		return NULL; /* ?? */
+	if (ret < 0)
+		return NULL;
 
-	pstr = add_hash(str);
-	if (*pstr)
-		free(str);
-	else
-		*pstr = str;
+	if (ret < sizeof(buf))
+		return store_str(sb, buf);
+
+	str = arena_alloc(sb, ret + 1);
+	if (!str)
+		return NULL;
+
+	va_start(ap, fmt);
+	vsnprintf(str, ret + 1, fmt, ap);
+	va_end(ap);
 
-	return *pstr;
+	return store_str(sb, str);
 }
 
-void clean_stores(void)
+void clean_stores(struct sqlhist_bison *sb)
 {
-	struct expression *e;
-	int i;
+	struct arena_block *block;
 
-	while ((e = estore)) {
-		estore = e->next;
-		free(e);
+	while ((block = sb->arena)) {
+		sb->arena = block->next;
+		free(block);
 	}
 
-	for (i = 0; i < (1 << HASH_BITS); i++) {
-		struct str_hash *str;
-
-		while ((str = str_hash[i])) {
-			str_hash[i] = str->next;
-			free(str->str);
-			free(str);
-		}
-	}
+	free(sb->str_hash);
+	sb->str_hash = NULL;
+	sb->str_hash_size = 0;
+	sb->str_hash_bits = 0;
+	sb->nr_syms = 0;
 }
@@ -2,6 +2,8 @@
 #define __SQLHIST_PARSE_H
 
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #ifdef HAVE_TRACEFS
 #include <tracefs/tracefs.h>
@@ -9,16 +11,81 @@
 #include "tracefs-stubs.h"
 #endif
 
+/*
+ * Every string the parser keeps is interned once, and is known by the
+ * dense symbol ID it was given. Two interned strings are equal only if
+ * their IDs are, so lookups compare IDs instead of strings.
+ */
+struct str_hash {
+	unsigned int		hash;
+	unsigned int		id;
+	unsigned int		len;
+	char			str[];
+};
+
+struct arena_block;
+struct sql_table;
+struct table_map;
+struct expression;
+struct sqlhist_catalog;
+
+/*
+ * Everything a single parse needs. Nothing here is shared between
+ * parses, so different threads may each compile their own statement.
+ */
 struct sqlhist_bison {
-	void *scanner;
+	void			*scanner;
+	const char		*buffer;
+	size_t			buffer_size;
+	size_t			buffer_idx;
+	int			line_no;
+	int			line_idx;
+	char			*parse_error_str;
+	struct sql_table	*curr_table;
+	struct sql_table	*top_table;
+	struct table_map	*table_list;
+	struct arena_block	*arena;
+	struct sqlhist_catalog	*catalog;
+	int			anony_cnt;
+	int			arg_cnt;
+	int			stage_cnt;
+	struct str_hash		**str_hash;
+	unsigned int		str_hash_size;
+	unsigned int		str_hash_bits;
+	unsigned int		nr_syms;
+	/* "No table?" is only said once a parse */
+	bool			no_table;
+	/* Dump the tables after the parse */
+	bool			debug;
+	/* The histograms have been emitted once */
+	bool			emitted;
 };
 
 #include "sqlhist.tab.h"
 
 #include "sqlhist-defs.h"
 
+void *arena_alloc(struct sqlhist_bison *sb, size_t size);
+
 char * store_str(struct sqlhist_bison *sb, const char *str);
 char * store_printf(struct sqlhist_bison *sb, const char *fmt, ...);
+
+/* Only for strings returned by store_str() or store_printf() */
+static inline struct str_hash *str_sym(const char *str)
+{
+	return (struct str_hash *)(str - offsetof(struct str_hash, str));
+}
+
+static inline unsigned int str_id(const char *str)
+{
+	return str_sym(str)->id;
+}
+
+static inline unsigned int str_len(const char *str)
+{
+	return str_sym(str)->len;
+}
+
 int add_label(struct sqlhist_bison *sb, const char *label, const char *val);
 int add_match(struct sqlhist_bison *sb, const char *A, const char *B);
 int table_start(struct sqlhist_bison *sb);
@@ -32,22 +99,32 @@ void *add_minus(struct sqlhist_bison *sb, void *A, void *B);
 void *add_mult(struct sqlhist_bison *sb, void *A, void *B);
 void *add_divid(struct sqlhist_bison *sb, void *A, void *B);
 void *add_field(struct sqlhist_bison *sb, const char *field, const char *label);
-void *add_filter(struct sqlhist_bison *sb, char *a, char *b, const char *op);
+void *add_value(struct sqlhist_bison *sb, const char *value);
+void *add_string(struct sqlhist_bison *sb, const char *str);
+void *add_filter(struct sqlhist_bison *sb, char *a, void *B, const char *op);
+void *add_bucket(struct sqlhist_bison *sb, void *A, const char *size);
+void *add_log2(struct sqlhist_bison *sb, void *A);
+void *add_aggregate(struct sqlhist_bison *sb, enum expr_type type,
+		    const char *field);
+bool is_aggregate(struct expression *e);
+int add_group_by(struct sqlhist_bison *sb, const char *field);
+int add_order_by(struct sqlhist_bison *sb, const char *field, bool desc);
+int add_limit(struct sqlhist_bison *sb, const char *limit);
+int add_option(struct sqlhist_bison *sb, const char *name, const char *value);
+void *add_and(struct sqlhist_bison *sb, void *A, void *B);
+void *add_or(struct sqlhist_bison *sb, void *A, void *B);
+void *add_not(struct sqlhist_bison *sb, void *A);
 
 int add_expr(const char *name, void *expr);
-void add_where(void *expr);
+void add_where(struct sqlhist_bison *sb, void *expr);
 
 int add_selection(struct sqlhist_bison *sb, void *item);
 void add_from(struct sqlhist_bison *sb, void *item);
-void add_to(struct sqlhist_bison *sb, void *item);
-
-void clean_stores(void);
+int add_to(struct sqlhist_bison *sb, void *item);
 
-extern void parse_error(int line, int index, const char *text,
-			const char *fmt, va_list ap);
+void clean_stores(struct sqlhist_bison *sb);
 
-extern struct sql_table *curr_table;
-extern struct sql_table *top_table;
-extern struct table_map *table_list;
+extern void parse_error(struct sqlhist_bison *sb, int line, int index,
+			const char *text, const char *fmt, va_list ap);
 
 #endif
@@ -0,0 +1,941 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "sqlhist.h"
+#include "sqlhist-defs.h"
+
+/*
+ * Reading the rows of an installed statement back out of its hist file.
+ *
+ * A hist file has a section per histogram on the event, each headed by
+ * its trigger:
+ *
+ *   # event histogram
+ *   #
+ *   # trigger info: hist:keys=pid:vals=hitcount:sort=hitcount.descending:size=2048 [active]
+ *   #
+ *
+ *   { pid:        123 } hitcount:          5
+ *   { pid:        456 } hitcount:          3
+ *
+ *   Totals:
+ *       Hits: 8
+ *   ...
+ *
+ * An entry starts with a '{' line, and may go on over more lines (for a
+ * stacktrace key). The kernel already sorted the entries by the :sort=
+ * of the trigger, so for a LIMIT the file is only read up to the entry
+ * after the last one wanted.
+ *
+ * Programs can read the entries as rows with sqlhist_result_open() and
+ * sqlhist_result_next(), by the names the statement selected them as.
+ *
+ * The Totals: of every section are what EXPLAIN ANALYZE reads back.
+ */
+#define RESULT_BUF_SIZE		(64 * 1024)
+
+/* The default of TRACING_MAP_BITS_DEFAULT, for a histogram without a size */
+#define DEFAULT_HIST_SIZE	2048
+
+/* Dropped hits, per thousand, from which a bigger map is suggested */
+#define DROP_THRESHOLD		1
+
+struct result_read {
+	int			fd;
+	char			*buf;
+	size_t			size;
+	size_t			start;
+	size_t			end;
+	bool			eof;
+	bool			error;
+};
+
+/* Returns the next line without its '\n', or NULL at the end or on error */
+static char *read_line(struct result_read *r)
+{
+	char *line;
+	char *nl;
+	char *buf;
+	ssize_t n;
+
+	for (;;) {
+		line = r->buf + r->start;
+		nl = memchr(line, '\n', r->end - r->start);
+		if (nl) {
+			*nl = '\0';
+			r->start = nl - r->buf + 1;
+			return line;
+		}
+		if (r->eof) {
+			if (r->start == r->end)
+				return NULL;
+			/* The last line without its '\n' */
+			r->buf[r->end] = '\0';
+			r->start = r->end;
+			return line;
+		}
+
+		/* Keep the partial line, and make room after it */
+		memmove(r->buf, line, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+		if (r->end + 1 >= r->size) {
+			buf = realloc(r->buf, r->size * 2);
+			if (!buf) {
+				r->error = true;
+				return NULL;
+			}
+			r->buf = buf;
+			r->size *= 2;
+		}
+
+		do {
+			n = read(r->fd, r->buf + r->end, r->size - r->end - 1);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			r->error = true;
+			return NULL;
+		}
+		if (!n)
+			r->eof = true;
+		r->end += n;
+	}
+}
+
+static int result_init(struct result_read *r)
+{
+	r->size = RESULT_BUF_SIZE;
+	r->buf = malloc(r->size);
+	if (!r->buf)
+		return -1;
+	return 0;
+}
+
+static int result_open(struct result_read *r, const char *trace_dir,
+		       const char *path)
+{
+	char *file;
+
+	if (asprintf(&file, "%s/%s", trace_dir, path) < 0)
+		return -1;
+	r->fd = open(file, O_RDONLY);
+	free(file);
+	if (r->fd < 0)
+		return -1;
+
+	return result_init(r);
+}
+
+static void result_close(struct result_read *r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r->buf);
+}
+
+/* The part of @hist from ":@name" to the next ':', like "keys=pid" */
+static char *hist_part(const char *hist, const char *name)
+{
+	const char *p;
+
+	p = strstr(hist, name);
+	if (!p || p == hist || p[-1] != ':')
+		return NULL;
+
+	return strndup(p, strcspn(p, ": "));
+}
+
+/**
+ * sqlhist_result_hist - the trigger of the histogram with the rows
+ * @sqlhist: The compiled statement
+ *
+ * Returns the trigger whose section of sqlhist_result_path() has the
+ * rows of @sqlhist, or NULL if they are not in a histogram.
+ */
+const char *sqlhist_result_hist(struct sqlhist *sqlhist)
+{
+	const char *result = sqlhist_result_path(sqlhist);
+	const char *paths[] = {
+		sqlhist_synth_hist_path(sqlhist),
+		sqlhist_end_path(sqlhist),
+		sqlhist_start_path(sqlhist),
+	};
+	const char *hists[] = {
+		sqlhist_synth_hist(sqlhist),
+		sqlhist_end_hist(sqlhist),
+		sqlhist_start_hist(sqlhist),
+	};
+	size_t len;
+	int i;
+
+	if (!result)
+		return NULL;
+
+	/* "events/sched/sched_switch/" of ".../trigger" and ".../hist" */
+	for (i = 0; i < 3; i++) {
+		if (!paths[i] || !hists[i])
+			continue;
+		len = strrchr(paths[i], '/') - paths[i] + 1;
+		if (strncmp(paths[i], result, len) == 0 && !strchr(result + len, '/'))
+			return hists[i];
+	}
+
+	return NULL;
+}
+
+static bool has_part(const char *line, const char *part)
+{
+	const char *p;
+	size_t len;
+
+	if (!part)
+		return true;
+
+	len = strlen(part);
+	for (p = line; (p = strstr(p, part)); p++) {
+		if (p[-1] == ':' && (p[len] == ':' || p[len] == ' ' || !p[len]))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * The kernel shows the trigger in its own words, but the keys and the
+ * sort come out as they went in.
+ */
+static bool is_our_section(const char *line, const char *keys,
+			   const char *sort)
+{
+	line = strstr(line, "trigger info: ");
+	if (!line)
+		return false;
+
+	return has_part(line, keys) && has_part(line, sort);
+}
+
+/*
+ * Several statements may have a histogram with the same keys on the
+ * same event, but then they differ in their filter, which the kernel
+ * shows after the trigger as it went in, followed by " [active]".
+ */
+static bool is_trigger_section(const char *line, const char *hist,
+			       const char *keys, const char *sort)
+{
+	const char *filter;
+	const char *shown;
+	size_t len;
+
+	if (!is_our_section(line, keys, sort))
+		return false;
+	if (!hist)
+		return true;
+
+	filter = strstr(hist, " if ");
+	shown = strstr(line, " if ");
+	if (!filter || !shown)
+		return !filter && !shown;
+
+	len = strlen(filter);
+	return strncmp(shown, filter, len) == 0 &&
+		(shown[len] == ' ' || !shown[len]);
+}
+
+/**
+ * sqlhist_print_top - print the rows of an installed statement
+ * @sqlhist: The compiled statement, installed in sqlhist_trace_dir()
+ * @fp: Where to print the rows
+ *
+ * Prints the entries of the histogram with the rows of @sqlhist (see
+ * sqlhist_result_path()), as the kernel shows them, in the order of
+ * its ORDER BY. With a LIMIT of n (see sqlhist_limit()), only the first
+ * n are printed, and the hist file is not read any further than that.
+ *
+ * Returns the number of entries printed, or -1 with errno set.
+ */
+int sqlhist_print_top(struct sqlhist *sqlhist, FILE *fp)
+{
+	unsigned long long limit = sqlhist_limit(sqlhist);
+	struct result_read r = { .fd = -1 };
+	const char *trace_dir = sqlhist_trace_dir(sqlhist);
+	const char *path = sqlhist_result_path(sqlhist);
+	const char *hist;
+	bool found = false;
+	char *keys = NULL;
+	char *sort = NULL;
+	char *line;
+	int cnt = 0;
+	int ret = -1;
+
+	if (!trace_dir || !path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hist = sqlhist_result_hist(sqlhist);
+	if (hist) {
+		keys = hist_part(hist, "keys=");
+		sort = hist_part(hist, "sort=");
+	}
+
+	if (result_open(&r, trace_dir, path) < 0)
+		goto out;
+
+	while ((line = read_line(&r))) {
+		if (!found) {
+			found = line[0] == '#' &&
+				is_trigger_section(line, hist, keys, sort);
+			continue;
+		}
+		if (strncmp(line, "Totals:", 7) == 0)
+			break;
+		if (line[0] == '{') {
+			if (limit && cnt == limit)
+				break;
+			cnt++;
+		} else if (!cnt) {
+			/* The rest of the header */
+			continue;
+		} else if (!line[0] || line[0] == '#') {
+			break;
+		}
+		fprintf(fp, "%s\n", line);
+	}
+	if (r.error)
+		goto out;
+	if (!found) {
+		errno = ENOENT;
+		goto out;
+	}
+
+	ret = cnt;
+ out:
+	result_close(&r);
+	free(keys);
+	free(sort);
+	return ret;
+}
+
+/*
+ * The row iterator parses the entries in place in the read buffer:
+ * every delimiter is found with memchr() or memmem(), which go through
+ * the buffer a vector at a time, and the columns point into the line.
+ */
+struct sqlhist_result {
+	struct result_read	r;
+	char			*cols_buf;
+	char			**fields;
+	char			**names;
+	int			nr_names;
+	struct sqlhist_col	*cols;
+	int			max_cols;
+	char			*entry;
+	size_t			entry_len;
+	size_t			entry_size;
+	unsigned long long	limit;
+	unsigned long long	cnt;
+	bool			in_rows;
+	bool			done;
+};
+
+/* Splits sqlhist_result_cols() into the fields and their names */
+static int result_names(struct sqlhist_result *result, const char *cols)
+{
+	char *col, *save;
+	char *eq;
+	int nr = 1;
+	int i;
+
+	if (!cols || !*cols)
+		return 0;
+
+	for (i = 0; cols[i]; i++)
+		nr += cols[i] == ',';
+
+	result->cols_buf = strdup(cols);
+	result->fields = calloc(nr, sizeof(*result->fields));
+	result->names = calloc(nr, sizeof(*result->names));
+	if (!result->cols_buf || !result->fields || !result->names)
+		return -1;
+
+	for (col = strtok_r(result->cols_buf, ",", &save); col;
+	     col = strtok_r(NULL, ",", &save)) {
+		eq = strchr(col, '=');
+		if (!eq)
+			continue;
+		*eq = '\0';
+		result->fields[result->nr_names] = col;
+		result->names[result->nr_names++] = eq + 1;
+	}
+	return 0;
+}
+
+/* The columns are mostly where they were in the row before */
+static const char *col_name(struct sqlhist_result *result, int idx,
+			    const char *field)
+{
+	int i;
+
+	if (idx < result->nr_names && strcmp(result->fields[idx], field) == 0)
+		return result->names[idx];
+
+	for (i = 0; i < result->nr_names; i++) {
+		if (strcmp(result->fields[i], field) == 0)
+			return result->names[i];
+	}
+	return field;
+}
+
+/* "123", "~ 100-199" for buckets, "~ 2^7" for log2, "0x1f" for hex */
+static unsigned long long col_val(const char *str)
+{
+	unsigned long long shift;
+
+	if (str[0] == '~' && str[1] == ' ')
+		str += 2;
+	if (str[0] == '2' && str[1] == '^') {
+		shift = strtoull(str + 2, NULL, 10);
+		return shift < 64 ? 1ULL << shift : 0;
+	}
+	if (str[0] == '0' && str[1] == 'x')
+		return strtoull(str, NULL, 16);
+
+	if (*str < '0' || *str > '9')
+		return 0;
+	return strtoull(str, NULL, 10);
+}
+
+static int add_col(struct sqlhist_result *result, int idx, char *field,
+		   char *str)
+{
+	struct sqlhist_col *cols;
+
+	if (idx == result->max_cols) {
+		cols = realloc(result->cols, sizeof(*cols) * (idx + 8));
+		if (!cols)
+			return -1;
+		result->cols = cols;
+		result->max_cols = idx + 8;
+	}
+
+	result->cols[idx].name = col_name(result, idx, field);
+	result->cols[idx].str = str;
+	result->cols[idx].val = col_val(str);
+	return 0;
+}
+
+/* ", name:" starts the next key */
+static bool is_next_key(const char *p, const char *end)
+{
+	if (p >= end || *p++ != ' ')
+		return false;
+	while (p < end && (isalnum((unsigned char)*p) || *p == '_' || *p == '.' || *p == '$'))
+		p++;
+	return p < end && *p == ':';
+}
+
+static char *trim_end(char *str, char *end)
+{
+	while (end > str && (end[-1] == ' ' || end[-1] == '\n'))
+		end--;
+	*end = '\0';
+	return str;
+}
+
+/*
+ * An entry is "{ key: value, key: value } hitcount: n  field: n ...".
+ * The hitcount always comes right after the keys, so that is what ends
+ * them, whatever their strings hold. A stacktrace value keeps its lines,
+ * without the ones around it. Returns the number of columns.
+ */
+static int parse_row(struct sqlhist_result *result, char *line)
+{
+	char *end = line + strlen(line);
+	char *keys_end;
+	char *field;
+	char *str;
+	char *p, *q;
+	int nr = 0;
+
+	for (keys_end = line; (keys_end = memchr(keys_end, '}', end - keys_end));
+	     keys_end++) {
+		if (strncmp(keys_end, "} hitcount:", 11) == 0)
+			break;
+	}
+	if (!keys_end) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (p = line + 1; p < keys_end; p = q + 1) {
+		p += strspn(p, " ");
+		q = memchr(p, ':', keys_end - p);
+		if (!q)
+			break;
+		*q = '\0';
+		field = p;
+		str = q + 1;
+		str += strspn(str, " \n");
+		for (q = str; (q = memchr(q, ',', keys_end - q)); q++) {
+			if (is_next_key(q + 1, keys_end))
+				break;
+		}
+		if (!q)
+			q = keys_end;
+		if (add_col(result, nr++, field, trim_end(str, q)) < 0)
+			return -1;
+	}
+
+	for (p = keys_end + 2; p < end; p = q + 1) {
+		p += strspn(p, " ");
+		q = memchr(p, ':', end - p);
+		if (!q)
+			break;
+		*q = '\0';
+		field = p;
+		str = q + 1;
+		str += strspn(str, " ");
+		q = memchr(str, ' ', end - str);
+		if (!q)
+			q = end;
+		*q = '\0';
+		if (add_col(result, nr++, field, str) < 0)
+			return -1;
+	}
+
+	return nr;
+}
+
+static int add_entry_line(struct sqlhist_result *result, const char *line)
+{
+	size_t len = strlen(line);
+	size_t size;
+	char *entry;
+
+	/* The line, its '\n' and the '\0' */
+	if (result->entry_len + len + 2 > result->entry_size) {
+		size = (result->entry_len + len + 2) * 2;
+		entry = realloc(result->entry, size);
+		if (!entry)
+			return -1;
+		result->entry = entry;
+		result->entry_size = size;
+	}
+
+	if (result->entry_len)
+		result->entry[result->entry_len++] = '\n';
+	memcpy(result->entry + result->entry_len, line, len + 1);
+	result->entry_len += len;
+	return 0;
+}
+
+/*
+ * Returns the entry that starts with @line. That is the line itself,
+ * unless a key goes on over more lines (a stacktrace): those are copied
+ * out of the read buffer, which the next read may move, and joined up
+ * to the one with the "} hitcount:".
+ */
+static char *read_entry(struct sqlhist_result *result, char *line)
+{
+	if (strstr(line, "} hitcount:"))
+		return line;
+
+	result->entry_len = 0;
+	do {
+		if (add_entry_line(result, line) < 0)
+			return NULL;
+		line = read_line(&result->r);
+		if (!line || !line[0] || line[0] == '{' || line[0] == '#') {
+			if (!result->r.error)
+				errno = EINVAL;
+			return NULL;
+		}
+	} while (!strstr(line, "} hitcount:"));
+
+	if (add_entry_line(result, line) < 0)
+		return NULL;
+	return result->entry;
+}
+
+/**
+ * sqlhist_result_open_fd - read the rows of a statement from a hist file
+ * @sqlhist: The compiled statement
+ * @fd: The hist file (or a copy of it) opened for reading
+ *
+ * Like sqlhist_result_open(), but reads the rows from @fd, which is then
+ * closed by sqlhist_result_close(), or right away on failure.
+ *
+ * Returns the rows to read with sqlhist_result_next(), or NULL with
+ * errno set (ENOENT if @fd has no section with the rows of @sqlhist).
+ */
+struct sqlhist_result *sqlhist_result_open_fd(struct sqlhist *sqlhist, int fd)
+{
+	struct sqlhist_result *result;
+	const char *hist;
+	char *keys = NULL;
+	char *sort = NULL;
+	char *line;
+
+	result = calloc(1, sizeof(*result));
+	if (!result) {
+		close(fd);
+		return NULL;
+	}
+	result->r.fd = fd;
+	result->limit = sqlhist_limit(sqlhist);
+
+	hist = sqlhist_result_hist(sqlhist);
+	if (!hist) {
+		errno = EINVAL;
+		goto fail;
+	}
+	keys = hist_part(hist, "keys=");
+	sort = hist_part(hist, "sort=");
+
+	if (result_init(&result->r) < 0 ||
+	    result_names(result, sqlhist_result_cols(sqlhist)) < 0)
+		goto fail;
+
+	while ((line = read_line(&result->r))) {
+		if (line[0] == '#' &&
+		    is_trigger_section(line, hist, keys, sort))
+			break;
+	}
+	if (!line) {
+		if (!result->r.error)
+			errno = ENOENT;
+		goto fail;
+	}
+
+	free(keys);
+	free(sort);
+	return result;
+ fail:
+	free(keys);
+	free(sort);
+	sqlhist_result_close(result);
+	return NULL;
+}
+
+/**
+ * sqlhist_result_open - read the rows of an installed statement
+ * @sqlhist: The compiled statement, installed in sqlhist_trace_dir()
+ *
+ * Opens the hist file with the rows of @sqlhist (see
+ * sqlhist_result_path()), to read them one at a time with
+ * sqlhist_result_next(). The file is read as the rows are, so even a
+ * big histogram is never all in memory.
+ *
+ * Returns the rows, to be freed with sqlhist_result_close(), or NULL
+ * with errno set.
+ */
+struct sqlhist_result *sqlhist_result_open(struct sqlhist *sqlhist)
+{
+	const char *trace_dir = sqlhist_trace_dir(sqlhist);
+	const char *path = sqlhist_result_path(sqlhist);
+	char *file;
+	int fd;
+
+	if (!trace_dir || !path) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (asprintf(&file, "%s/%s", trace_dir, path) < 0)
+		return NULL;
+	fd = open(file, O_RDONLY);
+	free(file);
+	if (fd < 0)
+		return NULL;
+
+	return sqlhist_result_open_fd(sqlhist, fd);
+}
+
+/**
+ * sqlhist_result_next - read the next row
+ * @result: The rows from sqlhist_result_open()
+ * @cols: Set to the columns of the row
+ *
+ * Reads the next row, in the order of the ORDER BY of the statement,
+ * and up to its LIMIT. Each column has the name it was selected as
+ * (see sqlhist_result_cols()), its value as the kernel shows it, and
+ * that as a number, if it is one. A column that the statement did not
+ * select, like the hitcount without a COUNT(*), has the name the kernel
+ * gives it. The columns are only valid until the next call.
+ *
+ * Returns the number of columns, 0 after the last row, or -1 with
+ * errno set.
+ */
+int sqlhist_result_next(struct sqlhist_result *result,
+			struct sqlhist_col **cols)
+{
+	char *line;
+	int nr;
+
+	if (result->done || (result->limit && result->cnt == result->limit))
+		return 0;
+
+	while ((line = read_line(&result->r))) {
+		if (line[0] == '{') {
+			result->in_rows = true;
+			result->cnt++;
+			line = read_entry(result, line);
+			if (!line) {
+				result->done = true;
+				return -1;
+			}
+			nr = parse_row(result, line);
+			*cols = result->cols;
+			return nr;
+		}
+		if (strncmp(line, "Totals:", 7) == 0)
+			break;
+		/* The end of the section; before the rows, its header */
+		if (result->in_rows && (!line[0] || line[0] == '#'))
+			break;
+	}
+
+	result->done = true;
+	return result->r.error ? -1 : 0;
+}
+
+/**
+ * sqlhist_result_close - stop reading the rows
+ * @result: The rows from sqlhist_result_open()
+ */
+void sqlhist_result_close(struct sqlhist_result *result)
+{
+	if (!result)
+		return;
+
+	result_close(&result->r);
+	free(result->cols_buf);
+	free(result->fields);
+	free(result->names);
+	free(result->cols);
+	free(result->entry);
+	free(result);
+}
+
+struct hist_totals {
+	unsigned long long	hits;
+	unsigned long long	entries;
+	unsigned long long	dropped;
+};
+
+/* The Totals: of the section of @hist in the hist file next to @path */
+static int read_totals(const char *trace_dir, const char *path,
+		       const char *hist, struct hist_totals *totals)
+{
+	struct result_read r = { .fd = -1 };
+	bool in_totals = false;
+	bool found = false;
+	char *keys = NULL;
+	char *sort = NULL;
+	char *file;
+	char *line;
+	int ret = -1;
+
+	/* ".../trigger" to ".../hist" */
+	if (asprintf(&file, "%.*shist", (int)(strrchr(path, '/') + 1 - path),
+		     path) < 0)
+		return -1;
+
+	memset(totals, 0, sizeof(*totals));
+	keys = hist_part(hist, "keys=");
+	sort = hist_part(hist, "sort=");
+
+	if (result_open(&r, trace_dir, file) < 0)
+		goto out;
+
+	while ((line = read_line(&r))) {
+		if (!found) {
+			found = line[0] == '#' &&
+				is_trigger_section(line, hist, keys, sort);
+			continue;
+		}
+		if (!in_totals) {
+			in_totals = strncmp(line, "Totals:", 7) == 0;
+			continue;
+		}
+
+		line += strspn(line, " \t");
+		if (strncmp(line, "Hits: ", 6) == 0)
+			totals->hits = strtoull(line + 6, NULL, 10);
+		else if (strncmp(line, "Entries: ", 9) == 0)
+			totals->entries = strtoull(line + 9, NULL, 10);
+		else if (strncmp(line, "Dropped: ", 9) == 0)
+			totals->dropped = strtoull(line + 9, NULL, 10);
+		else
+			break;
+	}
+	if (r.error)
+		goto out;
+	if (!in_totals) {
+		errno = ENOENT;
+		goto out;
+	}
+
+	ret = 0;
+ out:
+	result_close(&r);
+	free(file);
+	free(keys);
+	free(sort);
+	return ret;
+}
+
+/* What part of the SELECT a histogram comes from */
+static const char *span_role(enum sqlhist_span_type type)
+{
+	switch (type) {
+	case SQLHIST_SPAN_START:
+		return "FROM";
+	case SQLHIST_SPAN_END:
+		return "JOIN";
+	case SQLHIST_SPAN_SYNTH_HIST:
+		return "SELECT over the joined rows";
+	default:
+		return NULL;
+	}
+}
+
+static void analyze_hist(struct sqlhist_span *span, const char *hist,
+			 struct hist_totals *before, struct hist_totals *after,
+			 unsigned int secs, FILE *fp, int *over)
+{
+	unsigned long long size = DEFAULT_HIST_SIZE;
+	unsigned long long bigger;
+	unsigned long long hits;
+	unsigned long long dropped;
+	const char *p;
+
+	/* Reinstalled in between, so it counted from zero again */
+	if (after->hits < before->hits)
+		memset(before, 0, sizeof(*before));
+	hits = after->hits - before->hits;
+	dropped = after->dropped - before->dropped;
+
+	p = strstr(hist, ":size=");
+	if (p)
+		size = strtoull(p + 6, NULL, 0);
+
+	fprintf(fp, "%s (%s)\n", span->path, span_role(span->type));
+	fprintf(fp, "    %s\n", hist);
+
+	/* Without an interval, everything since it was installed */
+	if (!secs) {
+		hits = after->hits;
+		dropped = after->dropped;
+		fprintf(fp, "    hits: %llu\n", hits);
+	} else {
+		fprintf(fp, "    hits: %llu in %u secs, %.1f a second\n",
+			hits, secs, (double)hits / secs);
+	}
+	fprintf(fp, "    entries: %llu of %llu, %.1f%% full\n",
+		after->entries, size, 100.0 * after->entries / size);
+	fprintf(fp, "    dropped: %llu, %.2f%% of the hits\n", dropped,
+		hits ? 100.0 * dropped / hits : 0.0);
+
+	if (!dropped || dropped * 1000 < hits * DROP_THRESHOLD)
+		return;
+
+	(*over)++;
+	if (size >= HIST_SIZE_MAX) {
+		fprintf(fp, "  warning: the map is full at the largest size, filter out more of the events\n");
+		return;
+	}
+	for (bigger = size * 2; bigger < HIST_SIZE_MAX &&
+		     bigger < after->entries + dropped; bigger *= 2)
+		;
+	fprintf(fp, "  warning: the map is full, recompile WITH (size = %llu)\n",
+		bigger);
+}
+
+/**
+ * sqlhist_analyze - report how the installed triggers of a statement do
+ * @sqlhist: The compiled statement, installed in sqlhist_trace_dir()
+ * @secs: The seconds to count the hits for, or 0 for all of them so far
+ * @fp: Where to write the report
+ *
+ * Reads the Hits:, Entries: and Dropped: totals of every histogram of
+ * @sqlhist out of the hist file of its event, and reports for each the
+ * part of the SELECT it comes from, the rate of its event, how full its
+ * map is, and how many hits it dropped. With @secs, the totals are read
+ * @secs seconds apart, and only the hits in between are counted.
+ *
+ * A histogram that dropped more than DROP_THRESHOLD per thousand of its
+ * hits is warned about, with the size to recompile the statement with.
+ *
+ * Returns the number of histograms that dropped too many hits, or -1
+ * with errno set.
+ */
+int sqlhist_analyze(struct sqlhist *sqlhist, unsigned int secs, FILE *fp)
+{
+	const char *trace_dir = sqlhist_trace_dir(sqlhist);
+	struct hist_totals *before = NULL;
+	struct hist_totals *after = NULL;
+	struct sqlhist_span *spans;
+	char **hists = NULL;
+	int nr_spans;
+	int over = 0;
+	int ret = -1;
+	int i;
+
+	nr_spans = sqlhist_spans(sqlhist, NULL, 0);
+	if (nr_spans < 0 || !trace_dir) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	spans = calloc(nr_spans, sizeof(*spans));
+	hists = calloc(nr_spans, sizeof(*hists));
+	before = calloc(nr_spans, sizeof(*before));
+	after = calloc(nr_spans, sizeof(*after));
+	if (!spans || !hists || !before || !after)
+		goto out;
+	sqlhist_spans(sqlhist, spans, nr_spans);
+
+	for (i = 0; i < nr_spans; i++) {
+		if (!span_role(spans[i].type))
+			continue;
+		hists[i] = strndup(spans[i].iov.iov_base, spans[i].iov.iov_len);
+		if (!hists[i] ||
+		    read_totals(trace_dir, spans[i].path, hists[i], &before[i]) < 0)
+			goto out;
+	}
+
+	if (secs) {
+		sleep(secs);
+		for (i = 0; i < nr_spans; i++) {
+			if (hists[i] &&
+			    read_totals(trace_dir, spans[i].path, hists[i],
+					&after[i]) < 0)
+				goto out;
+		}
+	} else {
+		memcpy(after, before, nr_spans * sizeof(*after));
+	}
+
+	for (i = 0; i < nr_spans; i++) {
+		if (hists[i])
+			analyze_hist(&spans[i], hists[i], &before[i], &after[i],
+				     secs, fp, &over);
+	}
+
+	ret = over;
+ out:
+	for (i = 0; hists && i < nr_spans; i++)
+		free(hists[i]);
+	free(hists);
+	free(spans);
+	free(before);
+	free(after);
+	return ret;
+}
@@ -0,0 +1,918 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "sqlhist.h"
+#include "sqlhist-parse.h"
+#include "sqlhist-local.h"
+
+/*
+ * Sharing histograms between the statements of a batch.
+ *
+ * Every join saves what it needs of its start event in a histogram of
+ * its own, so ten latencies from sched_waking keyed on pid mean ten map
+ * lookups on every wakeup. The start histograms of joins on the same
+ * event with the same keys and filter are folded into the first one,
+ * which then does the lookup once for all of them. Each statement still
+ * saves its own variables there, even of a field that another one
+ * saves too: an end histogram reads a variable of another histogram
+ * once, which resets it, and the others would never see it.
+ *
+ * The kernel looks up a variable by its name in all the histograms of
+ * an event, and refuses one that another histogram there already
+ * defines, but every statement names its variables __arg0__ and up,
+ * and its latencies "lat" and the like. The variables that clash are
+ * renamed in the bound tables of the statements, which are then
+ * emitted again with the shared start histograms and the new names.
+ *
+ * A start histogram that would have more variables than the kernel
+ * allows is not shared.
+ */
+
+/* A join, whose start histogram may be shared */
+struct share_table {
+	struct sqlhist		*sqlhist;
+	struct sql_table	*table;
+	const char		*event;
+	/* The variables of the start histogram, with those of its sharers */
+	int			nr_vars;
+};
+
+/* A variable defined on an event so far */
+struct share_var {
+	const char		*event;
+	const char		*name;
+};
+
+static bool is_join_start(struct sql_table *table)
+{
+	return table->to && table->from_event.event && !table->from_event.table;
+}
+
+static bool same_keys(struct sql_table *a, struct sql_table *b)
+{
+	struct match_map *x = a->matches;
+	struct match_map *y = b->matches;
+
+	for (; x && y; x = x->next, y = y->next) {
+		if (strcmp(x->from_key, y->from_key) != 0)
+			return false;
+	}
+	return !x && !y;
+}
+
+/* Compares what print_compare() would print of @a and @b */
+static const char *compare_field(struct expression *e)
+{
+	return e->event ? e->field : e->raw;
+}
+
+static bool same_compare(struct expression *a, struct expression *b)
+{
+	struct expression *x = a->B;
+	struct expression *y = b->B;
+
+	return strcmp(compare_field(a->A), compare_field(b->A)) == 0 &&
+		strcmp(a->op, b->op) == 0 &&
+		x->type == y->type &&
+		strcmp((char *)x->A, (char *)y->A) == 0;
+}
+
+static bool same_cond(struct expression *a, struct expression *b)
+{
+	if (!a || !b)
+		return a == b;
+	if (a->type != b->type)
+		return false;
+
+	switch (a->type) {
+	case EXPR_AND:
+	case EXPR_OR:
+		return same_cond(a->A, b->A) && same_cond(a->B, b->B);
+	case EXPR_NOT:
+		return same_cond(a->A, b->A);
+	case EXPR_FILTER:
+		return same_compare(a, b);
+	default:
+		return false;
+	}
+}
+
+static bool can_share(struct share_table *root, struct share_table *start)
+{
+	struct sql_table *a = root->table;
+	struct sql_table *b = start->table;
+
+	return root->sqlhist != start->sqlhist && !a->shared_start &&
+		strcmp(root->event, start->event) == 0 &&
+		same_keys(a, b) &&
+		same_cond(a->from_event.filter, b->from_event.filter) &&
+		root->nr_vars + start->nr_vars <= SQLHIST_MAX_VARS;
+}
+
+static void share_start(struct share_table *root, struct share_table *start)
+{
+	struct sql_table **sharer;
+
+	/* In the order of the statements */
+	for (sharer = &root->table->sharers; *sharer;
+	     sharer = &(*sharer)->next_sharer)
+		;
+	*sharer = start->table;
+	start->table->shared_start = root->table;
+	root->nr_vars += start->nr_vars;
+}
+
+static int get_starts(struct sqlhist **sqlhists, int nr,
+		      struct share_table **starts, int *nr_starts)
+{
+	struct share_table *start;
+	struct table_map *tmap;
+	struct sql_table *table;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!sqlhists[i] || !sqlhists[i]->sb)
+			continue;
+		for (tmap = sqlhists[i]->sb->table_list; tmap; tmap = tmap->next) {
+			table = tmap->table;
+			if (!is_join_start(table))
+				continue;
+			start = realloc(*starts, sizeof(*start) * (*nr_starts + 1));
+			if (!start)
+				return -1;
+			*starts = start;
+			start += (*nr_starts)++;
+			start->sqlhist = sqlhists[i];
+			start->table = table;
+			start->event = sqlhist_event_key(table, &table->from_event);
+			start->nr_vars = table->nr_start_vars;
+			if (!start->event)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static bool is_defined(struct share_var *defined, int nr, const char *event,
+		       const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (strcmp(defined[i].name, name) == 0 &&
+		    strcmp(defined[i].event, event) == 0)
+			return true;
+	}
+	return false;
+}
+
+static int add_rename(struct sql_table *table, const char *name, int *nr_fresh)
+{
+	struct var_rename *rename;
+
+	rename = arena_alloc(table->sb, sizeof(*rename));
+	if (!rename)
+		return -1;
+	rename->name = name;
+	rename->var = store_printf(table->sb, "__share%d__", (*nr_fresh)++);
+	if (!rename->var)
+		return -1;
+	rename->next = table->renames;
+	table->renames = rename;
+
+	return 0;
+}
+
+/*
+ * Renames the variables of @table whose names a histogram of a table
+ * before it already defines on the same event, and adds them to
+ * @defined. Returns 1 if any was renamed, 0 if not, or -1 on error.
+ */
+static int rename_clashes(struct sql_table *table, struct share_var **defined,
+			  int *nr_defined, int *nr_fresh)
+{
+	struct share_var *def;
+	struct hist_var *var;
+	const char *name;
+	int ret = 0;
+
+	for (var = table->hist_vars; var; var = var->next) {
+		name = sqlhist_var_name(table, var->name);
+		if (is_defined(*defined, *nr_defined, var->event, name)) {
+			if (add_rename(table, var->name, nr_fresh) < 0)
+				return -1;
+			name = sqlhist_var_name(table, var->name);
+			ret = 1;
+		}
+
+		def = realloc(*defined, sizeof(*def) * (*nr_defined + 1));
+		if (!def)
+			return -1;
+		*defined = def;
+		def += (*nr_defined)++;
+		def->event = var->event;
+		def->name = name;
+	}
+	return ret;
+}
+
+/**
+ * sqlhist_share_starts - share the start histograms of statements
+ * @sqlhists: The compiled statements
+ * @nr: The number of @sqlhists
+ *
+ * Folds the start histograms of the joins of @sqlhists that are on the
+ * same event with the same keys and filter into the first of them,
+ * where each of them still saves its own variables. The variables of
+ * all the histograms on an event are renamed where their names clash,
+ * and the statements are emitted again, so they must be installed
+ * together (see sqlhist_apply_list()). A statement whose only start
+ * histogram was folded away has no sqlhist_start_hist() of its own.
+ * Only statements from sqlhist_parse_catalog() that compiled are
+ * shared, while the catalog is still open.
+ *
+ * Returns the number of histograms that are no longer needed, or -1 on
+ * error (in which case the statements may be partly changed).
+ */
+int sqlhist_share_starts(struct sqlhist **sqlhists, int nr)
+{
+	struct share_table *starts = NULL;
+	struct share_var *defined = NULL;
+	struct table_map *tmap;
+	struct sqlhist *sqlhist;
+	bool *changed = NULL;
+	int nr_defined = 0;
+	int nr_starts = 0;
+	int nr_fresh = 0;
+	int folded = 0;
+	int ret = -1;
+	int i, j;
+
+	changed = calloc(nr, sizeof(*changed));
+	if (!changed)
+		goto out;
+
+	if (get_starts(sqlhists, nr, &starts, &nr_starts) < 0)
+		goto out;
+
+	for (i = 0; i < nr_starts; i++) {
+		for (j = 0; j < i; j++) {
+			if (!can_share(&starts[j], &starts[i]))
+				continue;
+			share_start(&starts[j], &starts[i]);
+			folded++;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		sqlhist = sqlhists[i];
+		if (!sqlhist || !sqlhist->sb)
+			continue;
+		for (tmap = sqlhist->sb->table_list; tmap; tmap = tmap->next) {
+			if (tmap->table->shared_start || tmap->table->sharers)
+				changed[i] = true;
+			switch (rename_clashes(tmap->table, &defined,
+					       &nr_defined, &nr_fresh)) {
+			case -1:
+				goto out;
+			case 1:
+				changed[i] = true;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (changed[i] && sqlhist_emit(sqlhists[i]) < 0)
+			goto out;
+	}
+
+	ret = folded;
+ out:
+	free(changed);
+	free(defined);
+	free(starts);
+
+	return ret;
+}
+
+/*
+ * Folding families of plain histograms.
+ *
+ * Generated queries often come in families that only differ in a
+ * constant, like one per pid (WHERE next_pid == 1234), and each of them
+ * is a histogram of its own on the same event. Histograms that are the
+ * same but for one "field == constant" of their filter are folded into
+ * one that is keyed on that field as well, with a filter that only lets
+ * the wanted constants through. The rows of each statement are the
+ * ones with its constant, given by sqlhist_fold_key() and
+ * sqlhist_fold_value().
+ */
+
+/* A histogram of a statement, and what it is to be replaced with */
+struct trigger {
+	enum sqlhist_str	hists;
+	const char		*hist;
+	const char		*path;
+	char			*new_hist;
+	bool			removed;
+};
+
+struct share_stmt {
+	struct sqlhist		*sqlhist;
+	struct trigger		*triggers;
+	int			nr_triggers;
+	/* The other strings that are to be set */
+	char			*strs[SQLHIST_NR_STRS];
+	bool			changed;
+};
+
+/* The lists of histograms, with the paths that go with them */
+static const enum sqlhist_str trigger_strs[][2] = {
+	{ SQLHIST_STAGE_START_HISTS,	SQLHIST_STAGE_START_PATHS },
+	{ SQLHIST_START_HIST,		SQLHIST_START_PATH },
+	{ SQLHIST_STAGE_END_HISTS,	SQLHIST_STAGE_END_PATHS },
+	{ SQLHIST_END_HIST,		SQLHIST_END_PATH },
+};
+
+#define NR_TRIGGER_STRS	(sizeof(trigger_strs) / sizeof(trigger_strs[0]))
+
+static bool is_word_char(char c)
+{
+	return isalnum(c) || c == '_';
+}
+
+static int get_triggers(struct share_stmt *stmt)
+{
+	struct sqlhist *sqlhist = stmt->sqlhist;
+	const char *hist, *path, *end;
+	struct trigger *t;
+	size_t i;
+
+	for (i = 0; i < NR_TRIGGER_STRS; i++) {
+		hist = sqlhist->strs[trigger_strs[i][0]];
+		path = sqlhist->strs[trigger_strs[i][1]];
+		if (!hist || !path)
+			continue;
+
+		/* The lists have a '\0' after each but the last */
+		end = hist + sqlhist->lens[trigger_strs[i][0]];
+		for (; hist <= end; hist += strlen(hist) + 1,
+			     path += strlen(path) + 1) {
+			t = realloc(stmt->triggers,
+				    sizeof(*t) * (stmt->nr_triggers + 1));
+			if (!t)
+				return -1;
+			stmt->triggers = t;
+			t += stmt->nr_triggers++;
+			memset(t, 0, sizeof(*t));
+			t->hists = trigger_strs[i][0];
+			t->hist = hist;
+			t->path = path;
+		}
+	}
+	return 0;
+}
+
+/* Writes the strings of @stmt into a new output, with the new triggers */
+static bool is_trigger_str(enum sqlhist_str str)
+{
+	size_t i;
+
+	for (i = 0; i < NR_TRIGGER_STRS; i++) {
+		if (trigger_strs[i][0] == str || trigger_strs[i][1] == str)
+			return true;
+	}
+	return false;
+}
+
+static int rewrite(struct share_stmt *stmt)
+{
+	struct sqlhist *sqlhist = stmt->sqlhist;
+	ssize_t offs[SQLHIST_NR_STRS];
+	size_t lens[SQLHIST_NR_STRS];
+	enum sqlhist_str str;
+	struct trigger *t;
+	char *buf = NULL;
+	bool first;
+	size_t size;
+	long start;
+	FILE *fp;
+	size_t i;
+	int j, k;
+
+	fp = open_memstream(&buf, &size);
+	if (!fp)
+		return -1;
+
+	for (i = 0; i < SQLHIST_NR_STRS; i++) {
+		offs[i] = -1;
+		if (is_trigger_str(i))
+			continue;
+		if (stmt->strs[i]) {
+			offs[i] = ftell(fp);
+			lens[i] = strlen(stmt->strs[i]);
+		} else if (sqlhist->strs[i]) {
+			offs[i] = ftell(fp);
+			lens[i] = sqlhist->lens[i];
+		} else {
+			continue;
+		}
+		fwrite(stmt->strs[i] ? : sqlhist->strs[i], 1, lens[i] + 1, fp);
+	}
+
+	for (i = 0; i < NR_TRIGGER_STRS; i++) {
+		for (k = 0; k < 2; k++) {
+			str = trigger_strs[i][k];
+			start = ftell(fp);
+			first = true;
+			for (j = 0; j < stmt->nr_triggers; j++) {
+				t = &stmt->triggers[j];
+				if (t->hists != trigger_strs[i][0] || t->removed)
+					continue;
+				if (!first)
+					fputc('\0', fp);
+				first = false;
+				if (k)
+					fputs(t->path, fp);
+				else
+					fputs(t->new_hist ? t->new_hist : t->hist, fp);
+			}
+			if (first)
+				continue;
+			offs[str] = start;
+			lens[str] = ftell(fp) - start;
+			fputc('\0', fp);
+		}
+	}
+
+	if (fclose(fp) || !buf) {
+		free(buf);
+		return -1;
+	}
+
+	for (i = 0; i < SQLHIST_NR_STRS; i++) {
+		sqlhist->strs[i] = offs[i] < 0 ? NULL : buf + offs[i];
+		sqlhist->lens[i] = offs[i] < 0 ? 0 : lens[i];
+	}
+	free(sqlhist->output);
+	sqlhist->output = buf;
+
+	return 0;
+}
+
+static void put_stmts(struct share_stmt *stmts, int nr)
+{
+	int i, j;
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < stmts[i].nr_triggers; j++)
+			free(stmts[i].triggers[j].new_hist);
+		free(stmts[i].triggers);
+		for (j = 0; j < SQLHIST_NR_STRS; j++)
+			free(stmts[i].strs[j]);
+	}
+	free(stmts);
+}
+
+static struct share_stmt *get_stmts(struct sqlhist **sqlhists, int nr)
+{
+	struct share_stmt *stmts;
+	int i;
+
+	stmts = calloc(nr, sizeof(*stmts));
+	if (!stmts)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		stmts[i].sqlhist = sqlhists[i];
+		if (!sqlhist_start_event(sqlhists[i]))
+			continue;
+		if (get_triggers(&stmts[i]) < 0) {
+			put_stmts(stmts, i + 1);
+			return NULL;
+		}
+	}
+
+	return stmts;
+}
+
+static int rewrite_stmts(struct share_stmt *stmts, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (stmts[i].changed && rewrite(&stmts[i]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+struct fold_hist {
+	struct share_stmt	*stmt;
+	struct trigger		*trigger;
+	/* The histogram up to its filter, without the size */
+	char			*head;
+	unsigned long long	size;
+	/* The filter, split at its top level "&&"s */
+	char			**conds;
+	int			nr_conds;
+	/* The condition that the family differs in, or -1 */
+	int			cond;
+	struct fold_hist	*folded;
+	/* The constants of the family, in the first of it */
+	char			**values;
+	int			nr_values;
+};
+
+static int add_str(char ***strs, int *nr, const char *str, size_t len)
+{
+	char **s;
+
+	s = realloc(*strs, sizeof(*s) * (*nr + 1));
+	if (!s)
+		return -1;
+	*strs = s;
+	s[*nr] = strndup(str, len);
+	if (!s[*nr])
+		return -1;
+	(*nr)++;
+	return 0;
+}
+
+static void free_strs(char **strs, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		free(strs[i]);
+	free(strs);
+}
+
+static int split_conds(struct fold_hist *fold, const char *filter)
+{
+	const char *p = filter;
+	bool quote = false;
+	int depth = 0;
+
+	for (; *p; p++) {
+		if (*p == '"')
+			quote = !quote;
+		if (quote)
+			continue;
+		if (*p == '(')
+			depth++;
+		else if (*p == ')')
+			depth--;
+		else if (!depth && strncmp(p, " && ", 4) == 0) {
+			if (add_str(&fold->conds, &fold->nr_conds,
+				    filter, p - filter) < 0)
+				return -1;
+			filter = p + 4;
+			p += 3;
+		}
+	}
+
+	return add_str(&fold->conds, &fold->nr_conds, filter, p - filter);
+}
+
+/* Returns 1 if @fold can be folded, 0 if not, or -1 on error */
+static int parse_fold(struct fold_hist *fold)
+{
+	const char *hist = fold->trigger->hist;
+	const char *filter;
+	const char *size;
+	const char *end;
+
+	fold->cond = -1;
+
+	if (strncmp(hist, "hist:keys=", 10) != 0)
+		return 0;
+
+	/* Sorted rows, or a maximum, of more than one would mix */
+	if (strstr(hist, ":sort=") || strstr(hist, ":onmax("))
+		return 0;
+
+	filter = strstr(hist, " if ");
+	if (!filter)
+		return 0;
+
+	size = strstr(hist, ":size=");
+	if (size && size < filter) {
+		fold->size = strtoull(size + 6, (char **)&end, 10);
+		if (end != filter && *end != ':')
+			return 0;
+		if (asprintf(&fold->head, "%.*s%.*s", (int)(size - hist), hist,
+			     (int)(filter - end), end) < 0)
+			return -1;
+	} else {
+		fold->head = strndup(hist, filter - hist);
+		if (!fold->head)
+			return -1;
+	}
+
+	if (split_conds(fold, filter + 4) < 0)
+		return -1;
+
+	return 1;
+}
+
+/* "field == value": returns the length of the field, or 0 */
+static size_t eq_field(const char *cond)
+{
+	const char *eq = strstr(cond, " == ");
+	const char *p;
+
+	if (!eq || eq == cond)
+		return 0;
+	for (p = cond; p < eq; p++) {
+		if (!is_word_char(*p) && *p != '.')
+			return 0;
+	}
+	for (p = eq + 4; *p; p++) {
+		if (*p == '"')
+			break;
+		if (*p == ' ' || *p == '(' || *p == ')')
+			return 0;
+	}
+	return eq - cond;
+}
+
+static const char *eq_value(const char *cond)
+{
+	return strstr(cond, " == ") + 4;
+}
+
+/* The one condition @a and @b differ in, -1 for none, or -2 for more */
+static int diff_conds(struct fold_hist *a, struct fold_hist *b)
+{
+	int diff = -1;
+	int i;
+
+	if (a->nr_conds != b->nr_conds)
+		return -2;
+
+	for (i = 0; i < a->nr_conds; i++) {
+		if (strcmp(a->conds[i], b->conds[i]) == 0)
+			continue;
+		if (diff >= 0)
+			return -2;
+		diff = i;
+	}
+	return diff;
+}
+
+static int fold_into(struct fold_hist *family, struct fold_hist *fold)
+{
+	const char *cond;
+	size_t len;
+	int diff;
+	int i;
+
+	if (strcmp(family->trigger->path, fold->trigger->path) ||
+	    strcmp(family->head, fold->head))
+		return 0;
+
+	diff = diff_conds(family, fold);
+	if (diff == -1)
+		diff = family->cond;
+	if (diff < 0 || (family->cond >= 0 && diff != family->cond))
+		return 0;
+
+	len = eq_field(family->conds[diff]);
+	if (!len || len != eq_field(fold->conds[diff]) ||
+	    strncmp(family->conds[diff], fold->conds[diff], len) != 0)
+		return 0;
+
+	if (family->cond < 0) {
+		family->cond = diff;
+		cond = family->conds[diff];
+		if (add_str(&family->values, &family->nr_values,
+			    eq_value(cond), strlen(eq_value(cond))) < 0)
+			return -1;
+	}
+
+	cond = eq_value(fold->conds[diff]);
+	for (i = 0; i < family->nr_values; i++) {
+		if (strcmp(family->values[i], cond) == 0)
+			break;
+	}
+	if (i == family->nr_values &&
+	    add_str(&family->values, &family->nr_values, cond, strlen(cond)) < 0)
+		return -1;
+
+	fold->folded = family;
+	fold->cond = diff;
+	fold->trigger->removed = true;
+	fold->stmt->changed = true;
+
+	return 1;
+}
+
+static bool has_key(const char *keys, const char *field, size_t len)
+{
+	const char *p;
+
+	for (p = keys; *p; p++) {
+		if (strncmp(p, field, len) == 0 &&
+		    (p[len] == ',' || p[len] == ':' || !p[len]))
+			return true;
+		p += strcspn(p, ",:");
+		if (*p != ',')
+			break;
+	}
+	return false;
+}
+
+static unsigned long long fold_size(unsigned long long size, int nr)
+{
+	unsigned long long entries = size * nr;
+
+	for (size = HIST_SIZE_MIN; size < entries && size < HIST_SIZE_MAX; )
+		size <<= 1;
+	return size;
+}
+
+static char *print_fold(struct fold_hist *family)
+{
+	const char *field = family->conds[family->cond];
+	size_t len = eq_field(field);
+	const char *keys;
+	char *buf = NULL;
+	size_t size;
+	FILE *fp;
+	int i;
+
+	fp = open_memstream(&buf, &size);
+	if (!fp)
+		return NULL;
+
+	keys = family->head + 10;
+	if (has_key(keys, field, len))
+		fputs(family->head, fp);
+	else
+		fprintf(fp, "hist:keys=%.*s,%s", (int)len, field, keys);
+	if (family->size)
+		fprintf(fp, ":size=%llu",
+			fold_size(family->size, family->nr_values));
+
+	fputs(" if ", fp);
+	for (i = 0; i < family->nr_conds; i++) {
+		if (i != family->cond)
+			fprintf(fp, "%s && ", family->conds[i]);
+	}
+	fputc('(', fp);
+	for (i = 0; i < family->nr_values; i++)
+		fprintf(fp, "%s%.*s == %s", i ? " || " : "",
+			(int)len, field, family->values[i]);
+	fputc(')', fp);
+	fclose(fp);
+
+	return buf;
+}
+
+/* Where the rows of @fold are, and which they are */
+static int set_fold_strs(struct fold_hist *fold, struct fold_hist *family)
+{
+	struct share_stmt *stmt = fold->stmt;
+	const char *cond = fold->conds[family->cond];
+	const char *value = eq_value(cond);
+	size_t len = strlen(value);
+
+	/* The value as it is shown, without the quotes of a string */
+	if (*value == '"' && len > 1) {
+		value++;
+		len -= 2;
+	}
+
+	stmt->strs[SQLHIST_FOLD_PATH] = strdup(family->trigger->path);
+	stmt->strs[SQLHIST_FOLD_KEY] = strndup(cond, eq_field(cond));
+	stmt->strs[SQLHIST_FOLD_VALUE] = strndup(value, len);
+	if (!stmt->strs[SQLHIST_FOLD_PATH] || !stmt->strs[SQLHIST_FOLD_KEY] ||
+	    !stmt->strs[SQLHIST_FOLD_VALUE])
+		return -1;
+	stmt->changed = true;
+
+	return 0;
+}
+
+static unsigned long long mul_entries(unsigned long long entries, int nr)
+{
+	if (entries > ULLONG_MAX / nr)
+		return ULLONG_MAX;
+	return entries * nr;
+}
+
+/**
+ * sqlhist_fold_filters - fold histograms that differ in a constant
+ * @sqlhists: The compiled statements
+ * @nr: The number of @sqlhists
+ *
+ * Folds the histograms of @sqlhists without a join that are on the
+ * same event, and only differ in the constant of one "field == constant"
+ * of their filters, into the first of them. That one is keyed on the
+ * field as well, and its filter lets through all of the constants.
+ * Every statement of such a family gets the histogram that its rows are
+ * in (sqlhist_fold_path()), and the key and value of those rows
+ * (sqlhist_fold_key() and sqlhist_fold_value()). The others no longer
+ * have a sqlhist_start_hist() of their own. Statements that did not
+ * compile are skipped.
+ *
+ * Returns the number of histograms that are no longer needed, or -1 on
+ * error (in which case the statements may be partly changed).
+ */
+int sqlhist_fold_filters(struct sqlhist **sqlhists, int nr)
+{
+	struct fold_hist *folds = NULL;
+	struct fold_hist *fold;
+	struct share_stmt *stmts;
+	struct trigger *t;
+	int nr_folds = 0;
+	int folded = 0;
+	int ret = -1;
+	int i, j;
+
+	stmts = get_stmts(sqlhists, nr);
+	if (!stmts)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		/* Only a plain histogram, without a join */
+		if (stmts[i].nr_triggers != 1 ||
+		    stmts[i].triggers[0].hists != SQLHIST_START_HIST)
+			continue;
+		t = &stmts[i].triggers[0];
+
+		fold = realloc(folds, sizeof(*fold) * (nr_folds + 1));
+		if (!fold)
+			goto out;
+		folds = fold;
+		fold += nr_folds++;
+		memset(fold, 0, sizeof(*fold));
+		fold->stmt = &stmts[i];
+		fold->trigger = t;
+
+		switch (parse_fold(fold)) {
+		case -1:
+			goto out;
+		case 0:
+			fold->folded = fold;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr_folds; i++) {
+		if (folds[i].folded)
+			continue;
+		for (j = 0; j < i; j++) {
+			if (folds[j].folded)
+				continue;
+			ret = fold_into(&folds[j], &folds[i]);
+			if (ret < 0)
+				goto out;
+			if (ret) {
+				folded++;
+				break;
+			}
+		}
+	}
+	ret = -1;
+
+	for (i = 0; i < nr_folds; i++) {
+		fold = &folds[i];
+		if (fold->folded == fold || fold->cond < 0)
+			continue;
+		if (set_fold_strs(fold, fold->folded ? : fold) < 0)
+			goto out;
+		if (fold->folded)
+			continue;
+		fold->trigger->new_hist = print_fold(fold);
+		if (!fold->trigger->new_hist)
+			goto out;
+		fold->stmt->sqlhist->max_entries =
+			mul_entries(fold->stmt->sqlhist->max_entries,
+				    fold->nr_values);
+	}
+
+	if (rewrite_stmts(stmts, nr) < 0)
+		goto out;
+
+	ret = folded;
+ out:
+	for (i = 0; i < nr_folds; i++) {
+		free(folds[i].head);
+		free_strs(folds[i].conds, folds[i].nr_conds);
+		free_strs(folds[i].values, folds[i].nr_values);
+	}
+	free(folds);
+	put_stmts(stmts, nr);
+
+	return ret;
+}
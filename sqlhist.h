@@ -1,7 +1,12 @@
 #ifndef __SQLHIST_H
 #define __SQLHIST_H
 
+#include <stdio.h>
+#include <sys/uio.h>
+
 struct sqlhist;
+struct sqlhist_catalog;
+struct sqlhist_cache;
 
 const char *sqlhist_start_event(struct sqlhist *sqlhist);
 const char *sqlhist_end_event(struct sqlhist *sqlhist);
@@ -10,15 +15,94 @@ const char *sqlhist_synth_event_def(struct sqlhist *sqlhist);
 const char *sqlhist_start_hist(struct sqlhist *sqlhist);
 const char *sqlhist_end_hist(struct sqlhist *sqlhist);
 const char *sqlhist_synth_filter(struct sqlhist *sqlhist);
+const char *sqlhist_synth_filter_path(struct sqlhist *sqlhist);
+const char *sqlhist_synth_hist(struct sqlhist *sqlhist);
+const char *sqlhist_synth_hist_path(struct sqlhist *sqlhist);
 const char *sqlhist_start_path(struct sqlhist *sqlhist);
 const char *sqlhist_end_path(struct sqlhist *sqlhist);
+const char *sqlhist_fold_path(struct sqlhist *sqlhist);
+const char *sqlhist_fold_key(struct sqlhist *sqlhist);
+const char *sqlhist_fold_value(struct sqlhist *sqlhist);
+const char *sqlhist_result_path(struct sqlhist *sqlhist);
+const char *sqlhist_result_hist(struct sqlhist *sqlhist);
+const char *sqlhist_result_cols(struct sqlhist *sqlhist);
+
+unsigned long long sqlhist_limit(struct sqlhist *sqlhist);
+unsigned long long sqlhist_max_entries(struct sqlhist *sqlhist);
 
 const char *sqlhist_trace_dir(struct sqlhist *sqlhist);
 const char *sqlhist_error(struct sqlhist *sqlhist);
 
+enum sqlhist_span_type {
+	SQLHIST_SPAN_SYNTH,
+	SQLHIST_SPAN_FILTER,
+	SQLHIST_SPAN_SYNTH_HIST,
+	SQLHIST_SPAN_START,
+	SQLHIST_SPAN_END,
+};
+
+/* One command to write to @path (relative to the tracefs directory) */
+struct sqlhist_span {
+	enum sqlhist_span_type	type;
+	const char		*path;
+	struct iovec		iov;
+};
+
+int sqlhist_spans(struct sqlhist *sqlhist, struct sqlhist_span *spans, int nr);
+
+/* TRACING_MAP_VARS_MAX: the variables the kernel takes in a histogram */
+#define SQLHIST_MAX_VARS	16
+
+int sqlhist_span_vars(const struct sqlhist_span *span);
+
 struct sqlhist *sqlhist_parse(const char *buffer, const char *trace_dir);
+struct sqlhist *sqlhist_parse_catalog(const char *buffer,
+				      struct sqlhist_catalog *catalog);
 int sqlhist_lex_it(void);
 
 void sqlhist_destroy(struct sqlhist *sqlhist);
 
+/* Install into a plain directory standing in for tracefs, for tests */
+#define SQLHIST_APPLY_DIR	(1 << 0)
+
+int sqlhist_apply(struct sqlhist *sqlhist);
+int sqlhist_apply_list(struct sqlhist **sqlhists, int nr);
+int sqlhist_apply_list_flags(struct sqlhist **sqlhists, int nr,
+			     unsigned int flags);
+
+int sqlhist_print_top(struct sqlhist *sqlhist, FILE *fp);
+
+struct sqlhist_result;
+
+/* One column of a row, valid until the next sqlhist_result_next() */
+struct sqlhist_col {
+	const char		*name;
+	const char		*str;
+	unsigned long long	val;
+};
+
+struct sqlhist_result *sqlhist_result_open(struct sqlhist *sqlhist);
+struct sqlhist_result *sqlhist_result_open_fd(struct sqlhist *sqlhist, int fd);
+int sqlhist_result_next(struct sqlhist_result *result,
+			struct sqlhist_col **cols);
+void sqlhist_result_close(struct sqlhist_result *result);
+int sqlhist_analyze(struct sqlhist *sqlhist, unsigned int secs, FILE *fp);
+int sqlhist_explain(struct sqlhist *sqlhist, struct sqlhist_catalog *catalog,
+		    FILE *fp);
+
+int sqlhist_share_starts(struct sqlhist **sqlhists, int nr);
+int sqlhist_fold_filters(struct sqlhist **sqlhists, int nr);
+
+struct sqlhist_catalog *sqlhist_catalog_open(const char *trace_dir,
+					     const char *file);
+void sqlhist_catalog_close(struct sqlhist_catalog *catalog);
+
+struct sqlhist_cache *sqlhist_cache_open(const char *dir);
+void sqlhist_cache_close(struct sqlhist_cache *cache);
+struct sqlhist *sqlhist_cache_parse(struct sqlhist_cache *cache,
+				    const char *buffer, const char *trace_dir,
+				    struct sqlhist_catalog *catalog);
+void sqlhist_cache_stats(struct sqlhist_cache *cache, unsigned long *hits,
+			 unsigned long *misses);
+
 #endif
@@ -41,20 +41,27 @@ extern void yyerror(struct sqlhist_bison *, char *fmt, ...);
 	void	*expr;
 }
 
-%token AS SELECT FROM JOIN ON WHERE
-%token <string> STRING VARIABLE
+%token AS SELECT FROM JOIN ON WHERE AND OR NOT
+%token <string> BUCKET LOG2 WITH GROUP BY COUNT DISTINCT SUM MIN MAX
+%token <string> ORDER LIMIT ASC DESC
+%token <string> STRING VARIABLE QUOTED
 %token <string> LE GE EQ NEQ TILDA
 
+%left OR
+%left AND
+%right NOT
 %left '+' '-'
 %left '*' '/'
 %left '<' '>'
 
-%type <string> name field label
+%type <string> name field label keyword
 %type <string> selection_list table_exp selection_item
 %type <string> from_clause select_statement
-%type <string> where_clause compare
+%type <string> where_clause
+%type <s32>    opt_direction
 
-%type <expr>  selection_expr item named_field join_clause
+%type <expr>  selection_expr item named_field join_clause join_list
+%type <expr>  condition compare value function
 %type <expr>  opt_join_clause
 
 %%
@@ -72,8 +79,9 @@ select_name :
 			}
  ;
 
+/* Without AS, a keyword after an item starts the next clause */
 label : AS name { CHECK_RETURN_PTR($$ = store_printf(sb, "%s", $2)); }
- | name
+ | STRING
  ;
 
 select : SELECT  { table_start(sb); }
@@ -126,6 +134,12 @@ selection_expr :
 					CHECK_RETURN_PTR($$);
 				}
  | item
+ | function
+ | function label
+			{
+				CHECK_RETURN_VAL(add_expr($2, $1));
+				CHECK_RETURN_PTR($$ = $1);
+			}
  | '(' selection_expr ')' { $$ = $2; CHECK_RETURN_PTR($$); }
  | '(' selection_expr ')' label
 			{
@@ -134,6 +148,44 @@ selection_expr :
 			}
  ;
 
+function :
+   BUCKET '(' selection_expr ',' STRING ')'
+			{
+				$$ = add_bucket(sb, $3, $5);
+				CHECK_RETURN_PTR($$);
+			}
+ | LOG2 '(' selection_expr ')'
+			{
+				$$ = add_log2(sb, $3);
+				CHECK_RETURN_PTR($$);
+			}
+ | COUNT '(' '*' ')'
+			{
+				$$ = add_aggregate(sb, EXPR_COUNT, NULL);
+				CHECK_RETURN_PTR($$);
+			}
+ | COUNT '(' DISTINCT field ')'
+			{
+				$$ = add_aggregate(sb, EXPR_COUNT_DISTINCT, $4);
+				CHECK_RETURN_PTR($$);
+			}
+ | SUM '(' field ')'
+			{
+				$$ = add_aggregate(sb, EXPR_SUM, $3);
+				CHECK_RETURN_PTR($$);
+			}
+ | MIN '(' field ')'
+			{
+				$$ = add_aggregate(sb, EXPR_MIN, $3);
+				CHECK_RETURN_PTR($$);
+			}
+ | MAX '(' field ')'
+			{
+				$$ = add_aggregate(sb, EXPR_MAX, $3);
+				CHECK_RETURN_PTR($$);
+			}
+ ;
+
 item :
    named_field 
  | field		{ $$ = add_field(sb, $1, NULL); CHECK_RETURN_PTR($$); }
@@ -142,6 +194,7 @@ item :
 field :
    STRING
  | VARIABLE
+ | keyword
  ;
 
 named_field :
@@ -150,25 +203,59 @@ named_field :
 
 name :
    STRING
+ | keyword
+ ;
+
+/* Tracepoints have fields such as "count", so these are only keywords in context */
+keyword :
+   BUCKET
+ | LOG2
+ | WITH
+ | GROUP
+ | BY
+ | COUNT
+ | DISTINCT
+ | SUM
+ | MIN
+ | MAX
+ | ORDER
+ | LIMIT
+ | ASC
+ | DESC
+ ;
+
+value :
+   field		{ $$ = add_value(sb, $1); CHECK_RETURN_PTR($$); }
+ | QUOTED		{ $$ = add_string(sb, $1); CHECK_RETURN_PTR($$); }
  ;
 
 compare :
-   field '<' field	{ $$ = add_filter(sb, $1, $3, "<"); CHECK_RETURN_PTR($$); }
- | field '>' field	{ $$ = add_filter(sb, $1, $3, ">"); CHECK_RETURN_PTR($$); }
- | field LE field	{ $$ = add_filter(sb, $1, $3, "<="); CHECK_RETURN_PTR($$); }
- | field GE field	{ $$ = add_filter(sb, $1, $3, ">="); CHECK_RETURN_PTR($$); }
- | field '=' field	{ $$ = add_filter(sb, $1, $3, "=="); CHECK_RETURN_PTR($$); }
- | field EQ field	{ $$ = add_filter(sb, $1, $3, "=="); CHECK_RETURN_PTR($$); }
- | field NEQ field	{ $$ = add_filter(sb, $1, $3, "!="); CHECK_RETURN_PTR($$); }
- | field '&' field	{ $$ = add_filter(sb, $1, $3, "&"); CHECK_RETURN_PTR($$); }
- | field '~' field	{ $$ = add_filter(sb, $1, $3, "~"); CHECK_RETURN_PTR($$); }
+   field '<' value	{ $$ = add_filter(sb, $1, $3, "<"); CHECK_RETURN_PTR($$); }
+ | field '>' value	{ $$ = add_filter(sb, $1, $3, ">"); CHECK_RETURN_PTR($$); }
+ | field LE value	{ $$ = add_filter(sb, $1, $3, "<="); CHECK_RETURN_PTR($$); }
+ | field GE value	{ $$ = add_filter(sb, $1, $3, ">="); CHECK_RETURN_PTR($$); }
+ | field '=' value	{ $$ = add_filter(sb, $1, $3, "=="); CHECK_RETURN_PTR($$); }
+ | field EQ value	{ $$ = add_filter(sb, $1, $3, "=="); CHECK_RETURN_PTR($$); }
+ | field NEQ value	{ $$ = add_filter(sb, $1, $3, "!="); CHECK_RETURN_PTR($$); }
+ | field '&' value	{ $$ = add_filter(sb, $1, $3, "&"); CHECK_RETURN_PTR($$); }
+ | field '~' value	{ $$ = add_filter(sb, $1, $3, "~"); CHECK_RETURN_PTR($$); }
 ;
 
+condition :
+   compare
+ | condition AND condition
+			{ $$ = add_and(sb, $1, $3); CHECK_RETURN_PTR($$); }
+ | condition OR condition
+			{ $$ = add_or(sb, $1, $3); CHECK_RETURN_PTR($$); }
+ | NOT condition	{ $$ = add_not(sb, $2); CHECK_RETURN_PTR($$); }
+ | '(' condition ')'	{ $$ = $2; }
+ ;
+
 where_clause :
-   WHERE compare {
+   WHERE condition {
 	   $$ = store_printf(sb, " WHERE %s", show_expr($2));
 	   CHECK_RETURN_PTR($$);
-	   add_where($2);
+	   add_where(sb, $2);
    }
  ;
 
@@ -177,8 +264,50 @@ opt_where_clause :
  | where_clause
 ;
 
+group_list :
+   field		{ CHECK_RETURN_VAL(add_group_by(sb, $1)); }
+ | group_list ',' field	{ CHECK_RETURN_VAL(add_group_by(sb, $3)); }
+ ;
+
+opt_group_by :
+   /* empty */
+ | GROUP BY group_list
+ ;
+
+opt_direction :
+   /* empty */		{ $$ = 0; }
+ | ASC			{ $$ = 0; }
+ | DESC			{ $$ = 1; }
+ ;
+
+opt_order_by :
+   /* empty */
+ | ORDER BY field opt_direction
+			{ CHECK_RETURN_VAL(add_order_by(sb, $3, $4)); }
+ ;
+
+opt_limit :
+   /* empty */
+ | LIMIT STRING		{ CHECK_RETURN_VAL(add_limit(sb, $2)); }
+ ;
+
+option :
+   name '=' STRING	{ CHECK_RETURN_VAL(add_option(sb, $1, $3)); }
+ ;
+
+option_list :
+   option
+ | option_list ',' option
+ ;
+
+opt_with :
+   /* empty */
+ | WITH '(' option_list ')'
+ ;
+
 table_exp :
-   from_clause opt_join_clause opt_where_clause
+   from_clause opt_join_clause opt_where_clause opt_group_by opt_order_by
+   opt_limit opt_with
  ;
 
 from_clause :
@@ -188,29 +317,30 @@ from_clause :
 					$$ = store_printf(sb, "FROM %s", show_expr($2));
 					CHECK_RETURN_PTR($$);
 				}
-/*
- * Select from a from clause confuses the variable parsing.
- * disable it for now.
-
-   | FROM '(' select_statement ')' label
+ | FROM '(' select_statement ')' label
 				{
-					from_table_end($5);
-					$$ = store_printf("FROM (%s) AS %s", $3, $5);
+					CHECK_RETURN_VAL(from_table_end(sb, $5));
+					$$ = store_printf(sb, "FROM (%s) AS %s", $3, $5);
+					CHECK_RETURN_PTR($$);
 				}
-*/
  ;
 
 join_clause :
   JOIN item ON match_clause	{
-					add_to(sb, $2);
+					CHECK_RETURN_VAL(add_to(sb, $2));
 					$$ = store_printf(sb, "TO %s",
 							  show_expr($2));
 				}
  ;
 
+join_list :
+   join_clause
+ | join_list join_clause
+ ;
+
 opt_join_clause :
   /* empty */		{ $$ = NULL; }
- | join_clause
+ | join_list
 ;
 
 match :
@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+# Installs each tests/*.txt sample with "sqlhist -a -d" into a plain
+# directory holding a copy of the event formats, and checks that it
+# writes the same commands as the script sqlhist prints. Then it does
+# the same with the last file made unwritable, and checks that the
+# rollback removed everything that was written.
+#
+# usage: tests/test-apply.sh [sqlhist [tracefs-path]]
+
+SQLHIST=${1:-./sqlhist}
+TRACEFS=${2:-/sys/kernel/tracing}
+TESTS=$(dirname "$0")
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+failed=0
+
+fail() {
+	echo "FAIL: $*"
+	failed=$((failed + 1))
+}
+
+# A fresh directory with only the event formats of $TRACEFS
+copy_formats() {
+	rm -rf "$1"
+	mkdir -p "$1"
+	(cd "$TRACEFS" && find events -name format -o -name 'header_*') |
+	while read -r f; do
+		mkdir -p "$1/$(dirname "$f")"
+		cat "$TRACEFS/$f" > "$1/$f"
+	done
+}
+
+# What the kernel makes for each synthetic event that is defined
+synth_dirs() {
+	sed -n "s/^echo '\([^ ]*\) .*' >>\{0,1\} synthetic_events\$/\1/p" "$tmp/cmds" |
+	while read -r name; do
+		mkdir -p "$1/events/synthetic/$name"
+	done
+}
+
+# The files the commands were written to
+written() {
+	(cd "$1" && find . -type f ! -name format ! -name 'header_*' | sort)
+}
+
+# Every command that was written is removed again
+rolled_back() {
+	case "$2" in
+	*/filter)
+		[ "$(tail -n 1 "$1/$2")" = 0 ] ;;
+	*synthetic_events)
+		awk '/^!/ { undo[substr($1, 2)]++; next }
+		     { done[$1]++ }
+		     END { for (n in done) if (undo[n] != done[n]) exit 1 }' "$1/$2" ;;
+	*)
+		awk '/^!/ { undo[substr($0, 2)]++; next }
+		     { done[$0]++ }
+		     END { for (c in done) if (undo[c] != done[c]) exit 1 }' "$1/$2" ;;
+	esac
+}
+
+for test in "$TESTS"/*.txt; do
+	opt=
+	grep -q ';' "$test" && opt=-b
+
+	copy_formats "$tmp/script"
+	"$SQLHIST" -t "$tmp/script" $opt -f "$test" > "$tmp/cmds" 2>/dev/null ||
+		continue
+	grep -q '^# failed to compile' "$tmp/cmds" && continue
+
+	# Plain files do not append on their own, as tracefs files do
+	sed "s/' > \([^ ]*\)\$/' >> \1/" "$tmp/cmds" > "$tmp/cmds.sh"
+	synth_dirs "$tmp/script"
+	(cd "$tmp/script" && sh -e "$tmp/cmds.sh") ||
+		{ fail "$test: running the printed commands"; continue; }
+
+	copy_formats "$tmp/apply"
+	synth_dirs "$tmp/apply"
+	if ! "$SQLHIST" -t "$tmp/apply" $opt -a -d -f "$test" > /dev/null 2>&1; then
+		fail "$test: -a"
+		continue
+	fi
+
+	if [ "$(written "$tmp/apply")" != "$(written "$tmp/script")" ]; then
+		fail "$test: -a wrote other files than the printed commands"
+		continue
+	fi
+	for f in $(written "$tmp/apply"); do
+		sort "$tmp/apply/$f" > "$tmp/a"
+		sort "$tmp/script/$f" > "$tmp/b"
+		cmp -s "$tmp/a" "$tmp/b" ||
+			fail "$test: $f differs from the printed commands"
+	done
+
+	# The end histograms go in last; make the last one fail
+	last=$(sed -n "s/.*' >>\{0,1\} \([^ ]*trigger\)\$/\1/p" "$tmp/cmds" | tail -n 1)
+	[ -n "$last" ] || continue
+	copy_formats "$tmp/rollback"
+	synth_dirs "$tmp/rollback"
+	mkdir "$tmp/rollback/$last"
+	if "$SQLHIST" -t "$tmp/rollback" $opt -a -d -f "$test" > /dev/null 2>&1; then
+		fail "$test: -a did not fail on an unwritable $last"
+		continue
+	fi
+	for f in $(written "$tmp/rollback"); do
+		rolled_back "$tmp/rollback" "$f" ||
+			fail "$test: $f was not rolled back"
+	done
+done
+
+if [ $failed -ne 0 ]; then
+	echo "$failed failed"
+	exit 1
+fi
+echo "all passed"
@@ -9,12 +9,31 @@ struct tep_handle {
 
 struct tep_format_field {
 	char		*type;
+	char		*name;
+	int		offset;
+	int		size;
+	unsigned long	flags;
+};
+
+enum tep_format_flags {
+	TEP_FIELD_IS_ARRAY	= 1,
+	TEP_FIELD_IS_POINTER	= 2,
+	TEP_FIELD_IS_SIGNED	= 4,
+	TEP_FIELD_IS_STRING	= 8,
+	TEP_FIELD_IS_DYNAMIC	= 16,
 };
 
 struct tep_event {
+	char		*name;
 	char		*system;
 };
 
+enum tep_event_sort_type {
+	TEP_EVENT_SORT_ID,
+	TEP_EVENT_SORT_NAME,
+	TEP_EVENT_SORT_SYSTEM,
+};
+
 static inline struct tep_handle *
  tracefs_local_events(const char *dir)
 {
@@ -22,6 +41,51 @@ static inline struct tep_handle *
 	return NULL;
 }
 
+static inline const char *tracefs_tracing_dir(void)
+{
+	errno = ENODEV;
+	return NULL;
+}
+
+static inline struct tep_handle *tep_alloc(void)
+{
+	errno = ENODEV;
+	return NULL;
+}
+
+static inline void tep_free(struct tep_handle *tep)
+{
+}
+
+static inline int tep_parse_event(struct tep_handle *tep, const char *buf,
+				  unsigned long size, const char *sys)
+{
+	return -1;
+}
+
+static inline int tep_get_events_count(struct tep_handle *tep)
+{
+	return 0;
+}
+
+static inline struct tep_event **
+ tep_list_events(struct tep_handle *tep, enum tep_event_sort_type sort_type)
+{
+	return NULL;
+}
+
+static inline struct tep_format_field **
+ tep_event_common_fields(struct tep_event *event)
+{
+	return NULL;
+}
+
+static inline struct tep_format_field **
+ tep_event_fields(struct tep_event *event)
+{
+	return NULL;
+}
+
 static inline struct tep_event *
  tep_find_event_by_name(struct tep_handle *tep, const char *system, const char *event)
 {